@@ -16,6 +16,7 @@
 
 #include "em_status.h"
 #include "em_app_log.h"
+#include "em_data_channels.h"
 
 #include <gst/gstelement.h>
 #include <gst/gstobject.h>
@@ -45,7 +46,11 @@ struct _EmConnection
 
 	GstPipeline *pipeline;
 	GstElement *webrtcbin;
-	GstWebRTCDataChannel *datachannel;
+
+	/// Created by the server, the control one is used for any that it did not create.
+	GstWebRTCDataChannel *tracking_channel;
+	GstWebRTCDataChannel *frame_channel;
+	GstWebRTCDataChannel *control_channel;
 
 	enum em_status status;
 };
@@ -305,7 +310,9 @@ emconn_disconnect_internal(EmConnection *emconn, enum em_status status)
 	g_clear_object(&emconn->ws);
 
 	gst_clear_object(&emconn->webrtcbin);
-	gst_clear_object(&emconn->datachannel);
+	gst_clear_object(&emconn->tracking_channel);
+	gst_clear_object(&emconn->frame_channel);
+	gst_clear_object(&emconn->control_channel);
 	gst_clear_object(&emconn->pipeline);
 	emconn_update_status(emconn, status);
 }
@@ -358,18 +365,37 @@ emconn_webrtc_prepare_data_channel_cb(GstElement *webrtc,
 	g_signal_connect(data_channel, "on-message-string", G_CALLBACK(emconn_data_channel_message_string_cb), emconn);
 }
 
+static void
+emconn_webrtc_on_new_transceiver_cb(GstElement *webrtcbin, GstWebRTCRTPTransceiver *transceiver, EmConnection *emconn)
+{
+	// Lets the jitterbuffer ask the server to retransmit lost packets, its latency is set by the stream client.
+	g_object_set(transceiver, "do-nack", TRUE, NULL);
+}
+
 static void
 emconn_webrtc_on_data_channel_cb(GstElement *webrtcbin, GstWebRTCDataChannel *data_channel, EmConnection *emconn)
 {
+	gchar *label = NULL;
+	g_object_get(data_channel, "label", &label, NULL);
 
-	ALOGI("Successfully created datachannel");
+	ALOGI("Successfully created datachannel %s", label);
 
-	g_assert_null(emconn->datachannel);
+	if (g_strcmp0(label, EM_DATA_CHANNEL_TRACKING) == 0) {
+		g_assert_null(emconn->tracking_channel);
+		emconn->tracking_channel = GST_WEBRTC_DATA_CHANNEL(g_object_ref(data_channel));
+	} else if (g_strcmp0(label, EM_DATA_CHANNEL_FRAME) == 0) {
+		g_assert_null(emconn->frame_channel);
+		emconn->frame_channel = GST_WEBRTC_DATA_CHANNEL(g_object_ref(data_channel));
+	} else {
+		// An older server only has the one channel, which takes everything.
+		g_assert_null(emconn->control_channel);
+		emconn->control_channel = GST_WEBRTC_DATA_CHANNEL(g_object_ref(data_channel));
 
-	emconn->datachannel = GST_WEBRTC_DATA_CHANNEL(data_channel);
+		emconn_update_status(emconn, EM_STATUS_CONNECTED);
+		g_signal_emit(emconn, signals[SIGNAL_CONNECTED], 0);
+	}
 
-	emconn_update_status(emconn, EM_STATUS_CONNECTED);
-	g_signal_emit(emconn, signals[SIGNAL_CONNECTED], 0);
+	g_free(label);
 }
 
 void
@@ -609,6 +635,8 @@ em_connection_set_pipeline(EmConnection *emconn, GstPipeline *pipeline)
 	g_signal_connect(emconn->webrtcbin, "prepare-data-channel", G_CALLBACK(emconn_webrtc_prepare_data_channel_cb),
 	                 emconn);
 	g_signal_connect(emconn->webrtcbin, "on-data-channel", G_CALLBACK(emconn_webrtc_on_data_channel_cb), emconn);
+	g_signal_connect(emconn->webrtcbin, "on-new-transceiver", G_CALLBACK(emconn_webrtc_on_new_transceiver_cb),
+	                 emconn);
 	g_signal_connect(emconn->webrtcbin, "deep-notify::connection-state",
 	                 G_CALLBACK(emconn_webrtc_deep_notify_callback), emconn);
 }
@@ -673,14 +701,24 @@ em_connection_disconnect(EmConnection *emconn)
 }
 
 bool
-em_connection_send_bytes(EmConnection *emconn, GBytes *bytes)
+em_connection_send_bytes(EmConnection *emconn, enum em_connection_channel channel, GBytes *bytes)
 {
 	if (emconn->status != EM_STATUS_CONNECTED) {
 		ALOGW("RYLIE: Cannot send bytes when status is %s", em_status_to_string(emconn->status));
 		return false;
 	}
 
-	gboolean success = gst_webrtc_data_channel_send_data_full(emconn->datachannel, bytes, NULL);
+	GstWebRTCDataChannel *datachannel = NULL;
+	switch (channel) {
+	case EM_CONNECTION_CHANNEL_TRACKING: datachannel = emconn->tracking_channel; break;
+	case EM_CONNECTION_CHANNEL_FRAME: datachannel = emconn->frame_channel; break;
+	case EM_CONNECTION_CHANNEL_CONTROL: break;
+	}
+	if (datachannel == NULL) {
+		datachannel = emconn->control_channel;
+	}
+
+	gboolean success = gst_webrtc_data_channel_send_data_full(datachannel, bytes, NULL);
 
 	return success == TRUE;
 }
@@ -21,6 +21,17 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE(EmConnection, em_connection, EM, CONNECTION, GObject)
 
+/*!
+ * Data channel a message is sent over, see em_data_channels.h for what each
+ * one is for.
+ */
+enum em_connection_channel
+{
+	EM_CONNECTION_CHANNEL_TRACKING,
+	EM_CONNECTION_CHANNEL_FRAME,
+	EM_CONNECTION_CHANNEL_CONTROL,
+};
+
 /*!
  * Create a connection object
  *
@@ -53,12 +64,13 @@ em_connection_disconnect(EmConnection *emconn);
 
 
 /*!
- * Send a message to the server
+ * Send a message to the server over @p channel, or the control channel if
+ * the server did not create that one.
  *
  * @memberof EmConnection
  */
 bool
-em_connection_send_bytes(EmConnection *emconn, GBytes *bytes);
+em_connection_send_bytes(EmConnection *emconn, enum em_connection_channel channel, GBytes *bytes);
 
 /*!
  * Assign a pipeline for use.
@@ -82,9 +82,17 @@ em_remote_experience_emit_upmessage(EmRemoteExperience *exp, em_proto_UpMessage
 
 	pb_encode(&os, &em_proto_UpMessage_msg, upMessage);
 
+	// Frame reports must arrive, a pose only matters until the next one.
+	enum em_connection_channel channel = EM_CONNECTION_CHANNEL_CONTROL;
+	if (upMessage->has_frame) {
+		channel = EM_CONNECTION_CHANNEL_FRAME;
+	} else if (upMessage->has_tracking) {
+		channel = EM_CONNECTION_CHANNEL_TRACKING;
+	}
+
 	ALOGI("RYLIE: Sending message");
 	GBytes *bytes = g_bytes_new(buffer, os.bytes_written);
-	bool bResult = em_connection_send_bytes(exp->connection, bytes);
+	bool bResult = em_connection_send_bytes(exp->connection, channel, bytes);
 	g_bytes_unref(bytes);
 	return bResult;
 }
@@ -405,6 +413,7 @@ em_remote_experience_poll_and_render_frame(EmRemoteExperience *exp)
 
 static void
 report_frame_timing(EmRemoteExperience *exp,
+                    const struct em_sample *sample,
                     const struct timespec *beginFrameTime,
                     const struct timespec *decodeEndTime,
                     XrTime predictedDisplayTime)
@@ -422,8 +431,9 @@ report_frame_timing(EmRemoteExperience *exp,
 		return;
 	}
 	em_proto_UpFrameMessage msg = em_proto_UpFrameMessage_init_default;
-	// TODO frame ID
-	// msg.frame_sequence_id = ???;
+	if (sample->have_frame_data) {
+		msg.frame_sequence_id = sample->frame_sequence_id;
+	}
 	msg.decode_complete_time = xrTimeDecodeEnd;
 	msg.begin_frame_time = xrTimeBeginFrame;
 	msg.display_time = predictedDisplayTime;
@@ -433,6 +443,27 @@ report_frame_timing(EmRemoteExperience *exp,
 	em_remote_experience_emit_upmessage(exp, &upMsg);
 }
 
+/*!
+ * Submit the views the frame was rendered with rather than the current ones,
+ * the runtime then reprojects the frame to where the head is at display time.
+ * Falls back to the current views if the server sent no frame data.
+ */
+static void
+set_projection_view_poses(const struct em_sample *sample,
+                          const XrView *views,
+                          XrCompositionLayerProjectionView *projectionViews)
+{
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		if (sample != nullptr && sample->have_frame_data) {
+			projectionViews[eye].pose = sample->render_poses[eye];
+			projectionViews[eye].fov = sample->render_fovs[eye];
+		} else {
+			projectionViews[eye].pose = views[eye].pose;
+			projectionViews[eye].fov = views[eye].fov;
+		}
+	}
+}
+
 EmPollRenderResult
 em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
                                                  const struct timespec *beginFrameTime,
@@ -464,13 +495,9 @@ em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
 	projectionLayer->space = exp->xr_owned.worldSpace;
 
 	projectionViews[0].subImage.swapchain = exp->xr_owned.swapchain;
-	projectionViews[0].pose = views[0].pose; // TODO use poses from server
-	projectionViews[0].fov = views[0].fov;
 	projectionViews[0].subImage.imageRect.offset = {0, 0};
 	projectionViews[0].subImage.imageRect.extent = {static_cast<int32_t>(width), static_cast<int32_t>(height)};
 	projectionViews[1].subImage.swapchain = exp->xr_owned.swapchain;
-	projectionViews[1].pose = views[1].pose; // TODO use poses from server
-	projectionViews[1].fov = views[1].fov;
 	projectionViews[1].subImage.imageRect.offset = {static_cast<int32_t>(width), 0};
 	projectionViews[1].subImage.imageRect.extent = {static_cast<int32_t>(width), static_cast<int32_t>(height)};
 
@@ -479,11 +506,15 @@ em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
 
 	if (sample == nullptr) {
 		if (exp->prev_sample) {
+			// The swapchain still holds the previous frame, so it goes with its poses.
+			set_projection_view_poses(exp->prev_sample, views, projectionViews);
 			return EM_POLL_RENDER_RESULT_REUSED_SAMPLE;
 		}
 		return EM_POLL_RENDER_RESULT_NO_SAMPLE_AVAILABLE;
 	}
 
+	set_projection_view_poses(sample, views, projectionViews);
+
 	uint32_t imageIndex;
 	result = xrAcquireSwapchainImage(exp->xr_owned.swapchain, NULL, &imageIndex);
 
@@ -527,7 +558,7 @@ em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
 	exp->prev_sample = sample;
 
 	// Send frame report
-	report_frame_timing(exp, beginFrameTime, &decodeEndTime, predictedDisplayTime);
+	report_frame_timing(exp, sample, beginFrameTime, &decodeEndTime, predictedDisplayTime);
 
 	return EM_POLL_RENDER_RESULT_NEW_SAMPLE;
 }
@@ -16,6 +16,8 @@
 
 #include "os/os_threading.h"
 
+#include "em_frame_sei.h"
+
 #include <gst/app/gstappsink.h>
 #include <gst/gl/gl.h>
 #include <gst/gl/gstglsyncmeta.h>
@@ -45,6 +47,16 @@ em_gst_message_debug(const char *function, GstMessage *msg);
 		em_gst_message_debug(__FUNCTION__, MSG);                                                               \
 	} while (0)
 
+//! Frames that can be between the parser and the decoder output, for matching frame data.
+#define EM_FRAME_DATA_QUEUE (8)
+
+/*!
+ * How long the jitterbuffer holds a gap open, in milliseconds. With NACK on
+ * a retransmission needs about one round trip to arrive, a few ms on a good
+ * Wi-Fi link, so this covers a couple of them without adding a whole frame.
+ */
+#define EM_JITTERBUFFER_LATENCY_MS (20)
+
 struct em_sc_sample
 {
 	struct em_sample base;
@@ -96,6 +108,18 @@ struct _EmStreamClient
 	GMutex sample_mutex;
 	GstSample *sample;
 	struct timespec sample_decode_end_ts;
+	bool sample_have_frame_data;
+	em_proto_DownFrameDataMessage sample_frame_data;
+
+	/// Frame data parsed from the stream waiting for the decoded frame, oldest at frame_data_head.
+	GMutex frame_data_mutex;
+	struct
+	{
+		GstClockTime pts;
+		em_proto_DownFrameDataMessage msg;
+	} frame_data[EM_FRAME_DATA_QUEUE];
+	uint32_t frame_data_head;
+	uint32_t frame_data_count;
 };
 
 #if 0
@@ -202,6 +226,7 @@ em_stream_client_init(EmStreamClient *sc)
 	sc->loop = g_main_loop_new(NULL, FALSE);
 	g_assert(os_thread_helper_init(&sc->play_thread) >= 0);
 	g_mutex_init(&sc->sample_mutex);
+	g_mutex_init(&sc->frame_data_mutex);
 	ALOGI("%s: done creating stuff", __FUNCTION__);
 }
 static void
@@ -229,6 +254,8 @@ em_stream_client_finalize(EmStreamClient *self)
 	// only called once, after dispose
 	// EmStreamClient *self = EM_STREAM_CLIENT(object);
 	os_thread_helper_destroy(&self->play_thread);
+	g_mutex_clear(&self->sample_mutex);
+	g_mutex_clear(&self->frame_data_mutex);
 	em_stream_client_free_egl_mutex(self);
 }
 
@@ -332,11 +359,104 @@ gst_bus_cb(GstBus *bus, GstMessage *message, gpointer data)
 	return TRUE;
 }
 
+static GstPadProbeReturn
+parsed_frame_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	EmStreamClient *sc = (EmStreamClient *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+	if (!GST_BUFFER_PTS_IS_VALID(buffer)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	em_proto_DownFrameDataMessage msg = em_proto_DownFrameDataMessage_init_default;
+	GstMapInfo map;
+	if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+		return GST_PAD_PROBE_OK;
+	}
+	bool found = em_frame_sei_parse(map.data, map.size, &msg);
+	gst_buffer_unmap(buffer, &map);
+
+	if (!found) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->frame_data_mutex);
+
+	// Drop the oldest, the decoder must have dropped that frame.
+	if (sc->frame_data_count == EM_FRAME_DATA_QUEUE) {
+		sc->frame_data_head = (sc->frame_data_head + 1) % EM_FRAME_DATA_QUEUE;
+		sc->frame_data_count--;
+	}
+
+	uint32_t index = (sc->frame_data_head + sc->frame_data_count) % EM_FRAME_DATA_QUEUE;
+	sc->frame_data[index].pts = GST_BUFFER_PTS(buffer);
+	sc->frame_data[index].msg = msg;
+	sc->frame_data_count++;
+
+	return GST_PAD_PROBE_OK;
+}
+
+static bool
+pop_frame_data(EmStreamClient *sc, GstClockTime pts, em_proto_DownFrameDataMessage *out_msg)
+{
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->frame_data_mutex);
+
+	// Frames come out in order, anything older than this one was dropped.
+	while (sc->frame_data_count > 0) {
+		uint32_t index = sc->frame_data_head;
+		if (sc->frame_data[index].pts > pts) {
+			break;
+		}
+
+		sc->frame_data_head = (sc->frame_data_head + 1) % EM_FRAME_DATA_QUEUE;
+		sc->frame_data_count--;
+
+		if (sc->frame_data[index].pts == pts) {
+			*out_msg = sc->frame_data[index].msg;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static XrPosef
+from_proto_pose(const em_proto_Pose *pose)
+{
+	XrPosef ret = {.orientation = {0, 0, 0, 1}};
+	if (pose->has_position) {
+		ret.position.x = pose->position.x;
+		ret.position.y = pose->position.y;
+		ret.position.z = pose->position.z;
+	}
+	if (pose->has_orientation) {
+		ret.orientation.x = pose->orientation.x;
+		ret.orientation.y = pose->orientation.y;
+		ret.orientation.z = pose->orientation.z;
+		ret.orientation.w = pose->orientation.w;
+	}
+
+	return ret;
+}
+
+static XrFovf
+from_proto_fov(const em_proto_Fov *fov)
+{
+	XrFovf ret = {
+	    .angleLeft = fov->angle_left,
+	    .angleRight = fov->angle_right,
+	    .angleUp = fov->angle_up,
+	    .angleDown = fov->angle_down,
+	};
+
+	return ret;
+}
+
 static GstFlowReturn
 on_new_sample_cb(GstAppSink *appsink, gpointer user_data)
 {
 	EmStreamClient *sc = (EmStreamClient *)user_data;
-	// TODO record the frame ID, get frame pose
 	struct timespec ts;
 	int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
 	if (ret != 0) {
@@ -346,11 +466,20 @@ on_new_sample_cb(GstAppSink *appsink, gpointer user_data)
 	GstSample *prevSample = NULL;
 	GstSample *sample = gst_app_sink_pull_sample(appsink);
 	g_assert_nonnull(sample);
+
+	// The decoder keeps the PTS, so it matches the frame data found in front of the decoder.
+	em_proto_DownFrameDataMessage frame_data = em_proto_DownFrameDataMessage_init_default;
+	GstBuffer *buffer = gst_sample_get_buffer(sample);
+	bool have_frame_data =
+	    GST_BUFFER_PTS_IS_VALID(buffer) && pop_frame_data(sc, GST_BUFFER_PTS(buffer), &frame_data);
+
 	{
 		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
 		prevSample = sc->sample;
 		sc->sample = sample;
 		sc->sample_decode_end_ts = ts;
+		sc->sample_have_frame_data = have_frame_data;
+		sc->sample_frame_data = frame_data;
 		sc->received_first_frame = true;
 	}
 	if (prevSample) {
@@ -381,12 +510,13 @@ on_need_pipeline_cb(EmConnection *emconn, EmStreamClient *sc)
 	}
 
 	gchar *pipeline_string = g_strdup_printf(
-	    "webrtcbin name=webrtc bundle-policy=max-bundle latency=0 ! "
+	    "webrtcbin name=webrtc bundle-policy=max-bundle latency=%u ! "
 	    "rtph264depay ! "
-	    "h264parse ! "
+	    "h264parse name=parser ! "
 	    "video/x-h264,stream-format=(string)byte-stream, alignment=(string)au,parsed=(boolean)true !"
 	    "amcviddec-omxqcomvideodecoderavc ! "
-	    "glsinkbin name=glsink");
+	    "glsinkbin name=glsink",
+	    EM_JITTERBUFFER_LATENCY_MS);
 
 	sc->pipeline = gst_object_ref_sink(gst_parse_launch(pipeline_string, &error));
 	if (sc->pipeline == NULL) {
@@ -429,6 +559,11 @@ on_need_pipeline_cb(EmConnection *emconn, EmStreamClient *sc)
 	g_autoptr(GstElement) glsinkbin = gst_bin_get_by_name(GST_BIN(sc->pipeline), "glsink");
 	g_object_set(glsinkbin, "sink", sc->appsink, NULL);
 
+	// Whole access units come out of the parser, look for the frame data the server put in front of the slices.
+	g_autoptr(GstElement) parser = gst_bin_get_by_name(GST_BIN(sc->pipeline), "parser");
+	g_autoptr(GstPad) parser_src = gst_element_get_static_pad(parser, "src");
+	gst_pad_add_probe(parser_src, GST_PAD_PROBE_TYPE_BUFFER, parsed_frame_probe_cb, sc, NULL);
+
 	g_autoptr(GstBus) bus = gst_element_get_bus(sc->pipeline);
 	// We set this up to inject the EGL context
 	gst_bus_set_sync_handler(bus, (GstBusSyncHandler)bus_sync_handler_cb, sc, NULL);
@@ -596,11 +731,15 @@ em_stream_client_try_pull_sample(EmStreamClient *sc, struct timespec *out_decode
 	// pulled.
 	GstSample *sample = NULL;
 	struct timespec decode_end;
+	bool have_frame_data = false;
+	em_proto_DownFrameDataMessage frame_data;
 	{
 		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
 		sample = sc->sample;
 		sc->sample = NULL;
 		decode_end = sc->sample_decode_end_ts;
+		have_frame_data = sc->sample_have_frame_data;
+		frame_data = sc->sample_frame_data;
 	}
 
 	if (sample == NULL) {
@@ -632,6 +771,15 @@ em_stream_client_try_pull_sample(EmStreamClient *sc, struct timespec *out_decode
 
 	struct em_sc_sample *ret = calloc(1, sizeof(struct em_sc_sample));
 
+	ret->base.have_frame_data = have_frame_data;
+	if (have_frame_data) {
+		ret->base.frame_sequence_id = frame_data.frame_sequence_id;
+		ret->base.render_poses[0] = from_proto_pose(&frame_data.P_localSpace_view0);
+		ret->base.render_poses[1] = from_proto_pose(&frame_data.P_localSpace_view1);
+		ret->base.render_fovs[0] = from_proto_fov(&frame_data.fov_view0);
+		ret->base.render_fovs[1] = from_proto_fov(&frame_data.fov_view1);
+	}
+
 	GstVideoFrame frame;
 	GstMapFlags flags = (GstMapFlags)(GST_MAP_READ | GST_MAP_GL);
 	gst_video_frame_map(&frame, &info, buffer, flags);
@@ -36,4 +36,14 @@ struct em_sample
 {
 	GLuint frame_texture_id;
 	GLenum frame_texture_target;
+
+	//! True if the server sent frame data with this frame, otherwise the fields below are not valid.
+	bool have_frame_data;
+
+	//! Server frame id, reported back in UpFrameMessage.
+	int64_t frame_sequence_id;
+
+	//! Views the server rendered the frame with, poses are in our local space.
+	XrPosef render_poses[2];
+	XrFovf render_fovs[2];
 };
@@ -0,0 +1,117 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ */
+
+#include "catch2/catch_test_macros.hpp"
+
+#include "em_frame_sei.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace {
+
+// 2.0f is 00 00 00 40 little-endian, so it needs emulation prevention.
+constexpr float kNeedsEscaping = 2.0f;
+
+em_proto_DownFrameDataMessage makeMessage() {
+  em_proto_DownFrameDataMessage msg = em_proto_DownFrameDataMessage_init_zero;
+  msg.frame_sequence_id = 1234;
+  msg.display_time = 5678;
+  msg.has_P_localSpace_view0 = true;
+  msg.P_localSpace_view0.has_position = true;
+  msg.P_localSpace_view0.position.x = kNeedsEscaping;
+  msg.P_localSpace_view0.position.y = 1.5f;
+  msg.P_localSpace_view0.has_orientation = true;
+  msg.P_localSpace_view0.orientation.w = 1.0f;
+  msg.has_fov_view1 = true;
+  msg.fov_view1.angle_left = -0.75f;
+  msg.fov_view1.angle_right = 0.75f;
+  return msg;
+}
+
+std::vector<uint8_t> buildSei(em_proto_DownFrameDataMessage const &msg) {
+  std::vector<uint8_t> sei(EM_FRAME_SEI_MAX_SIZE);
+  size_t size = em_frame_sei_build(&msg, sei.data(), sei.size());
+  REQUIRE(size > 0);
+  sei.resize(size);
+  return sei;
+}
+
+bool hasEmulationPrevention(std::vector<uint8_t> const &data) {
+  for (size_t i = 0; i + 2 < data.size(); i++) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 3) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// SPS, then whatever goes before the slice, then an IDR slice.
+std::vector<uint8_t> makeAccessUnit(std::vector<uint8_t> const &beforeSlice) {
+  std::vector<uint8_t> au = {0, 0, 0, 1, 0x67, 0x42, 0xc0, 0x1f};
+  au.insert(au.end(), beforeSlice.begin(), beforeSlice.end());
+  std::vector<uint8_t> slice = {0, 0, 0, 1, 0x65, 0x88, 0x84, 0x00, 0x21};
+  au.insert(au.end(), slice.begin(), slice.end());
+  return au;
+}
+
+} // namespace
+
+TEST_CASE("FrameSeiRoundtrip") {
+  em_proto_DownFrameDataMessage msg = makeMessage();
+  std::vector<uint8_t> sei = buildSei(msg);
+
+  CHECK(hasEmulationPrevention(sei));
+
+  std::vector<uint8_t> au = makeAccessUnit(sei);
+
+  SECTION("Inserted in front of the slice") {
+    std::vector<uint8_t> withoutSei = makeAccessUnit({});
+    size_t offset = em_frame_sei_find_insert_offset(withoutSei.data(), withoutSei.size());
+    REQUIRE(offset == 8);
+
+    withoutSei.insert(withoutSei.begin() + offset, sei.begin(), sei.end());
+    CHECK(withoutSei == au);
+  }
+
+  SECTION("Parsed back") {
+    em_proto_DownFrameDataMessage out = em_proto_DownFrameDataMessage_init_zero;
+    REQUIRE(em_frame_sei_parse(au.data(), au.size(), &out));
+
+    CHECK(out.frame_sequence_id == msg.frame_sequence_id);
+    CHECK(out.display_time == msg.display_time);
+    CHECK(out.has_P_localSpace_view0);
+    CHECK(out.P_localSpace_view0.position.x == kNeedsEscaping);
+    CHECK(out.P_localSpace_view0.position.y == msg.P_localSpace_view0.position.y);
+    CHECK(out.P_localSpace_view0.orientation.w == msg.P_localSpace_view0.orientation.w);
+    CHECK_FALSE(out.has_P_localSpace_view1);
+    CHECK(out.has_fov_view1);
+    CHECK(out.fov_view1.angle_left == msg.fov_view1.angle_left);
+    CHECK(out.fov_view1.angle_right == msg.fov_view1.angle_right);
+  }
+
+  SECTION("After another message with payload type 0x80") {
+    // Payload type 128, size 1, one byte of data, in the same SEI NAL in front of ours.
+    std::vector<uint8_t> prefixed = sei;
+    std::vector<uint8_t> other = {0x80, 0x01, 0x42};
+    prefixed.insert(prefixed.begin() + 5, other.begin(), other.end());
+
+    std::vector<uint8_t> prefixedAu = makeAccessUnit(prefixed);
+    em_proto_DownFrameDataMessage out = em_proto_DownFrameDataMessage_init_zero;
+    REQUIRE(em_frame_sei_parse(prefixedAu.data(), prefixedAu.size(), &out));
+    CHECK(out.frame_sequence_id == msg.frame_sequence_id);
+  }
+
+  SECTION("Without the trailing bits") {
+    std::vector<uint8_t> truncated = sei;
+    truncated.pop_back();
+
+    std::vector<uint8_t> truncatedAu = makeAccessUnit(truncated);
+    em_proto_DownFrameDataMessage out = em_proto_DownFrameDataMessage_init_zero;
+    CHECK_FALSE(em_frame_sei_parse(truncatedAu.data(), truncatedAu.size(), &out));
+  }
+}
@@ -0,0 +1,27 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Labels of the data channels between server and client.
+ *
+ * The server creates all of them with the reliability that suits what goes
+ * over them, the client picks the channel for each UpMessage it sends.
+ */
+
+#pragma once
+
+
+/*!
+ * TrackingMessage only. Unordered and never retransmitted: a pose that is
+ * lost or late is superseded by the next one, waiting for it would only
+ * hold that back.
+ */
+#define EM_DATA_CHANNEL_TRACKING "tracking"
+
+//! UpFrameMessage reports, reliable and ordered.
+#define EM_DATA_CHANNEL_FRAME "frame"
+
+//! Everything else, reliable and ordered.
+#define EM_DATA_CHANNEL_CONTROL "control"
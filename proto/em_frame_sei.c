@@ -0,0 +1,279 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Carrying DownFrameDataMessage in-band as a H.264 SEI.
+ */
+
+#include "em_frame_sei.h"
+
+#include "pb_encode.h"
+#include "pb_decode.h"
+
+#include <string.h>
+
+
+#define NAL_TYPE_SLICE (1)
+#define NAL_TYPE_SLICE_IDR (5)
+#define NAL_TYPE_SEI (6)
+
+#define SEI_TYPE_USER_DATA_UNREGISTERED (5)
+
+//! Random, identifies our user_data_unregistered payloads.
+static const uint8_t em_frame_sei_uuid[EM_FRAME_SEI_UUID_SIZE] = {
+    0x6d, 0x61, 0x70, 0x6c, 0x65, 0x5f, 0x4a, 0x8f, 0xa1, 0x3c, 0x0e, 0x57, 0xd2, 0x94, 0x6b, 0x1e,
+};
+
+//! Largest unescaped SEI RBSP we build or parse.
+#define MAX_RBSP_SIZE (1 + 1 + EM_FRAME_SEI_UUID_SIZE + em_proto_DownFrameDataMessage_size + 1)
+
+
+/*
+ *
+ * Annex B helpers.
+ *
+ */
+
+//! Offset of the first byte after the next 00 00 01 start code at or after @p pos, @p size if none.
+static size_t
+next_nal(const uint8_t *data, size_t size, size_t pos)
+{
+	for (size_t i = pos; i + 2 < size; i++) {
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+			return i + 3;
+		}
+	}
+
+	return size;
+}
+
+//! End of the NAL unit starting at @p start, where the next start code begins.
+static size_t
+nal_end(const uint8_t *data, size_t size, size_t start)
+{
+	size_t next = next_nal(data, size, start);
+	if (next == size) {
+		return size;
+	}
+
+	return next - 3;
+}
+
+static size_t
+add_emulation_prevention(const uint8_t *rbsp, size_t rbsp_size, uint8_t *out, size_t out_size)
+{
+	size_t n = 0;
+	uint32_t zeros = 0;
+
+	for (size_t i = 0; i < rbsp_size; i++) {
+		if (zeros == 2 && rbsp[i] <= 3) {
+			if (n >= out_size) {
+				return 0;
+			}
+			out[n++] = 3;
+			zeros = 0;
+		}
+
+		if (n >= out_size) {
+			return 0;
+		}
+		out[n++] = rbsp[i];
+		zeros = rbsp[i] == 0 ? zeros + 1 : 0;
+	}
+
+	return n;
+}
+
+static size_t
+remove_emulation_prevention(const uint8_t *ebsp, size_t ebsp_size, uint8_t *out, size_t out_size)
+{
+	size_t n = 0;
+	uint32_t zeros = 0;
+
+	for (size_t i = 0; i < ebsp_size && n < out_size; i++) {
+		if (zeros == 2 && ebsp[i] == 3) {
+			zeros = 0;
+			continue;
+		}
+
+		out[n++] = ebsp[i];
+		zeros = ebsp[i] == 0 ? zeros + 1 : 0;
+	}
+
+	return n;
+}
+
+//! Reads a SEI payload type or size, coded as a run of 0xff bytes and a final byte.
+static bool
+read_sei_value(const uint8_t *rbsp, size_t rbsp_size, size_t *inout_pos, size_t *out_value)
+{
+	size_t value = 0;
+	size_t pos = *inout_pos;
+
+	while (pos < rbsp_size && rbsp[pos] == 0xff) {
+		value += 0xff;
+		pos++;
+	}
+
+	if (pos >= rbsp_size) {
+		return false;
+	}
+
+	*out_value = value + rbsp[pos];
+	*inout_pos = pos + 1;
+
+	return true;
+}
+
+static bool
+parse_sei_rbsp(const uint8_t *rbsp, size_t rbsp_size, em_proto_DownFrameDataMessage *out_msg)
+{
+	size_t pos = 0;
+
+	/*
+	 * SEI messages are byte aligned, so the rbsp trailing bits are a last
+	 * 0x80 byte, possibly followed by zero bytes. A 0x80 anywhere else is a
+	 * payload type, size or data.
+	 */
+	while (rbsp_size > 0 && rbsp[rbsp_size - 1] == 0) {
+		rbsp_size--;
+	}
+
+	if (rbsp_size == 0 || rbsp[rbsp_size - 1] != 0x80) {
+		return false;
+	}
+
+	rbsp_size--;
+
+	while (pos < rbsp_size) {
+		size_t type = 0;
+		size_t size = 0;
+
+		if (!read_sei_value(rbsp, rbsp_size, &pos, &type) || //
+		    !read_sei_value(rbsp, rbsp_size, &pos, &size) || //
+		    pos + size > rbsp_size) {
+			return false;
+		}
+
+		const uint8_t *payload = rbsp + pos;
+		pos += size;
+
+		if (type != SEI_TYPE_USER_DATA_UNREGISTERED || size < EM_FRAME_SEI_UUID_SIZE ||
+		    memcmp(payload, em_frame_sei_uuid, EM_FRAME_SEI_UUID_SIZE) != 0) {
+			continue;
+		}
+
+		pb_istream_t stream =
+		    pb_istream_from_buffer(payload + EM_FRAME_SEI_UUID_SIZE, size - EM_FRAME_SEI_UUID_SIZE);
+
+		return pb_decode(&stream, em_proto_DownFrameDataMessage_fields, out_msg);
+	}
+
+	return false;
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+size_t
+em_frame_sei_build(const em_proto_DownFrameDataMessage *msg, uint8_t *out, size_t out_size)
+{
+	uint8_t rbsp[MAX_RBSP_SIZE];
+
+	// The payload, UUID then the message, goes after the type and size.
+	uint8_t *payload = rbsp + 2;
+	memcpy(payload, em_frame_sei_uuid, EM_FRAME_SEI_UUID_SIZE);
+
+	pb_ostream_t stream =
+	    pb_ostream_from_buffer(payload + EM_FRAME_SEI_UUID_SIZE, em_proto_DownFrameDataMessage_size);
+	if (!pb_encode(&stream, em_proto_DownFrameDataMessage_fields, msg)) {
+		return 0;
+	}
+
+	size_t payload_size = EM_FRAME_SEI_UUID_SIZE + stream.bytes_written;
+
+	// The message is small enough for single byte type and size.
+	_Static_assert(EM_FRAME_SEI_UUID_SIZE + em_proto_DownFrameDataMessage_size < 0xff, "SEI payload too large");
+
+	rbsp[0] = SEI_TYPE_USER_DATA_UNREGISTERED;
+	rbsp[1] = (uint8_t)payload_size;
+	rbsp[2 + payload_size] = 0x80;
+
+	size_t rbsp_size = 2 + payload_size + 1;
+
+	if (out_size < 5) {
+		return 0;
+	}
+
+	out[0] = 0;
+	out[1] = 0;
+	out[2] = 0;
+	out[3] = 1;
+	out[4] = NAL_TYPE_SEI;
+
+	size_t n = add_emulation_prevention(rbsp, rbsp_size, out + 5, out_size - 5);
+	if (n == 0) {
+		return 0;
+	}
+
+	return 5 + n;
+}
+
+size_t
+em_frame_sei_find_insert_offset(const uint8_t *data, size_t size)
+{
+	size_t start = next_nal(data, size, 0);
+
+	while (start < size) {
+		uint8_t type = data[start] & 0x1f;
+
+		if (type == NAL_TYPE_SLICE || type == NAL_TYPE_SLICE_IDR) {
+			// Back to the start code, including the leading zero of a four byte one.
+			size_t offset = start - 3;
+			if (offset > 0 && data[offset - 1] == 0) {
+				offset--;
+			}
+			return offset;
+		}
+
+		start = next_nal(data, size, start);
+	}
+
+	return size;
+}
+
+bool
+em_frame_sei_parse(const uint8_t *data, size_t size, em_proto_DownFrameDataMessage *out_msg)
+{
+	size_t start = next_nal(data, size, 0);
+
+	while (start < size) {
+		uint8_t type = data[start] & 0x1f;
+		size_t end = nal_end(data, size, start);
+
+		// SEIs all come before the first slice.
+		if (type == NAL_TYPE_SLICE || type == NAL_TYPE_SLICE_IDR) {
+			break;
+		}
+
+		if (type == NAL_TYPE_SEI) {
+			uint8_t rbsp[MAX_RBSP_SIZE];
+			size_t rbsp_size =
+			    remove_emulation_prevention(data + start + 1, end - start - 1, rbsp, sizeof(rbsp));
+
+			if (parse_sei_rbsp(rbsp, rbsp_size, out_msg)) {
+				return true;
+			}
+		}
+
+		start = next_nal(data, size, end);
+	}
+
+	return false;
+}
@@ -0,0 +1,65 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Carrying DownFrameDataMessage in-band as a H.264 SEI.
+ *
+ * The message is put in a user_data_unregistered SEI in front of the slices
+ * of the frame it describes, so it can not get out of step with the video
+ * like a message on the data channel can. Only H.264 Annex B byte-stream
+ * access units are handled.
+ */
+
+#pragma once
+
+#include "electricmaple.pb.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//! Size of the UUID that marks the user_data_unregistered SEI as ours.
+#define EM_FRAME_SEI_UUID_SIZE (16)
+
+/*!
+ * Largest SEI NAL unit @ref em_frame_sei_build can produce, start code
+ * included: header, payload type and size, UUID, message and trailing bits,
+ * all of which might need emulation prevention.
+ */
+#define EM_FRAME_SEI_MAX_SIZE (4 + 1 + 2 * (1 + 1 + EM_FRAME_SEI_UUID_SIZE + em_proto_DownFrameDataMessage_size + 1))
+
+/*!
+ * Encode @p msg into a complete SEI NAL unit with a four byte start code.
+ *
+ * @return Number of bytes written to @p out, zero on failure.
+ */
+size_t
+em_frame_sei_build(const em_proto_DownFrameDataMessage *msg, uint8_t *out, size_t out_size);
+
+/*!
+ * Where in an access unit our SEI should go, the start code of the first
+ * slice, since SEIs have to come before it.
+ *
+ * @return Offset into @p data, @p size if there is no slice.
+ */
+size_t
+em_frame_sei_find_insert_offset(const uint8_t *data, size_t size);
+
+/*!
+ * Look for our SEI in front of the first slice of an access unit and decode
+ * it into @p out_msg.
+ */
+bool
+em_frame_sei_parse(const uint8_t *data, size_t size, em_proto_DownFrameDataMessage *out_msg);
+
+
+#ifdef __cplusplus
+}
+#endif
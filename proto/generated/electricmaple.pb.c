@@ -18,6 +18,9 @@ PB_BIND(em_proto_Vec2, em_proto_Vec2, AUTO)
 PB_BIND(em_proto_Pose, em_proto_Pose, AUTO)
 
 
+PB_BIND(em_proto_Fov, em_proto_Fov, AUTO)
+
+
 PB_BIND(em_proto_TrackingMessage, em_proto_TrackingMessage, 2)
 
 
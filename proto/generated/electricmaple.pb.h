@@ -42,6 +42,14 @@ typedef struct _em_proto_Pose {
     em_proto_Quaternion orientation;
 } em_proto_Pose;
 
+/* Angles in radians, like XrFovf. */
+typedef struct _em_proto_Fov {
+    float angle_left;
+    float angle_right;
+    float angle_up;
+    float angle_down;
+} em_proto_Fov;
+
 typedef struct _em_proto_TrackingMessage {
     bool has_P_localSpace_viewSpace;
     em_proto_Pose P_localSpace_viewSpace;
@@ -125,11 +133,20 @@ typedef struct _em_proto_UpMessage {
     em_proto_UpFrameMessage frame;
 } em_proto_UpMessage;
 
+/* Sent in-band with each encoded frame, as a H.264 SEI, see em_frame_sei.h. */
 typedef struct _em_proto_DownFrameDataMessage {
     int64_t frame_sequence_id;
     bool has_P_localSpace_viewSpace;
     em_proto_Pose P_localSpace_viewSpace;
-    int64_t display_time; /* TODO fovs here */
+    int64_t display_time; /* nanoseconds, in server time domain */
+    bool has_P_localSpace_view0;
+    em_proto_Pose P_localSpace_view0; /* Left view, as rendered */
+    bool has_P_localSpace_view1;
+    em_proto_Pose P_localSpace_view1; /* Right view, as rendered */
+    bool has_fov_view0;
+    em_proto_Fov fov_view0;
+    bool has_fov_view1;
+    em_proto_Fov fov_view1;
 } em_proto_DownFrameDataMessage;
 
 typedef struct _em_proto_DownMessage {
@@ -168,6 +185,7 @@ extern "C" {
 #define em_proto_Vec3_init_default               {0, 0, 0}
 #define em_proto_Vec2_init_default               {0, 0}
 #define em_proto_Pose_init_default               {false, em_proto_Vec3_init_default, false, em_proto_Quaternion_init_default}
+#define em_proto_Fov_init_default                {0, 0, 0, 0}
 #define em_proto_TrackingMessage_init_default    {false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, 0, 0}
 #define em_proto_InputThumbstick_init_default    {false, em_proto_Vec2_init_default, 0, 0}
 #define em_proto_InputValueTouch_init_default    {0, 0}
@@ -177,12 +195,13 @@ extern "C" {
 #define em_proto_TouchControllerRight_init_default {false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_TouchControllerCommon_init_default}
 #define em_proto_UpFrameMessage_init_default     {0, 0, 0, 0}
 #define em_proto_UpMessage_init_default          {0, false, em_proto_TrackingMessage_init_default, false, em_proto_UpFrameMessage_init_default}
-#define em_proto_DownFrameDataMessage_init_default {0, false, em_proto_Pose_init_default, 0}
+#define em_proto_DownFrameDataMessage_init_default {0, false, em_proto_Pose_init_default, 0, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Fov_init_default, false, em_proto_Fov_init_default}
 #define em_proto_DownMessage_init_default        {false, em_proto_DownFrameDataMessage_init_default}
 #define em_proto_Quaternion_init_zero            {0, 0, 0, 0}
 #define em_proto_Vec3_init_zero                  {0, 0, 0}
 #define em_proto_Vec2_init_zero                  {0, 0}
 #define em_proto_Pose_init_zero                  {false, em_proto_Vec3_init_zero, false, em_proto_Quaternion_init_zero}
+#define em_proto_Fov_init_zero                   {0, 0, 0, 0}
 #define em_proto_TrackingMessage_init_zero       {false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, 0, 0}
 #define em_proto_InputThumbstick_init_zero       {false, em_proto_Vec2_init_zero, 0, 0}
 #define em_proto_InputValueTouch_init_zero       {0, 0}
@@ -192,7 +211,7 @@ extern "C" {
 #define em_proto_TouchControllerRight_init_zero  {false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_TouchControllerCommon_init_zero}
 #define em_proto_UpFrameMessage_init_zero        {0, 0, 0, 0}
 #define em_proto_UpMessage_init_zero             {0, false, em_proto_TrackingMessage_init_zero, false, em_proto_UpFrameMessage_init_zero}
-#define em_proto_DownFrameDataMessage_init_zero  {0, false, em_proto_Pose_init_zero, 0}
+#define em_proto_DownFrameDataMessage_init_zero  {0, false, em_proto_Pose_init_zero, 0, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Fov_init_zero, false, em_proto_Fov_init_zero}
 #define em_proto_DownMessage_init_zero           {false, em_proto_DownFrameDataMessage_init_zero}
 
 /* Field tags (for use in manual encoding/decoding) */
@@ -207,6 +226,10 @@ extern "C" {
 #define em_proto_Vec2_y_tag                      2
 #define em_proto_Pose_position_tag               1
 #define em_proto_Pose_orientation_tag            2
+#define em_proto_Fov_angle_left_tag              1
+#define em_proto_Fov_angle_right_tag             2
+#define em_proto_Fov_angle_up_tag                3
+#define em_proto_Fov_angle_down_tag              4
 #define em_proto_TrackingMessage_P_localSpace_viewSpace_tag 1
 #define em_proto_TrackingMessage_P_viewSpace_view0_tag 2
 #define em_proto_TrackingMessage_P_viewSpace_view1_tag 3
@@ -245,6 +268,10 @@ extern "C" {
 #define em_proto_DownFrameDataMessage_frame_sequence_id_tag 1
 #define em_proto_DownFrameDataMessage_P_localSpace_viewSpace_tag 2
 #define em_proto_DownFrameDataMessage_display_time_tag 3
+#define em_proto_DownFrameDataMessage_P_localSpace_view0_tag 4
+#define em_proto_DownFrameDataMessage_P_localSpace_view1_tag 5
+#define em_proto_DownFrameDataMessage_fov_view0_tag 6
+#define em_proto_DownFrameDataMessage_fov_view1_tag 7
 #define em_proto_DownMessage_frame_data_tag      1
 
 /* Struct field encoding specification for nanopb */
@@ -277,6 +304,14 @@ X(a, STATIC,   OPTIONAL, MESSAGE,  orientation,       2)
 #define em_proto_Pose_position_MSGTYPE em_proto_Vec3
 #define em_proto_Pose_orientation_MSGTYPE em_proto_Quaternion
 
+#define em_proto_Fov_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, FLOAT,    angle_left,        1) \
+X(a, STATIC,   SINGULAR, FLOAT,    angle_right,       2) \
+X(a, STATIC,   SINGULAR, FLOAT,    angle_up,          3) \
+X(a, STATIC,   SINGULAR, FLOAT,    angle_down,        4)
+#define em_proto_Fov_CALLBACK NULL
+#define em_proto_Fov_DEFAULT NULL
+
 #define em_proto_TrackingMessage_FIELDLIST(X, a) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_viewSpace,   1) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  P_viewSpace_view0,   2) \
@@ -372,10 +407,18 @@ X(a, STATIC,   OPTIONAL, MESSAGE,  frame,             3)
 #define em_proto_DownFrameDataMessage_FIELDLIST(X, a) \
 X(a, STATIC,   SINGULAR, INT64,    frame_sequence_id,   1) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_viewSpace,   2) \
-X(a, STATIC,   SINGULAR, INT64,    display_time,      3)
+X(a, STATIC,   SINGULAR, INT64,    display_time,      3) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_view0,   4) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_view1,   5) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  fov_view0,         6) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  fov_view1,         7)
 #define em_proto_DownFrameDataMessage_CALLBACK NULL
 #define em_proto_DownFrameDataMessage_DEFAULT NULL
 #define em_proto_DownFrameDataMessage_P_localSpace_viewSpace_MSGTYPE em_proto_Pose
+#define em_proto_DownFrameDataMessage_P_localSpace_view0_MSGTYPE em_proto_Pose
+#define em_proto_DownFrameDataMessage_P_localSpace_view1_MSGTYPE em_proto_Pose
+#define em_proto_DownFrameDataMessage_fov_view0_MSGTYPE em_proto_Fov
+#define em_proto_DownFrameDataMessage_fov_view1_MSGTYPE em_proto_Fov
 
 #define em_proto_DownMessage_FIELDLIST(X, a) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  frame_data,        1)
@@ -387,6 +430,7 @@ extern const pb_msgdesc_t em_proto_Quaternion_msg;
 extern const pb_msgdesc_t em_proto_Vec3_msg;
 extern const pb_msgdesc_t em_proto_Vec2_msg;
 extern const pb_msgdesc_t em_proto_Pose_msg;
+extern const pb_msgdesc_t em_proto_Fov_msg;
 extern const pb_msgdesc_t em_proto_TrackingMessage_msg;
 extern const pb_msgdesc_t em_proto_InputThumbstick_msg;
 extern const pb_msgdesc_t em_proto_InputValueTouch_msg;
@@ -404,6 +448,7 @@ extern const pb_msgdesc_t em_proto_DownMessage_msg;
 #define em_proto_Vec3_fields &em_proto_Vec3_msg
 #define em_proto_Vec2_fields &em_proto_Vec2_msg
 #define em_proto_Pose_fields &em_proto_Pose_msg
+#define em_proto_Fov_fields &em_proto_Fov_msg
 #define em_proto_TrackingMessage_fields &em_proto_TrackingMessage_msg
 #define em_proto_InputThumbstick_fields &em_proto_InputThumbstick_msg
 #define em_proto_InputValueTouch_fields &em_proto_InputValueTouch_msg
@@ -417,8 +462,9 @@ extern const pb_msgdesc_t em_proto_DownMessage_msg;
 #define em_proto_DownMessage_fields &em_proto_DownMessage_msg
 
 /* Maximum encoded size of messages (where known) */
-#define em_proto_DownFrameDataMessage_size       63
-#define em_proto_DownMessage_size                65
+#define em_proto_DownFrameDataMessage_size       189
+#define em_proto_DownMessage_size                192
+#define em_proto_Fov_size                        20
 #define em_proto_InputClickTouch_size            4
 #define em_proto_InputThumbstick_size            16
 #define em_proto_InputValueTouch_size            7
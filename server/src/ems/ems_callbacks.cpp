@@ -56,6 +56,13 @@ ems_callbacks_add(struct ems_callbacks *callbacks, uint32_t event_mask, ems_call
 	callbacks->callbacks_collection.addCallback(func, event_mask, userdata);
 }
 
+void
+ems_callbacks_remove(struct ems_callbacks *callbacks, uint32_t event_mask, ems_callbacks_func_t func, void *userdata)
+{
+	std::unique_lock<std::mutex> lock(callbacks->mutex);
+	callbacks->callbacks_collection.removeCallback(func, event_mask, userdata);
+}
+
 void
 ems_callbacks_reset(struct ems_callbacks *callbacks)
 {
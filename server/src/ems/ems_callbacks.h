@@ -25,6 +25,10 @@ enum ems_callbacks_event
 {
 	EMS_CALLBACKS_EVENT_TRACKING = 1u << 0u,
 	EMS_CALLBACKS_EVENT_CONTROLLER = 1u << 1u,
+	//! The message has a @ref em_proto_UpFrameMessage with client frame timing.
+	EMS_CALLBACKS_EVENT_FRAME = 1u << 2u,
+	//! Frame reports come from a different client from now on, the message is empty.
+	EMS_CALLBACKS_EVENT_FRAME_CLIENT = 1u << 3u,
 };
 
 /// Callback function type
@@ -58,6 +62,17 @@ ems_callbacks_destroy(struct ems_callbacks **ptr_callbacks);
 void
 ems_callbacks_add(struct ems_callbacks *callbacks, uint32_t event_mask, ems_callbacks_func_t func, void *userdata);
 
+/// Remove a callback previously added with the same arguments.
+///
+/// @param callbacks self
+/// @param event_mask Bitmask the callback was added with
+/// @param func Function that was added
+/// @param userdata Opaque pointer that was added with it
+///
+/// @public @memberof ems_callbacks
+void
+ems_callbacks_remove(struct ems_callbacks *callbacks, uint32_t event_mask, ems_callbacks_func_t func, void *userdata);
+
 /// Call all callbacks that are interested in @p event
 ///
 /// @param callbacks self
@@ -0,0 +1,84 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Rough client to server clock offset estimation.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//! Number of samples the minimum is taken over before restarting.
+#define EMS_CLOCK_OFFSET_WINDOW (256)
+
+/*!
+ * Estimates the offset to add to a client timestamp to get server time.
+ *
+ * Each sample is the server receive time minus a client timestamp taken
+ * before sending, the minimum of those is the clock offset plus the smallest
+ * one-way delay seen. Clocks drift, so the minimum is restarted every
+ * @ref EMS_CLOCK_OFFSET_WINDOW samples from the last window.
+ *
+ * Not thread safe, callers provide their own locking.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_clock_offset
+{
+	int64_t client_to_server_ns;
+	bool valid;
+
+	int64_t window_min_ns;
+	uint32_t window_count;
+};
+
+static inline void
+ems_clock_offset_init(struct ems_clock_offset *co)
+{
+	co->client_to_server_ns = 0;
+	co->valid = false;
+	co->window_min_ns = INT64_MAX;
+	co->window_count = 0;
+}
+
+static inline void
+ems_clock_offset_add_sample(struct ems_clock_offset *co, uint64_t server_receive_ns, int64_t client_sent_ns)
+{
+	int64_t sample = (int64_t)server_receive_ns - client_sent_ns;
+
+	if (!co->valid || sample < co->client_to_server_ns) {
+		co->client_to_server_ns = sample;
+		co->valid = true;
+	}
+
+	if (sample < co->window_min_ns) {
+		co->window_min_ns = sample;
+	}
+
+	if (++co->window_count >= EMS_CLOCK_OFFSET_WINDOW) {
+		co->client_to_server_ns = co->window_min_ns;
+		co->window_min_ns = INT64_MAX;
+		co->window_count = 0;
+	}
+}
+
+static inline uint64_t
+ems_clock_offset_to_server(const struct ems_clock_offset *co, int64_t client_ns)
+{
+	return (uint64_t)(client_ns + co->client_to_server_ns);
+}
+
+
+#ifdef __cplusplus
+}
+#endif
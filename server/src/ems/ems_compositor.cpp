@@ -16,10 +16,17 @@
  */
 
 #include "ems_compositor.h"
+#include "ems_callbacks.h"
+#include "ems_frame_trace.h"
+#include "gst/ems_gstreamer_encoder.h"
+
+#include "electricmaple.pb.h"
 
-#include "gstreamer/gst_internal.h"
 #include "os/os_time.h"
 
+#include "math/m_api.h"
+#include "math/m_vec3.h"
+
 #include "util/u_misc.h"
 #include "util/u_time.h"
 #include "util/u_debug.h"
@@ -31,31 +38,43 @@
 
 #include "multi/comp_multi_interface.h"
 
-#include "vk/vk_image_readback_to_xf_pool.h"
 #include "vk/vk_cmd.h"
 #include "vk/vk_cmd_pool.h"
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <math.h>
+#include <inttypes.h>
 
-// native quest resolution
-// #define APP_VIEW_W (1832)
-// #define APP_VIEW_H (1920)
-
-
-#define APP_VIEW_W (1920)
-#define APP_VIEW_H (1920)
-
-// TODO making this 1 causes readback failures
-// I assume this means there is some kind of buffer creation failing and we aren't handling the error right.
-#define READBACK_DIV_FACTOR (2)
-
-#define READBACK_W2 (APP_VIEW_W / READBACK_DIV_FACTOR)
-#define READBACK_W (READBACK_W2 * 2)
-#define READBACK_H (APP_VIEW_H / READBACK_DIV_FACTOR)
+/*!
+ * Largest per-view size we advertise to applications and accept from
+ * EMS_VIEW_WIDTH/EMS_VIEW_HEIGHT.
+ */
+#define MAX_VIEW_SIZE (4096)
 
 
 DEBUG_GET_ONCE_LOG_OPTION(log, "XRT_COMPOSITOR_LOG", U_LOGGING_INFO)
+DEBUG_GET_ONCE_BOOL_OPTION(async_readback, "EMS_ASYNC_READBACK", true)
+// Blit into a bounce image before converting, instead of sampling the swapchains directly.
+DEBUG_GET_ONCE_BOOL_OPTION(bounce_image, "EMS_BOUNCE_IMAGE", false)
+DEBUG_GET_ONCE_BOOL_OPTION(drop_stale_frames, "EMS_DROP_STALE_FRAMES", true)
+// Don't encode frames identical to the last one, but send one at least this often.
+DEBUG_GET_ONCE_BOOL_OPTION(skip_static_frames, "EMS_SKIP_STATIC_FRAMES", true)
+DEBUG_GET_ONCE_NUM_OPTION(static_refresh_ms, "EMS_STATIC_REFRESH_MS", 500)
+// Step encode resolution and frame rate down when we can't keep up.
+DEBUG_GET_ONCE_BOOL_OPTION(governor, "EMS_GOVERNOR", true)
+// Native Quest 2 resolution is 1832x1920.
+DEBUG_GET_ONCE_NUM_OPTION(view_width, "EMS_VIEW_WIDTH", 1920)
+DEBUG_GET_ONCE_NUM_OPTION(view_height, "EMS_VIEW_HEIGHT", 1920)
+// Scale from the view size to the per-eye size that is read back and encoded.
+DEBUG_GET_ONCE_FLOAT_OPTION(readback_scale, "EMS_READBACK_SCALE", 0.5f)
+// Resolutions to encode at, the readback size then 2/3 and 1/2 of it.
+DEBUG_GET_ONCE_NUM_OPTION(simulcast_layers, "EMS_SIMULCAST_LAYERS", 1)
+DEBUG_GET_ONCE_BOOL_OPTION(client_pacing, "EMS_CLIENT_PACING", false)
+DEBUG_GET_ONCE_NUM_OPTION(client_pacing_slack_us, "EMS_CLIENT_PACING_SLACK_US", 2000)
+DEBUG_GET_ONCE_BOOL_OPTION(foveation, "EMS_FOVEATION", false)
+DEBUG_GET_ONCE_FLOAT_OPTION(foveation_size, "EMS_FOVEATION_SIZE", 0.4f)
+DEBUG_GET_ONCE_NUM_OPTION(foveation_delta_qp, "EMS_FOVEATION_DELTA_QP", -8)
 
 
 /*
@@ -70,6 +89,92 @@ get_vk(struct ems_compositor *c)
 	return &c->base.vk;
 }
 
+static uint32_t
+clamp_and_align(int64_t value, uint32_t min, uint32_t max, uint32_t alignment)
+{
+	int64_t clamped = CLAMP(value, (int64_t)min, (int64_t)max);
+
+	return (uint32_t)clamped - ((uint32_t)clamped % alignment);
+}
+
+static void
+compositor_init_sizes(struct ems_compositor *c)
+{
+	c->settings.view_width = clamp_and_align(debug_get_num_option_view_width(), 16, MAX_VIEW_SIZE, 2);
+	c->settings.view_height = clamp_and_align(debug_get_num_option_view_height(), 16, MAX_VIEW_SIZE, 2);
+
+	float scale = CLAMP(debug_get_float_option_readback_scale(), 0.1f, 1.0f);
+
+	/*
+	 * NV12 conversion works on 4x2 blocks, keeping each eye a multiple of
+	 * 2 wide makes the side-by-side width a multiple of 4.
+	 */
+	uint32_t eye_width = clamp_and_align(lroundf(c->settings.view_width * scale), 2, MAX_VIEW_SIZE, 2);
+	uint32_t eye_height = clamp_and_align(lroundf(c->settings.view_height * scale), 2, MAX_VIEW_SIZE, 2);
+
+	c->settings.readback_width = eye_width * 2;
+	c->settings.readback_height = eye_height;
+
+	EMS_COMP_INFO(c, "View size %ux%u, readback %ux%u (scale %.2f)", c->settings.view_width,
+	              c->settings.view_height, c->settings.readback_width, c->settings.readback_height, scale);
+}
+
+//! Side-by-side size for @p scale of the readback size, keeping the 4x2 alignment NV12 needs.
+static void
+scaled_readback_size(struct ems_compositor *c, float scale, uint32_t *out_width, uint32_t *out_height)
+{
+	uint32_t eye_width = clamp_and_align(lroundf((float)(c->settings.readback_width / 2) * scale), 8,
+	                                     c->settings.readback_width / 2, 2);
+	uint32_t eye_height =
+	    clamp_and_align(lroundf((float)c->settings.readback_height * scale), 8, c->settings.readback_height, 2);
+
+	*out_width = eye_width * 2;
+	*out_height = eye_height;
+}
+
+static void
+compositor_init_layers(struct ems_compositor *c)
+{
+	static const float scales[EMS_GSTREAMER_MAX_LAYERS] = {1.0f, 2.0f / 3.0f, 0.5f};
+
+	c->layer_count = (uint32_t)CLAMP(debug_get_num_option_simulcast_layers(), 1, EMS_GSTREAMER_MAX_LAYERS);
+
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		struct ems_stream_layer *layer = &c->layers[i];
+
+		layer->scale = scales[i];
+		scaled_readback_size(c, layer->scale, &layer->width, &layer->height);
+
+		EMS_COMP_INFO(c, "Layer %u: %ux%u", i, layer->width, layer->height);
+	}
+}
+
+static bool
+compositor_check_readback_size(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	VkPhysicalDeviceProperties props = {};
+	vk->vkGetPhysicalDeviceProperties(vk->physical_device, &props);
+
+	uint32_t max = props.limits.maxImageDimension2D;
+	if (c->settings.readback_width > max || c->settings.readback_height > max) {
+		EMS_COMP_ERROR(c, "Readback size %ux%u larger than device limit %u", c->settings.readback_width,
+		               c->settings.readback_height, max);
+		return false;
+	}
+
+	uint64_t nv12_size =
+	    (uint64_t)c->settings.readback_width * c->settings.readback_height * 3 / 2 + EMS_NV12_HASH_SIZE;
+	if (nv12_size > props.limits.maxStorageBufferRange) {
+		EMS_COMP_ERROR(c, "NV12 buffer of %" PRIu64 " bytes larger than maxStorageBufferRange %u", nv12_size,
+		               props.limits.maxStorageBufferRange);
+		return false;
+	}
+
+	return true;
+}
+
 
 /*
  *
@@ -271,6 +376,38 @@ compositor_init_pacing(struct ems_compositor *c)
 	return true;
 }
 
+/*!
+ * Sets up the timestamp queries for the GPU stage timings, without them only
+ * the CPU side stages are timed.
+ */
+static bool
+compositor_init_timing(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	VkPhysicalDeviceProperties props;
+	vk->vkGetPhysicalDeviceProperties(vk->physical_device, &props);
+	if (!props.limits.timestampComputeAndGraphics) {
+		EMS_COMP_WARN(c, "Queue can not write timestamps, no GPU stage timings.");
+		return true;
+	}
+
+	c->timing.timestamp_period_ns = props.limits.timestampPeriod;
+
+	VkQueryPoolCreateInfo pool_info = {};
+	pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	pool_info.queryCount = EMS_READBACK_MAX_IN_FLIGHT * 3;
+
+	VkResult ret = vk->vkCreateQueryPool(vk->device, &pool_info, NULL, &c->timing.query_pool);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_WARN(c, "vkCreateQueryPool: %s, no GPU stage timings.", vk_result_string(ret));
+		c->timing.query_pool = VK_NULL_HANDLE;
+	}
+
+	return true;
+}
+
 static bool
 compositor_init_info(struct ems_compositor *c)
 {
@@ -301,18 +438,18 @@ compositor_init_sys_info(struct ems_compositor *c, struct xrt_device *xdev)
 	// clang-format off
 
 	// These seem to control the
-	sys_info->views[0].recommended.width_pixels  = APP_VIEW_W;
-	sys_info->views[0].recommended.height_pixels = APP_VIEW_H;
+	sys_info->views[0].recommended.width_pixels  = c->settings.view_width;
+	sys_info->views[0].recommended.height_pixels = c->settings.view_height;
 	sys_info->views[0].recommended.sample_count  = 1;
-	sys_info->views[0].max.width_pixels          = 2048;
-	sys_info->views[0].max.height_pixels         = 2048;
+	sys_info->views[0].max.width_pixels          = MAX_VIEW_SIZE;
+	sys_info->views[0].max.height_pixels         = MAX_VIEW_SIZE;
 	sys_info->views[0].max.sample_count          = 1;
 
-	sys_info->views[1].recommended.width_pixels  = APP_VIEW_W;
-	sys_info->views[1].recommended.height_pixels = APP_VIEW_H;
+	sys_info->views[1].recommended.width_pixels  = c->settings.view_width;
+	sys_info->views[1].recommended.height_pixels = c->settings.view_height;
 	sys_info->views[1].recommended.sample_count  = 1;
-	sys_info->views[1].max.width_pixels          = 2048;
-	sys_info->views[1].max.height_pixels         = 2048;
+	sys_info->views[1].max.width_pixels          = MAX_VIEW_SIZE;
+	sys_info->views[1].max.height_pixels         = MAX_VIEW_SIZE;
 	sys_info->views[1].max.sample_count          = 1;
 	// clang-format on
 
@@ -330,18 +467,895 @@ compositor_init_sys_info(struct ems_compositor *c, struct xrt_device *xdev)
 	sys_info->num_refresh_rates = 1;
 	sys_info->refresh_rates[0] = (float)(1. / time_ns_to_s(c->settings.frame_interval_ns));
 
-	return true;
+	return true;
+}
+
+
+/*
+ *
+ * Frame handling functions.
+ *
+ */
+
+/*!
+ * Where the view direction lands in the image, as a fraction from the
+ * top-left corner, which is not the middle for asymmetric fovs.
+ */
+static void
+projection_centre(const struct xrt_fov *fov, float *out_x, float *out_y)
+{
+	float tan_left = tanf(fov->angle_left);
+	float tan_right = tanf(fov->angle_right);
+	float tan_up = tanf(fov->angle_up);
+	float tan_down = tanf(fov->angle_down);
+
+	*out_x = -tan_left / (tan_right - tan_left);
+	*out_y = tan_up / (tan_up - tan_down);
+}
+
+static void
+update_foveation_regions(struct ems_compositor *c,
+                         struct ems_stream_layer *layer,
+                         const struct xrt_frame *frame,
+                         const struct ems_frame_views *views,
+                         const struct ems_foveation_params *foveation)
+{
+	if (!foveation->enabled) {
+		ems_gstreamer_src_set_regions(layer->gstreamer_src, NULL, 0);
+		return;
+	}
+
+	// Macroblock aligned, encoders work in 16x16 blocks anyway.
+	const uint32_t align = 16;
+	uint32_t eye_w = frame->width / 2;
+	uint32_t eye_h = frame->height;
+	uint32_t w = (uint32_t)(eye_w * CLAMP(foveation->size, 0.0f, 1.0f)) & ~(align - 1);
+	uint32_t h = (uint32_t)(eye_h * CLAMP(foveation->size, 0.0f, 1.0f)) & ~(align - 1);
+
+	struct ems_gstreamer_src_region regions[2] = {};
+
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		/*
+		 * We have no eye tracking, so centre on where the eye looks
+		 * straight ahead. With gaze from the client this is where it
+		 * would be used instead.
+		 */
+		float cx, cy;
+		projection_centre(&views->fov[eye], &cx, &cy);
+
+		int64_t x = (int64_t)(cx * eye_w) - w / 2;
+		int64_t y = (int64_t)(cy * eye_h) - h / 2;
+
+		// Keep it inside the eye.
+		x = CLAMP(x, 0, (int64_t)(eye_w - w)) & ~(int64_t)(align - 1);
+		y = CLAMP(y, 0, (int64_t)(eye_h - h)) & ~(int64_t)(align - 1);
+
+		regions[eye].x = (uint32_t)x + eye * eye_w;
+		regions[eye].y = (uint32_t)y;
+		regions[eye].w = w;
+		regions[eye].h = h;
+		regions[eye].delta_qp = foveation->delta_qp;
+	}
+
+	ems_gstreamer_src_set_regions(layer->gstreamer_src, regions, ARRAY_SIZE(regions));
+}
+
+static em_proto_Pose
+to_proto_pose(const struct xrt_pose *pose)
+{
+	em_proto_Pose ret = em_proto_Pose_init_default;
+	ret.has_position = true;
+	ret.position.x = pose->position.x;
+	ret.position.y = pose->position.y;
+	ret.position.z = pose->position.z;
+	ret.has_orientation = true;
+	ret.orientation.w = pose->orientation.w;
+	ret.orientation.x = pose->orientation.x;
+	ret.orientation.y = pose->orientation.y;
+	ret.orientation.z = pose->orientation.z;
+
+	return ret;
+}
+
+static em_proto_Fov
+to_proto_fov(const struct xrt_fov *fov)
+{
+	em_proto_Fov ret = em_proto_Fov_init_default;
+	ret.angle_left = fov->angle_left;
+	ret.angle_right = fov->angle_right;
+	ret.angle_up = fov->angle_up;
+	ret.angle_down = fov->angle_down;
+
+	return ret;
+}
+
+//! Hand the render poses and fovs to the client along with the frame, so it can reproject.
+static void
+set_frame_data(struct ems_compositor *c, int64_t frame_id, const struct ems_frame_views *views)
+{
+	em_proto_DownFrameDataMessage msg = em_proto_DownFrameDataMessage_init_default;
+	msg.frame_sequence_id = frame_id;
+	msg.display_time = views->display_time_ns;
+
+	/*
+	 * We only get the views from the app, so use the point between the
+	 * eyes and the left eye orientation for the head, the views carry
+	 * the exact poses.
+	 */
+	struct xrt_pose head = views->pose[0];
+	math_vec3_accum(&views->pose[1].position, &head.position);
+	math_vec3_scalar_mul(0.5f, &head.position);
+
+	msg.has_P_localSpace_viewSpace = true;
+	msg.P_localSpace_viewSpace = to_proto_pose(&head);
+	msg.has_P_localSpace_view0 = true;
+	msg.P_localSpace_view0 = to_proto_pose(&views->pose[0]);
+	msg.has_P_localSpace_view1 = true;
+	msg.P_localSpace_view1 = to_proto_pose(&views->pose[1]);
+	msg.has_fov_view0 = true;
+	msg.fov_view0 = to_proto_fov(&views->fov[0]);
+	msg.has_fov_view1 = true;
+	msg.fov_view1 = to_proto_fov(&views->fov[1]);
+
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		ems_gstreamer_src_set_frame_data(c->layers[i].gstreamer_src, &msg);
+	}
+}
+
+static void
+add_stage_timing(struct ems_compositor *c, enum ems_comp_stage stage, uint64_t duration_ns)
+{
+	os_mutex_lock(&c->timing.mutex);
+
+	struct ems_comp_stage_timing *t = &c->timing.stages[stage];
+	if (t->count == 0 || duration_ns < t->min_ns) {
+		t->min_ns = duration_ns;
+	}
+	if (duration_ns > t->max_ns) {
+		t->max_ns = duration_ns;
+	}
+	t->total_ns += duration_ns;
+	t->count++;
+
+	os_mutex_unlock(&c->timing.mutex);
+}
+
+//! First of the three timestamp queries used by the readback in @p slot, NULL for synchronous readback.
+static uint32_t
+timestamp_query_base(struct ems_compositor *c, const struct ems_readback_slot *slot)
+{
+	uint32_t index = slot == NULL ? 0 : (uint32_t)(slot - c->readback.slots);
+
+	return index * 3;
+}
+
+static void
+write_timestamp(struct ems_compositor *c, VkCommandBuffer cmd, VkPipelineStageFlagBits stage, uint32_t query)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (c->timing.query_pool == VK_NULL_HANDLE) {
+		return;
+	}
+
+	vk->vkCmdWriteTimestamp(cmd, stage, c->timing.query_pool, query);
+}
+
+/*!
+ * Reads back the timestamps written by @ref record_readback, the GPU
+ * work must have completed.
+ *
+ * @return The total GPU time, zero if not known.
+ */
+static uint64_t
+add_gpu_stage_timings(struct ems_compositor *c, uint32_t query_base, bool bounced)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (c->timing.query_pool == VK_NULL_HANDLE) {
+		return 0;
+	}
+
+	uint64_t ts[3];
+	VkResult ret = vk->vkGetQueryPoolResults( //
+	    vk->device,                           // device
+	    c->timing.query_pool,                 // queryPool
+	    query_base,                           // firstQuery
+	    3,                                    // queryCount
+	    sizeof(ts),                           // dataSize
+	    ts,                                   // pData
+	    sizeof(ts[0]),                        // stride
+	    VK_QUERY_RESULT_64_BIT);              // flags
+	if (ret != VK_SUCCESS) {
+		return 0;
+	}
+
+	float period_ns = c->timing.timestamp_period_ns;
+	// Without the bounce image the first two timestamps are written back to back.
+	if (bounced) {
+		add_stage_timing(c, EMS_COMP_STAGE_BOUNCE_BLIT, (uint64_t)((float)(ts[1] - ts[0]) * period_ns));
+	}
+	add_stage_timing(c, EMS_COMP_STAGE_CONVERT, (uint64_t)((float)(ts[2] - ts[1]) * period_ns));
+
+	return (uint64_t)((float)(ts[2] - ts[0]) * period_ns);
+}
+
+/*!
+ * Feeds the governor once a frame has been read back. The GPU time is used
+ * when known, the readback wait also covers time spent queued behind other
+ * work, which in pipelined mode includes the frames in flight before it.
+ */
+static void
+update_governor(struct ems_compositor *c, uint64_t readback_ns, uint64_t gpu_ns)
+{
+	if (!c->governor.enabled) {
+		return;
+	}
+
+	uint64_t busy_ns = gpu_ns != 0 ? gpu_ns : readback_ns;
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		busy_ns = MAX(busy_ns, ems_gstreamer_src_get_encode_time_ns(c->layers[i].gstreamer_src));
+	}
+
+	ems_governor_update(&c->governor.governor, busy_ns, c->backpressure.dropped);
+}
+
+/*!
+ * Resizes the frames coming out of the conversion of each layer to
+ * @p scale of its configured size.
+ */
+static void
+apply_encode_scale(struct ems_compositor *c, float scale)
+{
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		struct ems_stream_layer *layer = &c->layers[i];
+
+		uint32_t width, height;
+		scaled_readback_size(c, layer->scale * scale, &width, &height);
+
+		if (width != layer->nv12.width || height != layer->nv12.height) {
+			ems_nv12_convert_set_size(&layer->nv12, width, height);
+		}
+	}
+}
+
+static bool
+views_equal(const struct ems_frame_views *a, const struct ems_frame_views *b)
+{
+	// Well below what tracking noise of a headset being worn moves.
+	const float max_distance = 0.0001f;
+	const float min_dot = 0.9999999f;
+
+	for (uint32_t i = 0; i < 2; i++) {
+		const struct xrt_quat *qa = &a->pose[i].orientation;
+		const struct xrt_quat *qb = &b->pose[i].orientation;
+		const struct xrt_fov *fa = &a->fov[i];
+		const struct xrt_fov *fb = &b->fov[i];
+
+		struct xrt_vec3 diff = m_vec3_sub(a->pose[i].position, b->pose[i].position);
+		float dot = fabsf(qa->x * qb->x + qa->y * qb->y + qa->z * qb->z + qa->w * qb->w);
+
+		if (m_vec3_len(diff) > max_distance || dot < min_dot) {
+			return false;
+		}
+
+		if (fa->angle_left != fb->angle_left || fa->angle_right != fb->angle_right ||
+		    fa->angle_up != fb->angle_up || fa->angle_down != fb->angle_down) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*!
+ * Is this the same image, rendered from the same poses, as the last frame
+ * sent. The client can then keep showing the last one, the poses matter as
+ * it reprojects with them.
+ *
+ * Skipping only starts once the unchanged image has been sent for a full
+ * intra refresh period, so what was lost while it changed is repaired. A
+ * requested key frame needs a frame to be made from, so nothing is skipped
+ * while one is pending, for a joining client or a PLI. One is still sent
+ * every refresh_ns.
+ */
+static bool
+is_static_frame(struct ems_compositor *c,
+                const struct ems_nv12_frame *nv12_frame,
+                const struct ems_frame_views *views,
+                uint64_t now_ns)
+{
+	if (!c->static_frames.enabled) {
+		return false;
+	}
+
+	uint64_t hash = ems_nv12_convert_get_hash(nv12_frame);
+
+	bool unchanged = c->static_frames.have_last &&                              //
+	                 hash == c->static_frames.last_hash &&                      //
+	                 nv12_frame->base.width == c->static_frames.last_width &&   //
+	                 nv12_frame->base.height == c->static_frames.last_height && //
+	                 views_equal(views, &c->static_frames.last_views);
+
+	if (unchanged &&                                                            //
+	    c->static_frames.unchanged_count >= c->static_frames.settle_frames &&   //
+	    now_ns - c->static_frames.last_push_ns < c->static_frames.refresh_ns && //
+	    !ems_gstreamer_pipeline_keyframe_pending(c->gstreamer_pipeline)) {
+		return true;
+	}
+
+	if (!unchanged) {
+		c->static_frames.unchanged_count = 0;
+	} else if (c->static_frames.unchanged_count < c->static_frames.settle_frames) {
+		c->static_frames.unchanged_count++;
+	}
+
+	c->static_frames.have_last = true;
+	c->static_frames.last_hash = hash;
+	c->static_frames.last_width = nv12_frame->base.width;
+	c->static_frames.last_height = nv12_frame->base.height;
+	c->static_frames.last_views = *views;
+	c->static_frames.last_push_ns = now_ns;
+
+	return false;
+}
+
+//! Drop our references to the frames of all layers.
+static void
+release_layer_frames(struct ems_compositor *c, struct ems_nv12_frame *frames[])
+{
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		if (frames[i] == NULL) {
+			continue;
+		}
+
+		xrt_frame *frame = &frames[i]->base;
+		xrt_frame_reference(&frame, NULL);
+		frames[i] = NULL;
+	}
+}
+
+/*!
+ * Keeps the images of both views alive and out of the app's hands while the
+ * readback recorded into @p slot still reads from them.
+ */
+static void
+hold_view_images(struct ems_readback_slot *slot,
+                 const struct xrt_layer_projection_view_data *lvd,
+                 const struct xrt_layer_projection_view_data *rvd,
+                 struct comp_swapchain *lsc,
+                 struct comp_swapchain *rsc)
+{
+	struct comp_swapchain *scs[2] = {lsc, rsc};
+	const struct xrt_layer_projection_view_data *vds[2] = {lvd, rvd};
+
+	for (uint32_t view = 0; view < 2; view++) {
+		xrt_swapchain_reference(&slot->xscs[view], &scs[view]->base.base);
+		slot->image_index[view] = vds[view]->sub.image_index;
+		xrt_swapchain_inc_image_use(slot->xscs[view], slot->image_index[view]);
+	}
+}
+
+//! Hands the images held by @ref hold_view_images back, the slot's fence must have signalled.
+static void
+release_view_images(struct ems_readback_slot *slot)
+{
+	for (uint32_t view = 0; view < 2; view++) {
+		if (slot->xscs[view] == NULL) {
+			continue;
+		}
+
+		xrt_swapchain_dec_image_use(slot->xscs[view], slot->image_index[view]);
+		xrt_swapchain_reference(&slot->xscs[view], NULL);
+	}
+}
+
+static void
+push_readback_frame(struct ems_compositor *c,
+                    int64_t frame_id,
+                    struct ems_nv12_frame *frames[],
+                    const struct ems_frame_views *views,
+                    const struct ems_foveation_params *foveation)
+{
+	// The smaller layers are scaled from the same image.
+	uint64_t now_ns = os_monotonic_get_ns();
+	if (is_static_frame(c, frames[0], views, now_ns)) {
+		c->static_frames.skipped++;
+		release_layer_frames(c, frames);
+		return;
+	}
+
+	ems_frame_trace_mark(frame_id, EMS_FRAME_TRACE_STAGE_READBACK, now_ns);
+
+	if (!c->pipeline_playing) {
+		ems_gstreamer_pipeline_play(c->gstreamer_pipeline);
+		c->pipeline_playing = true;
+	}
+
+	set_frame_data(c, frame_id, views);
+
+	u_sink_debug_push_frame(&c->debug_sink, &frames[0]->base);
+
+	uint64_t push_start_ns = os_monotonic_get_ns();
+
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		struct ems_stream_layer *layer = &c->layers[i];
+
+		// Usefull.
+		xrt_frame *frame = &frames[i]->base;
+
+		// HACK, the same timestamp gives all layers the same PTS.
+		frame->timestamp = now_ns;
+		frame->source_timestamp = frame->timestamp;
+		// Lets the frame be followed through the pipeline by the frame tracer.
+		frame->source_sequence = (uint64_t)frame_id;
+		frame->source_id = 0;
+
+		update_foveation_regions(c, layer, frame, views, foveation);
+
+		xrt_sink_push_frame(layer->frame_sink, frame);
+	}
+
+	add_stage_timing(c, EMS_COMP_STAGE_PUSH, os_monotonic_get_ns() - push_start_ns);
+
+	// Dereference the frames - by now we should have pushed them.
+	release_layer_frames(c, frames);
+}
+
+/*!
+ * Can the conversion sample views of this format straight out of the
+ * swapchain. It expects linear colour: the sRGB formats are decoded by the
+ * view and OpenXR treats all other colour formats as linear. Depth and
+ * stencil formats can't be sampled as colour at all.
+ */
+static bool
+is_direct_convert_format(VkFormat format)
+{
+	switch (format) {
+	case VK_FORMAT_R8G8B8A8_SRGB:
+	case VK_FORMAT_B8G8R8A8_SRGB:
+	case VK_FORMAT_R8G8B8A8_UNORM:
+	case VK_FORMAT_B8G8R8A8_UNORM:
+	case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+	case VK_FORMAT_R16G16B16A16_UNORM:
+	case VK_FORMAT_R16G16B16A16_SFLOAT: return true;
+	default: return false;
+	}
+}
+
+static bool
+can_direct_convert(struct ems_compositor *c, struct comp_swapchain *lsc, struct comp_swapchain *rsc)
+{
+	struct comp_swapchain *scs[2] = {lsc, rsc};
+
+	for (uint32_t view = 0; view < 2; view++) {
+		VkFormat format = (VkFormat)scs[view]->vkic.info.format;
+		if (is_direct_convert_format(format)) {
+			continue;
+		}
+
+		if (format != c->logged_unsupported_format) {
+			EMS_COMP_WARN(c, "Can't convert from swapchain format %s directly, using the bounce image.",
+			              vk_format_string(format));
+			c->logged_unsupported_format = format;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+/*!
+ * Creates the bounce image the views are blitted into when the conversion
+ * can't sample them directly, sized for the full readback.
+ */
+static bool
+create_bounce_image(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+	VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
+	VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	VkExtent2D extent = {c->settings.readback_width, c->settings.readback_height};
+	VkResult ret;
+
+	ret = vk_create_image_simple( //
+	    vk,                       // vk_bundle
+	    extent,                   // extent
+	    format,                   // format
+	    usage,                    // usage
+	    &c->bounce.device_memory, // out_mem
+	    &c->bounce.image);        // out_image
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vk_create_image_simple: %s", vk_result_string(ret));
+		return false;
+	}
+
+	VkImageSubresourceRange subresource_range = {
+	    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+	    .baseMipLevel = 0,
+	    .levelCount = 1,
+	    .baseArrayLayer = 0,
+	    .layerCount = 1,
+	};
+
+	ret = vk_create_view(      //
+	    vk,                    // vk_bundle
+	    c->bounce.image,       // image
+	    VK_IMAGE_VIEW_TYPE_2D, // type
+	    format,                // format
+	    subresource_range,     // subresource_range
+	    &c->bounce.view);      // out_view
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vk_create_view: %s", vk_result_string(ret));
+		vk->vkDestroyImage(vk->device, c->bounce.image, NULL);
+		vk->vkFreeMemory(vk->device, c->bounce.device_memory, NULL);
+		c->bounce.image = VK_NULL_HANDLE;
+		c->bounce.device_memory = VK_NULL_HANDLE;
+		return false;
+	}
+
+	return true;
+}
+
+static struct ems_nv12_source
+swapchain_nv12_source(const struct xrt_layer_projection_view_data *vd, struct comp_swapchain *sc)
+{
+	float width = (float)sc->vkic.info.width;
+	float height = (float)sc->vkic.info.height;
+
+	struct ems_nv12_source source = {};
+	source.view = sc->images[vd->sub.image_index].views.no_alpha[vd->sub.array_index];
+	source.rect.x = (float)vd->sub.rect.offset.w / width;
+	source.rect.y = (float)vd->sub.rect.offset.h / height;
+	source.rect.w = (float)vd->sub.rect.extent.w / width;
+	source.rect.h = (float)vd->sub.rect.extent.h / height;
+
+	return source;
+}
+
+/*!
+ * Scales the views straight out of the swapchains into the NV12 frame, no
+ * intermediate image. The swapchain images are already in
+ * VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+ */
+static void
+record_direct_convert(struct ems_compositor *c,
+                      VkCommandBuffer cmd,
+                      const struct xrt_layer_projection_view_data *lvd,
+                      const struct xrt_layer_projection_view_data *rvd,
+                      struct comp_swapchain *lsc,
+                      struct comp_swapchain *rsc,
+                      struct ems_nv12_frame *frames[])
+{
+	struct ems_nv12_source sources[2] = {
+	    swapchain_nv12_source(lvd, lsc),
+	    swapchain_nv12_source(rvd, rsc),
+	};
+
+	// Each layer samples the swapchains at its own size.
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		ems_nv12_convert_record(&c->layers[i].nv12, cmd, sources, frames[i]);
+	}
+}
+
+/*!
+ * Fallback that blits the views side-by-side into the bounce image and
+ * converts that, costs an extra full frame write and read on the GPU.
+ */
+static void
+record_blit_and_convert(struct ems_compositor *c,
+                        VkCommandBuffer cmd,
+                        const struct xrt_layer_projection_view_data *lvd,
+                        const struct xrt_layer_projection_view_data *rvd,
+                        struct comp_swapchain *lsc,
+                        struct comp_swapchain *rsc,
+                        struct ems_nv12_frame *frames[],
+                        uint32_t query_base)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	// The largest layer, the others are scaled down from it by their conversion.
+	const struct xrt_frame *blit_frame = &frames[0]->base;
+
+	// Blit images side-by-side (does scaling).
+	{
+		struct vk_cmd_blit_images_side_by_side_info info = {};
+
+		info.src[0].old_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		info.src[0].src_access_mask = VK_ACCESS_SHADER_READ_BIT;
+		info.src[0].src_stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		info.src[0].rect = lvd->sub.rect;
+		info.src[0].fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
+		info.src[0].fm_image.base_array_layer = lvd->sub.array_index;
+		info.src[0].fm_image.image = lsc->vkic.images[lvd->sub.image_index].handle;
+
+		info.src[1].old_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		info.src[1].src_access_mask = VK_ACCESS_SHADER_READ_BIT;
+		info.src[1].src_stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		info.src[1].rect = rvd->sub.rect;
+		info.src[1].fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
+		info.src[1].fm_image.base_array_layer = rvd->sub.array_index;
+		info.src[1].fm_image.image = rsc->vkic.images[rvd->sub.image_index].handle;
+
+		// Last used by the conversion of the previous frame.
+		info.dst.old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		info.dst.src_access_mask = VK_ACCESS_SHADER_READ_BIT;
+		info.dst.src_stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		// Only the part of the bounce image the frame's size covers is used.
+		info.dst.size = (xrt_size){(int)blit_frame->width, (int)blit_frame->height};
+		info.dst.fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
+		info.dst.fm_image.base_array_layer = 0;
+		info.dst.fm_image.image = c->bounce.image;
+
+		vk_cmd_blit_images_side_by_side_locked(vk, cmd, &info);
+	}
+
+	write_timestamp(c, cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, query_base + 1);
+
+	// Make the bounce image ready for sampling and convert it.
+	{
+		VkImageSubresourceRange first_color_level_subresource_range = {
+		    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+		    .baseMipLevel = 0,
+		    .levelCount = 1,
+		    .baseArrayLayer = 0,
+		    .layerCount = 1,
+		};
+
+		vk_cmd_image_barrier_locked(                  //
+		    vk,                                       // vk_bundle
+		    cmd,                                      // cmdbuffer
+		    c->bounce.image,                          // image
+		    VK_ACCESS_TRANSFER_WRITE_BIT,             // srcAccessMask
+		    VK_ACCESS_SHADER_READ_BIT,                // dstAccessMask
+		    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,     // oldImageLayout
+		    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // newImageLayout
+		    VK_PIPELINE_STAGE_TRANSFER_BIT,           // srcStageMask
+		    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,     // dstStageMask
+		    first_color_level_subresource_range);     // subresourceRange
+
+		// Each view is one half of the blitted area.
+		float w = (float)blit_frame->width / (float)c->settings.readback_width;
+		float h = (float)blit_frame->height / (float)c->settings.readback_height;
+
+		struct ems_nv12_source sources[2] = {};
+		sources[0].view = c->bounce.view;
+		sources[0].rect = (struct xrt_normalized_rect){0.f, 0.f, w / 2.f, h};
+		sources[1].view = c->bounce.view;
+		sources[1].rect = (struct xrt_normalized_rect){w / 2.f, 0.f, w / 2.f, h};
+
+		for (uint32_t i = 0; i < c->layer_count; i++) {
+			ems_nv12_convert_record(&c->layers[i].nv12, cmd, sources, frames[i]);
+		}
+	}
+
+	// Barrier images back.
+	{
+		// Copy views into bounce.
+		for (int view = 0; view < 2; view++) {
+
+			const xrt_layer_projection_view_data *data = (view == 0) ? lvd : rvd;
+			struct comp_swapchain *sc = (view == 0) ? lsc : rsc;
+
+			VkImageLayout srcImageOldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			VkImage srcImage = sc->vkic.images[data->sub.image_index].handle;
+
+			VkImageSubresourceRange view_subresource_range = {
+			    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			    .baseMipLevel = 0,
+			    .levelCount = 1,
+			    .baseArrayLayer = data->sub.array_index,
+			    .layerCount = 1,
+			};
+
+			// Barrier to make source back what it was before
+			vk_cmd_image_barrier_locked(              //
+			    vk,                                   // vk_bundle
+			    cmd,                                  // cmdbuffer
+			    srcImage,                             // image
+			    VK_ACCESS_TRANSFER_READ_BIT,          // srcAccessMask
+			    VK_ACCESS_SHADER_READ_BIT,            // dstAccessMask
+			    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, // oldImageLayout
+			    srcImageOldLayout,                    // newImageLayout
+			    VK_PIPELINE_STAGE_TRANSFER_BIT,       // srcStageMask
+			    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, // dstStageMask
+			    view_subresource_range);              // subresourceRange
+		}
+	}
+}
+
+static void
+record_readback(struct ems_compositor *c,
+                VkCommandBuffer cmd,
+                const struct xrt_layer_projection_view_data *lvd,
+                const struct xrt_layer_projection_view_data *rvd,
+                struct comp_swapchain *lsc,
+                struct comp_swapchain *rsc,
+                struct ems_nv12_frame *frames[],
+                uint32_t query_base,
+                bool bounce)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (c->timing.query_pool != VK_NULL_HANDLE) {
+		vk->vkCmdResetQueryPool(cmd, c->timing.query_pool, query_base, 3);
+	}
+	write_timestamp(c, cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_base);
+
+	if (bounce) {
+		// Writes the timestamp between the blit and the conversion.
+		record_blit_and_convert(c, cmd, lvd, rvd, lsc, rsc, frames, query_base);
+	} else {
+		write_timestamp(c, cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_base + 1);
+		record_direct_convert(c, cmd, lvd, rvd, lsc, rsc, frames);
+	}
+
+	write_timestamp(c, cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_base + 2);
+}
+
+/*!
+ * Ends and submits @p cmd with the slot's fence, the slot must be free.
+ *
+ * Called with the command pool locked.
+ */
+static VkResult
+submit_readback_slot_locked(struct ems_compositor *c, struct ems_readback_slot *slot, VkCommandBuffer cmd)
+{
+	struct vk_bundle *vk = get_vk(c);
+	VkResult ret;
+
+	ret = vk->vkEndCommandBuffer(cmd);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkEndCommandBuffer: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	ret = vk->vkResetFences(vk->device, 1, &slot->fence);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkResetFences: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkSubmitInfo submit_info = {};
+	submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit_info.commandBufferCount = 1;
+	submit_info.pCommandBuffers = &cmd;
+
+	ret = vk_locked_submit(vk, vk->queue, 1, &submit_info, slot->fence);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vk_locked_submit: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	slot->cmd = cmd;
+	slot->submit_ns = os_monotonic_get_ns();
+
+	return VK_SUCCESS;
+}
+
+/*!
+ * Frees the command buffer of a slot whose fence has signalled.
+ */
+static void
+free_readback_slot_cmd(struct ems_compositor *c, struct ems_readback_slot *slot)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	vk_cmd_pool_lock(&c->cmd_pool);
+	vk->vkFreeCommandBuffers(vk->device, c->cmd_pool.pool, 1, &slot->cmd);
+	vk_cmd_pool_unlock(&c->cmd_pool);
+
+	slot->cmd = VK_NULL_HANDLE;
+}
+
+static void *
+readback_thread_func(void *ptr)
+{
+	struct ems_compositor *c = (struct ems_compositor *)ptr;
+	struct vk_bundle *vk = get_vk(c);
+
+	U_TRACE_SET_THREAD_NAME("EMS Readback");
+
+	os_thread_helper_lock(&c->readback.oth);
+
+	while (os_thread_helper_is_running_locked(&c->readback.oth)) {
+		if (c->readback.count == 0) {
+			os_thread_helper_wait_locked(&c->readback.oth);
+			continue;
+		}
+
+		/*
+		 * The slot at head stays owned by us until count is decremented,
+		 * so it is safe to use it without holding the lock.
+		 */
+		struct ems_readback_slot *slot = &c->readback.slots[c->readback.head];
+
+		os_thread_helper_unlock(&c->readback.oth);
+
+		VkResult ret = vk->vkWaitForFences(vk->device, 1, &slot->fence, VK_TRUE, UINT64_MAX);
+		free_readback_slot_cmd(c, slot);
+		release_view_images(slot);
+
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vkWaitForFences: %s", vk_result_string(ret));
+			release_layer_frames(c, slot->frames);
+		} else {
+			uint64_t readback_ns = os_monotonic_get_ns() - slot->submit_ns;
+			add_stage_timing(c, EMS_COMP_STAGE_READBACK_WAIT, readback_ns);
+			uint64_t gpu_ns = add_gpu_stage_timings(c, timestamp_query_base(c, slot), slot->bounced);
+			update_governor(c, readback_ns, gpu_ns);
+			// Takes the references from the slot.
+			push_readback_frame(c, slot->frame_id, slot->frames, &slot->views, &slot->foveation);
+		}
+
+		os_thread_helper_lock(&c->readback.oth);
+
+		c->readback.head = (c->readback.head + 1) % EMS_READBACK_MAX_IN_FLIGHT;
+		c->readback.count--;
+
+		// Wake up layer_commit if it is waiting for a free slot.
+		os_thread_helper_signal_locked(&c->readback.oth);
+	}
+
+	os_thread_helper_unlock(&c->readback.oth);
+
+	return NULL;
+}
+
+/*!
+ * Blocks until there is room for one more readback in flight.
+ *
+ * @return The free slot, or NULL if the completion thread has stopped.
+ */
+static struct ems_readback_slot *
+wait_for_free_readback_slot(struct ems_compositor *c)
+{
+	struct ems_readback_slot *slot = NULL;
+
+	os_thread_helper_lock(&c->readback.oth);
+
+	while (c->readback.count >= EMS_READBACK_MAX_IN_FLIGHT &&
+	       os_thread_helper_is_running_locked(&c->readback.oth)) {
+		os_thread_helper_wait_locked(&c->readback.oth);
+	}
+
+	if (c->readback.count < EMS_READBACK_MAX_IN_FLIGHT) {
+		uint32_t index = (c->readback.head + c->readback.count) % EMS_READBACK_MAX_IN_FLIGHT;
+		slot = &c->readback.slots[index];
+	}
+
+	os_thread_helper_unlock(&c->readback.oth);
+
+	return slot;
+}
+
+/*!
+ * Hands a submitted slot over to the completion thread.
+ */
+static void
+queue_readback_slot(struct ems_compositor *c)
+{
+	os_thread_helper_lock(&c->readback.oth);
+	c->readback.count++;
+	os_thread_helper_signal_locked(&c->readback.oth);
+	os_thread_helper_unlock(&c->readback.oth);
 }
 
+static bool
+is_any_layer_backed_up(struct ems_compositor *c)
+{
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		if (ems_gstreamer_src_is_backed_up(c->layers[i].gstreamer_src)) {
+			return true;
+		}
+	}
 
-/*
- *
- * Frame handling functions.
- *
- */
+	return false;
+}
 
 void
 pack_blit_and_encode(struct ems_compositor *c,
+                     int64_t frame_id,
                      const struct xrt_layer_projection_view_data *lvd,
                      const struct xrt_layer_projection_view_data *rvd,
                      struct comp_swapchain *lsc,
@@ -350,23 +1364,72 @@ pack_blit_and_encode(struct ems_compositor *c,
 	if (c->offset_ns == 0) {
 		uint64_t now = os_monotonic_get_ns();
 		c->offset_ns = now;
-		c->gstreamer_sink->offset_ns = now;
+		for (uint32_t i = 0; i < c->layer_count; i++) {
+			c->layers[i].gstreamer_src->offset_ns = now;
+		}
 	}
+
+	if (c->governor.enabled) {
+		struct ems_governor_level level = ems_governor_get_level(&c->governor.governor);
+
+		if (frame_id % level.frame_divisor != 0) {
+			c->governor.skipped++;
+			return;
+		}
+
+		apply_encode_scale(c, level.scale);
+	}
+
+	// The bounce blit converts the format, otherwise the conversion samples the swapchains as they are.
+	bool bounce = c->bounce.forced || !can_direct_convert(c, lsc, rsc);
+	if (bounce && c->bounce.image == VK_NULL_HANDLE && !create_bounce_image(c)) {
+		EMS_COMP_ERROR(c, "No bounce image to convert through, dropping frame!");
+		return;
+	}
+
+	// The frame would only queue up behind others in front of an encoder, don't spend a readback on it.
+	if (c->backpressure.enabled && is_any_layer_backed_up(c)) {
+		c->backpressure.dropped++;
+		EMS_COMP_TRACE(c, "Encoder backed up, dropping frame %" PRId64, frame_id);
+		return;
+	}
+
 	VkResult ret;
 
-	struct vk_image_readback_to_xf *wrap = NULL;
+	struct ems_nv12_frame *frames[EMS_GSTREAMER_MAX_LAYERS] = {};
 	struct vk_bundle *vk = &c->base.vk;
 
-	// Getting frame
-	if (!vk_image_readback_to_xf_pool_get_unused_frame(vk, c->pool, &wrap)) {
-		EMS_COMP_ERROR(c, "vk_image_readback_to_xf_pool_get_unused_frame: Failed!");
-		return;
+	// In pipelined mode make sure we have somewhere to put this frame first.
+	struct ems_readback_slot *slot = NULL;
+	if (c->readback.enabled) {
+		slot = wait_for_free_readback_slot(c);
+		if (slot == NULL) {
+			EMS_COMP_ERROR(c, "Readback thread not running, dropping frame!");
+			return;
+		}
+	}
+
+	// Getting frames
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		if (!ems_nv12_convert_get_unused_frame(&c->layers[i].nv12, &frames[i])) {
+			EMS_COMP_ERROR(c, "ems_nv12_convert_get_unused_frame: Failed for layer %u!", i);
+			release_layer_frames(c, frames);
+			return;
+		}
 	}
 
-	// Usefull.
-	xrt_frame *frame = &wrap->base_frame;
+	struct ems_frame_views views = {};
+	views.pose[0] = lvd->pose;
+	views.pose[1] = rvd->pose;
+	views.fov[0] = lvd->fov;
+	views.fov[1] = rvd->fov;
+	views.display_time_ns = (int64_t)c->base.slot.data.display_time_ns;
+
+	// The debug UI may change these while the readback thread pushes the frame.
+	struct ems_foveation_params foveation = c->foveation.params;
+	foveation.enabled = foveation.enabled && c->foveation.supported;
 
-	const VkCommandBufferUsageFlags flags = 0;
+	const VkCommandBufferUsageFlags flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 	VkCommandBuffer cmd = {};
 
 	// For submitting commands.
@@ -374,156 +1437,64 @@ pack_blit_and_encode(struct ems_compositor *c,
 
 	ret = vk_cmd_pool_create_and_begin_cmd_buffer_locked(vk, &c->cmd_pool, flags, &cmd);
 	if (ret != VK_SUCCESS) {
+		vk_cmd_pool_unlock(&c->cmd_pool);
 		EMS_COMP_ERROR(c, "vk_cmd_pool_create_and_begin_cmd_buffer_locked: %s", vk_result_string(ret));
-		xrt_frame_reference(&frame, NULL);
+		release_layer_frames(c, frames);
 		return;
 	}
 
-	// Blit images side-by-side (does scaling).
-	{
-		struct vk_cmd_blit_images_side_by_side_info info = {};
-
-		info.src[0].old_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		info.src[0].src_access_mask = VK_ACCESS_SHADER_READ_BIT;
-		info.src[0].src_stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-		info.src[0].rect = lvd->sub.rect;
-		info.src[0].fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.src[0].fm_image.base_array_layer = lvd->sub.array_index;
-		info.src[0].fm_image.image = lsc->vkic.images[lvd->sub.image_index].handle;
-
-		info.src[1].old_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		info.src[1].src_access_mask = VK_ACCESS_SHADER_READ_BIT;
-		info.src[1].src_stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-		info.src[1].rect = rvd->sub.rect;
-		info.src[1].fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.src[1].fm_image.base_array_layer = rvd->sub.array_index;
-		info.src[1].fm_image.image = rsc->vkic.images[rvd->sub.image_index].handle;
-
-		info.dst.old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
-		info.dst.src_access_mask = VK_ACCESS_TRANSFER_READ_BIT;
-		info.dst.src_stage_mask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-		info.dst.size = (xrt_size){READBACK_W, READBACK_H};
-		info.dst.fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.dst.fm_image.base_array_layer = 0;
-		info.dst.fm_image.image = c->bounce.image;
-
-		vk_cmd_blit_images_side_by_side_locked(vk, cmd, &info);
-	}
-
-	// Copy bounce to destination.
-	{
-		struct vk_cmd_copy_image_info info = {};
-
-		info.src.old_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		info.src.src_access_mask = VK_ACCESS_TRANSFER_WRITE_BIT;
-		info.src.src_stage_mask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-		info.src.fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.src.fm_image.base_array_layer = 0;
-		info.src.fm_image.image = c->bounce.image;
-
-		info.dst.old_layout = wrap->layout;
-		info.dst.src_access_mask = VK_ACCESS_HOST_READ_BIT;
-		info.dst.src_stage_mask = VK_PIPELINE_STAGE_HOST_BIT;
-		info.dst.fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.dst.fm_image.base_array_layer = 0;
-		info.dst.fm_image.image = wrap->image;
-
-		info.size = (xrt_size){READBACK_W, READBACK_H};
-
-		vk_cmd_copy_image_locked(vk, cmd, &info);
-	}
-
-	// Barrier images back, or make ready for read.
-	{
-		// Copy views into bounce.
-		for (int view = 0; view < 2; view++) {
+	record_readback(c, cmd, lvd, rvd, lsc, rsc, frames, timestamp_query_base(c, slot), bounce);
 
-			const xrt_layer_projection_view_data *data = (view == 0) ? lvd : rvd;
-			struct comp_swapchain *sc = (view == 0) ? lsc : rsc;
+	// Done submitting commands.
 
-			VkImageLayout srcImageOldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			VkImage srcImage = sc->vkic.images[data->sub.image_index].handle;
+	if (slot == NULL) {
+		// Waits for command to finish.
+		uint64_t submit_ns = os_monotonic_get_ns();
+		ret = vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked(vk, &c->cmd_pool, cmd);
+		uint64_t done_ns = os_monotonic_get_ns();
 
-			VkImageSubresourceRange view_subresource_range = {
-			    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-			    .baseMipLevel = 0,
-			    .levelCount = 1,
-			    .baseArrayLayer = data->sub.array_index,
-			    .layerCount = 1,
-			};
+		// Unlock before checking.
+		vk_cmd_pool_unlock(&c->cmd_pool);
 
-			// Barrier to make source back what it was before
-			vk_cmd_image_barrier_locked(              //
-			    vk,                                   // vk_bundle
-			    cmd,                                  // cmdbuffer
-			    srcImage,                             // image
-			    VK_ACCESS_TRANSFER_READ_BIT,          // srcAccessMask
-			    VK_ACCESS_SHADER_READ_BIT,            // dstAccessMask
-			    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, // oldImageLayout
-			    srcImageOldLayout,                    // newImageLayout
-			    VK_PIPELINE_STAGE_TRANSFER_BIT,       // srcStageMask
-			    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, // dstStageMask
-			    view_subresource_range);              // subresourceRange
+		// Do checking here.
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked: %s",
+			               vk_result_string(ret));
+			release_layer_frames(c, frames);
+			return;
 		}
 
-		VkImageSubresourceRange first_color_level_subresource_range = {
-		    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-		    .baseMipLevel = 0,
-		    .levelCount = 1,
-		    .baseArrayLayer = 0,
-		    .layerCount = 1,
-		};
-
-		// Barrier transfer image to host so we can safely read back.
-		vk_cmd_image_barrier_locked(              //
-		    vk,                                   // vk_bundle
-		    cmd,                                  // cmdbuffer
-		    wrap->image,                          // image
-		    VK_ACCESS_TRANSFER_WRITE_BIT,         // srcAccessMask
-		    VK_ACCESS_HOST_READ_BIT,              // dstAccessMask
-		    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, // oldImageLayout
-		    VK_IMAGE_LAYOUT_GENERAL,              // newImageLayout
-		    VK_PIPELINE_STAGE_TRANSFER_BIT,       // srcStageMask
-		    VK_PIPELINE_STAGE_HOST_BIT,           // dstStageMask
-		    first_color_level_subresource_range); // subresourceRange
+		add_stage_timing(c, EMS_COMP_STAGE_READBACK_WAIT, done_ns - submit_ns);
+		uint64_t gpu_ns = add_gpu_stage_timings(c, timestamp_query_base(c, NULL), bounce);
+		update_governor(c, done_ns - submit_ns, gpu_ns);
+		push_readback_frame(c, frame_id, frames, &views, &foveation);
+		return;
 	}
 
-	// Done submitting commands.
-
-	// Waits for command to finish.
-	ret = vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked(vk, &c->cmd_pool, cmd);
-
-	// Unlock before checking.
-	vk_cmd_pool_unlock(&c->cmd_pool);
-
-	// Do checking here.
+	// Only submits, the completion thread waits on the fence and pushes the frame.
+	ret = submit_readback_slot_locked(c, slot, cmd);
 	if (ret != VK_SUCCESS) {
-		EMS_COMP_ERROR(c, "vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked: %s", vk_result_string(ret));
-		xrt_frame_reference(&frame, NULL);
+		vk->vkFreeCommandBuffers(vk->device, c->cmd_pool.pool, 1, &cmd);
+		vk_cmd_pool_unlock(&c->cmd_pool);
+		release_layer_frames(c, frames);
 		return;
 	}
 
-	// HACK
-	wrap->base_frame.timestamp = os_monotonic_get_ns();
-	wrap->base_frame.source_timestamp = wrap->base_frame.timestamp;
-	wrap->base_frame.source_sequence = c->image_sequence++;
-	wrap->base_frame.source_id = 0;
-	wrap = NULL;
+	vk_cmd_pool_unlock(&c->cmd_pool);
 
-	if (!c->pipeline_playing) {
-		ems_gstreamer_pipeline_play(c->gstreamer_pipeline);
-		c->pipeline_playing = true;
+	// The slot now holds our references.
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		slot->frames[i] = frames[i];
 	}
+	slot->frame_id = frame_id;
+	slot->views = views;
+	slot->foveation = foveation;
+	slot->bounced = bounce;
 
-	u_sink_debug_push_frame(&c->debug_sink, frame);
-
-	xrt_sink_push_frame(c->frame_sink, frame);
-
-
-	// TODO send data channel message with pose and fov here?
+	// The app may reuse the images once we return, the GPU is still reading them.
+	hold_view_images(slot, lvd, rvd, lsc, rsc);
 
-	// Dereference this frame - by now we should have pushed it.
-	xrt_frame_reference(&frame, NULL);
+	queue_readback_slot(c);
 }
 
 
@@ -551,6 +1522,17 @@ ems_compositor_end_session(struct xrt_compositor *xc)
 	return XRT_SUCCESS;
 }
 
+//! The pacer only knows its own schedule, frame times go to it without the client pacing offset.
+static uint64_t
+to_pacer_time(struct ems_compositor *c, int64_t frame_id, uint64_t time_ns)
+{
+	if (!c->client_pacing.enabled) {
+		return time_ns;
+	}
+
+	return ems_pacing_to_pacer_time(&c->client_pacing.pacing, frame_id, time_ns);
+}
+
 static xrt_result_t
 ems_compositor_predict_frame(struct xrt_compositor *xc,
                              int64_t *out_frame_id,
@@ -580,6 +1562,26 @@ ems_compositor_predict_frame(struct xrt_compositor *xc,
 	    out_predicted_display_period_ns, // out_predicted_display_period_ns
 	    &null_min_display_period_ns);    // out_min_display_period_ns
 
+	if (c->client_pacing.enabled) {
+		struct ems_pacing_present_info info;
+		while (ems_pacing_pop_present_info(&c->client_pacing.pacing, &info)) {
+			u_pc_info(                         //
+			    c->upc,                        // upc
+			    info.frame_id,                 // frame_id
+			    info.desired_present_time_ns,  // desired_present_time_ns
+			    info.actual_present_time_ns,   // actual_present_time_ns
+			    info.earliest_present_time_ns, // earliest_present_time_ns
+			    info.present_margin_ns,        // present_margin_ns
+			    now_ns);                       // when_ns
+		}
+
+		ems_pacing_adjust_prediction(       //
+		    &c->client_pacing.pacing,       //
+		    *out_frame_id,                  //
+		    out_wake_time_ns,               //
+		    out_predicted_display_time_ns); //
+	}
+
 	return XRT_SUCCESS;
 }
 
@@ -596,7 +1598,7 @@ ems_compositor_mark_frame(struct xrt_compositor *xc,
 
 	switch (point) {
 	case XRT_COMPOSITOR_FRAME_POINT_WOKE:
-		u_pc_mark_point(c->upc, U_TIMING_POINT_WAKE_UP, frame_id, when_ns);
+		u_pc_mark_point(c->upc, U_TIMING_POINT_WAKE_UP, frame_id, to_pacer_time(c, frame_id, when_ns));
 		return XRT_SUCCESS;
 	default: assert(false);
 	}
@@ -644,7 +1646,8 @@ ems_compositor_layer_commit(struct xrt_compositor *xc, xrt_graphics_sync_handle_
 	// When we begin rendering.
 	{
 		uint64_t now_ns = os_monotonic_get_ns();
-		u_pc_mark_point(c->upc, U_TIMING_POINT_BEGIN, frame_id, now_ns);
+		u_pc_mark_point(c->upc, U_TIMING_POINT_BEGIN, frame_id, to_pacer_time(c, frame_id, now_ns));
+		ems_frame_trace_mark(frame_id, EMS_FRAME_TRACE_STAGE_COMMIT, now_ns);
 	}
 
 	// We want to render here. comp_base filled c->base.slot.layers for us.
@@ -660,7 +1663,7 @@ ems_compositor_layer_commit(struct xrt_compositor *xc, xrt_graphics_sync_handle_
 			struct comp_swapchain *left = layer.sc_array[0];
 			struct comp_swapchain *right = layer.sc_array[1];
 
-			pack_blit_and_encode(c, lvd, rvd, left, right);
+			pack_blit_and_encode(c, frame_id, lvd, rvd, left, right);
 		} break;
 		case XRT_LAYER_STEREO_PROJECTION: {
 			const struct xrt_layer_stereo_projection_data *stereo = &layer.data.stereo;
@@ -670,7 +1673,7 @@ ems_compositor_layer_commit(struct xrt_compositor *xc, xrt_graphics_sync_handle_
 			struct comp_swapchain *left = layer.sc_array[0];
 			struct comp_swapchain *right = layer.sc_array[1];
 
-			pack_blit_and_encode(c, lvd, rvd, left, right);
+			pack_blit_and_encode(c, frame_id, lvd, rvd, left, right);
 		} break;
 		default: U_LOG_E("Unhandled layer type %d", layer.data.type); break;
 		}
@@ -679,7 +1682,7 @@ ems_compositor_layer_commit(struct xrt_compositor *xc, xrt_graphics_sync_handle_
 	// When we are submitting to the GPU.
 	{
 		uint64_t now_ns = os_monotonic_get_ns();
-		u_pc_mark_point(c->upc, U_TIMING_POINT_SUBMIT, frame_id, now_ns);
+		u_pc_mark_point(c->upc, U_TIMING_POINT_SUBMIT, frame_id, to_pacer_time(c, frame_id, now_ns));
 	}
 
 	// Now is a good point to garbage collect.
@@ -744,6 +1747,110 @@ ems_compositor_get_swapchain_create_properties(struct xrt_compositor *xc,
 	return XRT_SUCCESS;
 }
 
+static void
+compositor_handle_frame_report(enum ems_callbacks_event event, const em_proto_UpMessage *message, void *userdata)
+{
+	struct ems_compositor *c = (struct ems_compositor *)userdata;
+
+	if (event == EMS_CALLBACKS_EVENT_FRAME_CLIENT) {
+		if (c->client_pacing.enabled) {
+			ems_pacing_client_changed(&c->client_pacing.pacing);
+		}
+		ems_frame_trace_client_changed();
+		return;
+	}
+
+	if (!message->has_frame) {
+		return;
+	}
+
+	uint64_t now_ns = os_monotonic_get_ns();
+
+	if (c->client_pacing.enabled) {
+		ems_pacing_client_report(&c->client_pacing.pacing, now_ns, &message->frame);
+	}
+
+	ems_frame_trace_client_report(now_ns, &message->frame);
+}
+
+static void
+readback_destroy_fences(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	for (uint32_t i = 0; i < EMS_READBACK_MAX_IN_FLIGHT; i++) {
+		if (c->readback.slots[i].fence != VK_NULL_HANDLE) {
+			vk->vkDestroyFence(vk->device, c->readback.slots[i].fence, NULL);
+			c->readback.slots[i].fence = VK_NULL_HANDLE;
+		}
+	}
+}
+
+/*!
+ * Creates the fences and starts the readback thread, on failure everything
+ * created here is destroyed again and @ref readback_fini must not be called.
+ */
+static bool
+readback_init(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+	VkResult ret;
+
+	VkFenceCreateInfo fence_info = {};
+	fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+	for (uint32_t i = 0; i < EMS_READBACK_MAX_IN_FLIGHT; i++) {
+		ret = vk->vkCreateFence(vk->device, &fence_info, NULL, &c->readback.slots[i].fence);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vkCreateFence: %s", vk_result_string(ret));
+			readback_destroy_fences(c);
+			return false;
+		}
+	}
+
+	if (os_thread_helper_init(&c->readback.oth) != 0) {
+		EMS_COMP_ERROR(c, "Failed to init readback thread helper!");
+		readback_destroy_fences(c);
+		return false;
+	}
+
+	if (os_thread_helper_start(&c->readback.oth, readback_thread_func, c) != 0) {
+		EMS_COMP_ERROR(c, "Failed to start readback thread!");
+		os_thread_helper_destroy(&c->readback.oth);
+		readback_destroy_fences(c);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+readback_fini(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	// Stops the thread, anything still in the ring is retired here.
+	os_thread_helper_destroy(&c->readback.oth);
+
+	while (c->readback.count > 0) {
+		struct ems_readback_slot *slot = &c->readback.slots[c->readback.head];
+
+		vk->vkWaitForFences(vk->device, 1, &slot->fence, VK_TRUE, UINT64_MAX);
+		free_readback_slot_cmd(c, slot);
+
+		release_view_images(slot);
+		release_layer_frames(c, slot->frames);
+
+		c->readback.head = (c->readback.head + 1) % EMS_READBACK_MAX_IN_FLIGHT;
+		c->readback.count--;
+	}
+
+	readback_destroy_fences(c);
+
+	c->readback.enabled = false;
+}
+
 static void
 ems_compositor_destroy(struct xrt_compositor *xc)
 {
@@ -752,14 +1859,54 @@ ems_compositor_destroy(struct xrt_compositor *xc)
 
 	EMS_COMP_DEBUG(c, "EMS_COMP_COMP_DESTROY");
 
-	// Make sure we don't have anything to destroy.
+	if (c->frame_reports_registered) {
+		ems_callbacks_remove(c->callbacks, EMS_CALLBACKS_EVENT_FRAME | EMS_CALLBACKS_EVENT_FRAME_CLIENT,
+		                     compositor_handle_frame_report, c);
+		c->frame_reports_registered = false;
+	}
+
+	if (c->client_pacing.enabled) {
+		ems_pacing_fini(&c->client_pacing.pacing);
+		c->client_pacing.enabled = false;
+	}
+
+	// Needs to be done before the pool and command pool goes away.
+	if (c->readback.enabled) {
+		readback_fini(c);
+	}
+
+	// Make sure we don't have anything to destroy, after the readbacks released their images.
 	comp_swapchain_shared_garbage_collect(&c->base.cscs);
 	comp_swapchain_shared_destroy(&c->base.cscs, vk);
 
-	vk_image_readback_to_xf_pool_destroy(vk, &c->pool);
+	// The readback thread was the last to feed it.
+	if (c->governor.enabled) {
+		ems_governor_fini(&c->governor.governor);
+		c->governor.enabled = false;
+	}
+
+	// Tears down the pipeline, which releases all frames it was holding.
+	xrt_frame_context_destroy_nodes(&c->xfctx);
+
+	// Nothing is left that can mark frames.
+	ems_frame_trace_fini();
+
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		ems_nv12_convert_fini(&c->layers[i].nv12);
+	}
 
 	vk_cmd_pool_destroy(vk, &c->cmd_pool);
 
+	if (c->timing.query_pool != VK_NULL_HANDLE) {
+		vk->vkDestroyQueryPool(vk->device, c->timing.query_pool, NULL);
+		c->timing.query_pool = VK_NULL_HANDLE;
+	}
+
+	if (c->bounce.view != VK_NULL_HANDLE) {
+		vk->vkDestroyImageView(vk->device, c->bounce.view, NULL);
+		c->bounce.view = VK_NULL_HANDLE;
+	}
+
 	if (c->bounce.image != VK_NULL_HANDLE) {
 		vk->vkDestroyImage(vk->device, c->bounce.image, NULL);
 		vk->vkFreeMemory(vk->device, c->bounce.device_memory, NULL);
@@ -783,6 +1930,8 @@ ems_compositor_destroy(struct xrt_compositor *xc)
 
 	u_pc_destroy(&c->upc);
 
+	os_mutex_destroy(&c->timing.mutex);
+
 	free(c);
 }
 
@@ -793,13 +1942,37 @@ ems_compositor_destroy(struct xrt_compositor *xc)
  *
  */
 
+void
+ems_compositor_get_stage_timings(struct ems_compositor *c,
+                                 struct ems_comp_stage_timing out_timings[EMS_COMP_STAGE_COUNT],
+                                 bool reset)
+{
+	os_mutex_lock(&c->timing.mutex);
+
+	for (uint32_t i = 0; i < EMS_COMP_STAGE_COUNT; i++) {
+		out_timings[i] = c->timing.stages[i];
+	}
+
+	if (reset) {
+		U_ZERO_ARRAY(c->timing.stages);
+	}
+
+	os_mutex_unlock(&c->timing.mutex);
+}
+
 xrt_result_t
-ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **out_xsysc)
+ems_compositor_create(ems_instance &emsi, struct ems_compositor **out_c)
 {
 	struct ems_compositor *c = U_TYPED_CALLOC(struct ems_compositor);
 
 	EMS_COMP_DEBUG(c, "Doing init %p", (void *)c);
 
+	// First, so that destroy can always tear it down.
+	if (os_mutex_init(&c->timing.mutex) != 0) {
+		free(c);
+		return XRT_ERROR_ALLOCATION;
+	}
+
 	// Needs to be done before functions are set as override function(s).
 	comp_base_init(&c->base);
 
@@ -823,6 +1996,7 @@ ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **
 	xrt_device *xdev = emsi.xsysd_base.roles.head;
 
 	c->settings.frame_interval_ns = xdev->hmd->screens[0].nominal_frame_interval_ns;
+	compositor_init_sizes(c);
 	c->xdev = xdev;
 
 	EMS_COMP_INFO(c, "Starting Electric Maple Server remote compositor!");
@@ -834,6 +2008,8 @@ ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **
 
 	if (!compositor_init_pacing(c) ||         //
 	    !compositor_init_vulkan(c) ||         //
+	    !compositor_check_readback_size(c) || //
+	    !compositor_init_timing(c) ||         //
 	    !compositor_init_sys_info(c, xdev) || //
 	    !compositor_init_info(c)) {           //
 		EMS_COMP_DEBUG(c, "Failed to init compositor %p", (void *)c);
@@ -842,57 +2018,158 @@ ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **
 		return XRT_ERROR_VULKAN;
 	}
 
-	VkExtent2D readback_extent = {};
-	readback_extent.height = READBACK_H;
-	readback_extent.width = READBACK_W;
+	compositor_init_layers(c);
+
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		struct ems_stream_layer *layer = &c->layers[i];
+
+		// Client encoder branches are fed from the first layer only.
+		uint32_t frame_count = EMS_NV12_POOL_SIZE;
+		if (i == 0) {
+			uint32_t client_encoders = ems_gstreamer_pipeline_max_client_encoders();
+			frame_count += client_encoders * EMS_GSTREAMER_CLIENT_BRANCH_FRAMES;
+		}
+
+		VkResult vk_ret =
+		    ems_nv12_convert_init(&layer->nv12, &c->base.vk, layer->width, layer->height, frame_count);
+		if (vk_ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "ems_nv12_convert_init: %s", vk_result_string(vk_ret));
+			c->base.base.base.destroy(&c->base.base.base);
+
+			return XRT_ERROR_VULKAN;
+		}
+	}
+
+	c->callbacks = emsi.callbacks;
+	c->client_pacing.enabled = debug_get_bool_option_client_pacing();
+	if (c->client_pacing.enabled) {
+		int64_t slack_ns = debug_get_num_option_client_pacing_slack_us() * U_TIME_1MS_IN_NS / 1000;
+		if (ems_pacing_init(&c->client_pacing.pacing, c->settings.frame_interval_ns, slack_ns) != 0) {
+			EMS_COMP_ERROR(c, "Failed to init client pacing, disabling it.");
+			c->client_pacing.enabled = false;
+		}
+	}
+
+	ems_frame_trace_init();
+
+	if (c->client_pacing.enabled || ems_frame_trace_enabled()) {
+		ems_callbacks_add(c->callbacks, EMS_CALLBACKS_EVENT_FRAME | EMS_CALLBACKS_EVENT_FRAME_CLIENT,
+		                  compositor_handle_frame_report, c);
+		c->frame_reports_registered = true;
+	}
+
+	c->foveation.params.enabled = debug_get_bool_option_foveation();
+	c->foveation.params.size = debug_get_float_option_foveation_size();
+	c->foveation.params.delta_qp = (int32_t)debug_get_num_option_foveation_delta_qp();
 
-	vk_image_readback_to_xf_pool_create( //
-	    &c->base.vk,                     // vk_bundle
-	    readback_extent,                 // extent
-	    &c->pool,                        // out_pool
-	    XRT_FORMAT_R8G8B8X8,             // xrt_format
-	    VK_FORMAT_R8G8B8A8_UNORM);       // vk_format
+	c->readback.enabled = debug_get_bool_option_async_readback();
+	if (c->readback.enabled && !readback_init(c)) {
+		EMS_COMP_WARN(c, "Falling back to synchronous readback.");
+		c->readback.enabled = false;
+	}
 
 	u_var_add_root(c, "Electric Maple Server compositor", 0);
 	u_var_add_sink_debug(c, &c->debug_sink, "Debug Sink");
+	u_var_add_ro_u32(c, &c->readback.count, "Readbacks in flight");
+	u_var_add_ro_i64_ns(c, &c->client_pacing.pacing.phase_offset_ns, "Client pacing phase offset");
+	u_var_add_ro_i64_ns(c, &c->client_pacing.pacing.slack_ns, "Client pacing slack");
+
+	uint32_t fps = (uint32_t)(1. / time_ns_to_s(c->settings.frame_interval_ns) + 0.5);
+
+	struct ems_gstreamer_layer_info layer_infos[EMS_GSTREAMER_MAX_LAYERS] = {};
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		layer_infos[i].width = c->layers[i].width;
+		layer_infos[i].height = c->layers[i].height;
+	}
 
-#define EMS_APPSRC_NAME "EMS_source"
+	ems_gstreamer_pipeline_create( //
+	    &c->xfctx,                 //
+	    emsi.callbacks,            //
+	    layer_infos,               //
+	    c->layer_count,            //
+	    fps,                       //
+	    &c->gstreamer_pipeline);   //
+
+	c->static_frames.settle_frames =
+	    ems_gstreamer_encoder_get_refresh_frames(ems_gstreamer_pipeline_get_encoder(c->gstreamer_pipeline), fps);
+
+	// x264enc and most others ignore the ROI meta, there is nothing to gain from marking regions for them.
+	c->foveation.supported = ems_gstreamer_pipeline_get_encoder(c->gstreamer_pipeline)->roi;
+	if (c->foveation.params.enabled && !c->foveation.supported) {
+		EMS_COMP_WARN(c, "EMS_FOVEATION: The %s encoder can't do ROI encoding, foveation disabled.",
+		              ems_gstreamer_pipeline_get_encoder(c->gstreamer_pipeline)->name);
+	}
+	if (c->foveation.supported) {
+		u_var_add_bool(c, &c->foveation.params.enabled, "Foveated encoding");
+		u_var_add_f32(c, &c->foveation.params.size, "Foveal region size");
+		u_var_add_i32(c, &c->foveation.params.delta_qp, "Foveal region delta QP");
+	}
 
-	ems_gstreamer_pipeline_create(&c->xfctx, EMS_APPSRC_NAME, emsi.callbacks, &c->gstreamer_pipeline);
-	gstreamer_sink_create_with_pipeline( //
-	    c->gstreamer_pipeline,           //
-	    READBACK_W,                      //
-	    READBACK_H,                      //
-	    XRT_FORMAT_R8G8B8X8,             //
-	    EMS_APPSRC_NAME,                 //
-	    &c->gstreamer_sink,              //
-	    &c->frame_sink);                 //
+	for (uint32_t i = 0; i < c->layer_count; i++) {
+		struct ems_stream_layer *layer = &c->layers[i];
 
+		ems_gstreamer_src_create_with_pipeline( //
+		    c->gstreamer_pipeline,              //
+		    layer->width,                       //
+		    layer->height,                      //
+		    i,                                  //
+		    &layer->gstreamer_src,              //
+		    &layer->frame_sink);                //
+	}
 
-	// Bounce image for scaling.
-	{
-		VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
-		VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-		VkExtent2D extent = {READBACK_W, READBACK_H};
-		VkResult ret;
-
-		ret = vk_create_image_simple( //
-		    &c->base.vk,              // vk_bundle
-		    extent,                   // extent
-		    format,                   // format
-		    usage,                    // usage
-		    &c->bounce.device_memory, // out_mem
-		    &c->bounce.image);        // out_image
-		if (ret != VK_SUCCESS) {
-			EMS_COMP_DEBUG(c, "vk_create_image_simple: %s", vk_result_string(ret));
-		}
+	c->backpressure.enabled = debug_get_bool_option_drop_stale_frames();
+	u_var_add_bool(c, &c->backpressure.enabled, "Drop frames when the encoder is behind");
+	u_var_add_ro_u64(c, &c->backpressure.dropped, "Frames dropped for the encoder");
+	u_var_add_ro_u32(c, &c->layer_count, "Simulcast layers");
+	u_var_add_ro_u32(c, &c->layers[0].gstreamer_src->appsrc_level, "Frames queued in appsrc");
+	u_var_add_ro_u32(c, &c->layers[0].gstreamer_src->encoder_queue_level, "Frames queued for the encoder");
+	u_var_add_ro_f32(c, &c->layers[0].gstreamer_src->frame_size_mean, "Encoded frame size mean (bytes)");
+	u_var_add_ro_f32(c, &c->layers[0].gstreamer_src->frame_size_stddev, "Encoded frame size stddev (bytes)");
+	u_var_add_ro_u64(c, &c->layers[0].gstreamer_src->frame_size_spikes, "Encoded frames over twice the mean");
+
+	c->static_frames.enabled = debug_get_bool_option_skip_static_frames();
+	c->static_frames.refresh_ns = (uint64_t)debug_get_num_option_static_refresh_ms() * U_TIME_1MS_IN_NS;
+	u_var_add_bool(c, &c->static_frames.enabled, "Skip unchanged frames");
+	u_var_add_ro_u64(c, &c->static_frames.skipped, "Unchanged frames skipped");
+
+	c->governor.enabled = debug_get_bool_option_governor();
+	if (c->governor.enabled && ems_governor_init(&c->governor.governor, c->settings.frame_interval_ns) != 0) {
+		EMS_COMP_ERROR(c, "Failed to init governor, disabling it.");
+		c->governor.enabled = false;
+	}
+	if (c->governor.enabled) {
+		u_var_add_ro_u32(c, &c->governor.governor.level, "Governor level");
+		u_var_add_ro_f32(c, &c->governor.governor.load, "Governor load");
+		u_var_add_ro_u64(c, &c->governor.skipped, "Frames skipped by the governor");
+	}
+
+	// Bounce image for scaling, only when asked for, normally the conversion samples the swapchains.
+	c->bounce.forced = debug_get_bool_option_bounce_image();
+	if (c->bounce.forced && !create_bounce_image(c)) {
+		c->base.base.base.destroy(&c->base.base.base);
+		return XRT_ERROR_VULKAN;
 	}
 
 	EMS_COMP_DEBUG(c, "Done %p", (void *)c);
 
+	*out_c = c;
+
+	return XRT_SUCCESS;
+}
+
+xrt_result_t
+ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **out_xsysc)
+{
+	struct ems_compositor *c = NULL;
+
+	xrt_result_t xret = ems_compositor_create(emsi, &c);
+	if (xret != XRT_SUCCESS) {
+		return xret;
+	}
+
 	// Standard app pacer.
 	struct u_pacing_app_factory *upaf = NULL;
-	XRT_MAYBE_UNUSED xrt_result_t xret = u_pa_factory_create(&upaf);
+	xret = u_pa_factory_create(&upaf);
 	assert(xret == XRT_SUCCESS && upaf != NULL);
 
 	return comp_multi_create_system_compositor(&c->base.base, upaf, &c->sys_info, false, out_xsysc);
@@ -21,6 +21,7 @@
 #include "xrt/xrt_instance.h"
 
 #include "os/os_time.h"
+#include "os/os_threading.h"
 
 #include "util/u_threading.h"
 #include "util/u_logging.h"
@@ -31,8 +32,12 @@
 #include "util/comp_base.h"
 
 #include "gstreamer/gst_pipeline.h"
-#include "gstreamer/gst_sink.h"
 #include "gst/ems_gstreamer_pipeline.h"
+#include "gst/ems_gstreamer_src.h"
+
+#include "ems_nv12_convert.h"
+#include "ems_pacing.h"
+#include "ems_governor.h"
 
 
 #include "ems_server_internal.h"
@@ -81,6 +86,132 @@ struct ems_comp_frame
 	uint64_t present_slop_ns;
 };
 
+/*!
+ * Stages of getting a frame from the app's swapchains to the encoder that the
+ * compositor keeps timings for.
+ *
+ * @ingroup comp_ems
+ */
+enum ems_comp_stage
+{
+	//! GPU time of the side-by-side blit into the bounce image, only for frames that use it.
+	EMS_COMP_STAGE_BOUNCE_BLIT,
+	//! GPU time of the NV12 conversion, which writes the readback buffer.
+	EMS_COMP_STAGE_CONVERT,
+	//! From submitting the GPU work until the CPU has seen it complete.
+	EMS_COMP_STAGE_READBACK_WAIT,
+	//! Pushing the finished frame into the sink.
+	EMS_COMP_STAGE_PUSH,
+
+	EMS_COMP_STAGE_COUNT,
+};
+
+/*!
+ * Accumulated timing of one @ref ems_comp_stage.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_comp_stage_timing
+{
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+};
+
+/*!
+ * Pose and fov of the two views a frame was rendered with, kept alongside the
+ * readback so it is available when the frame is pushed and can be sent to the
+ * client with it.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_frame_views
+{
+	struct xrt_pose pose[2];
+	struct xrt_fov fov[2];
+
+	//! Display time the app predicted for the frame, in our clock.
+	int64_t display_time_ns;
+};
+
+/*!
+ * Foveated encoding settings, taken once per frame when the readback is
+ * recorded so the thread pushing the frame never reads the ones being edited.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_foveation_params
+{
+	bool enabled;
+
+	//! Size of the foveal region as a fraction of each eye.
+	float size;
+
+	//! QP offset for the foveal region, negative is better quality.
+	int32_t delta_qp;
+};
+
+/*!
+ * One resolution each frame is encoded at, with its own NV12 conversion and
+ * encoder branch. Layer 0 is the configured readback size, the others are
+ * smaller versions of the same frame for clients on worse links.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_stream_layer
+{
+	//! Of the configured readback size.
+	float scale;
+
+	//! Size the layer was created with, the governor may make frames smaller.
+	uint32_t width, height;
+
+	//! Converts the views to NV12 and owns the readback buffers.
+	struct ems_nv12_convert nv12;
+
+	struct ems_gstreamer_src *gstreamer_src;
+	struct xrt_frame_sink *frame_sink;
+};
+
+/*!
+ * A submitted readback that the completion thread has not pushed yet.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_readback_slot
+{
+	//! Command buffer holding the blit and copy, freed once the fence signals.
+	VkCommandBuffer cmd;
+
+	//! Signalled by the GPU when @ref cmd has completed, owned by the slot.
+	VkFence fence;
+
+	//! Frame of each layer being read back into, we hold a reference.
+	struct ems_nv12_frame *frames[EMS_GSTREAMER_MAX_LAYERS];
+
+	//! Swapchain of each view being read from, we hold a reference until the fence signals.
+	struct xrt_swapchain *xscs[2];
+
+	//! Image of @ref xscs being read from, we hold a use of it so the app can't render into it.
+	uint32_t image_index[2];
+
+	//! Frame id from the app that this readback belongs to.
+	int64_t frame_id;
+
+	//! Views the frame was rendered with.
+	struct ems_frame_views views;
+
+	//! Foveation settings the frame is encoded with.
+	struct ems_foveation_params foveation;
+
+	//! When the GPU work was submitted, for the readback wait timing.
+	uint64_t submit_ns;
+
+	//! The views went through the bounce image, so the blit was timed.
+	bool bounced;
+};
+
 /*!
  * Main compositor struct tying everything in the compositor together.
  *
@@ -94,6 +225,12 @@ struct ems_compositor
 	// This thing should outlive us
 	struct ems_instance *instance;
 
+	//! Owned by the instance, we register for client frame reports on it.
+	struct ems_callbacks *callbacks;
+
+	//! Have we registered for frame reports, for pacing or frame tracing.
+	bool frame_reports_registered;
+
 	//! The device we are displaying to.
 	struct xrt_device *xdev;
 
@@ -106,6 +243,12 @@ struct ems_compositor
 
 		//! Frame interval that we are using.
 		uint64_t frame_interval_ns;
+
+		//! Per-view size recommended to applications.
+		uint32_t view_width, view_height;
+
+		//! Size of the side-by-side image that is read back and encoded.
+		uint32_t readback_width, readback_height;
 	} settings;
 
 	// Kept here for convenience.
@@ -127,20 +270,148 @@ struct ems_compositor
 
 	struct vk_cmd_pool cmd_pool = {};
 
-	struct vk_image_readback_to_xf_pool *pool = nullptr;
-	int image_sequence;
+	//! The resolutions we encode at, set from EMS_SIMULCAST_LAYERS.
+	struct ems_stream_layer layers[EMS_GSTREAMER_MAX_LAYERS] = {};
+	uint32_t layer_count;
 	struct u_sink_debug debug_sink;
 
+	/*!
+	 * Pipelined readback: layer_commit only submits the GPU work and a
+	 * completion thread waits for it and pushes the finished frames.
+	 */
+	struct
+	{
+		//! Submit and wait asynchronously, set from EMS_ASYNC_READBACK.
+		bool enabled;
+
+		//! Completion thread, its mutex also protects the ring below.
+		struct os_thread_helper oth;
+
+		//! Ring of submitted readbacks, oldest at @ref head.
+		struct ems_readback_slot slots[EMS_READBACK_MAX_IN_FLIGHT];
+
+		//! Index of the oldest submitted slot.
+		uint32_t head;
+
+		//! Number of submitted slots not yet retired.
+		uint32_t count;
+	} readback;
+
+	//! Phase locks frame production to the client, see @ref ems_pacing.
+	struct
+	{
+		//! Set from EMS_CLIENT_PACING.
+		bool enabled;
+
+		struct ems_pacing pacing;
+	} client_pacing;
+
+	//! Skipping frames the encoder has no room for, see @ref ems_gstreamer_src_is_backed_up.
+	struct
+	{
+		//! Set from EMS_DROP_STALE_FRAMES.
+		bool enabled;
+
+		//! Frames not read back because the encoder was behind.
+		uint64_t dropped;
+	} backpressure;
+
+	//! Lowers encode resolution and frame rate under load, see @ref ems_governor.
+	struct
+	{
+		//! Set from EMS_GOVERNOR.
+		bool enabled;
+
+		struct ems_governor governor;
+
+		//! Frames not read back to lower the frame rate.
+		uint64_t skipped;
+	} governor;
+
+	/*!
+	 * Not encoding frames that look the same as the last one sent, the
+	 * client keeps showing that one. Only touched by whichever thread
+	 * pushes frames.
+	 */
 	struct
 	{
+		//! Set from EMS_SKIP_STATIC_FRAMES.
+		bool enabled;
+
+		//! Longest time to go without sending a frame, for recovering from loss.
+		uint64_t refresh_ns;
+
+		//! Unchanged frames still sent after a change, one intra refresh period of the encoder.
+		uint32_t settle_frames;
+
+		//! Unchanged frames sent since the last change, counts up to settle_frames.
+		uint32_t unchanged_count;
+
+		//! Last frame sent.
+		bool have_last;
+		uint64_t last_hash;
+		uint32_t last_width, last_height;
+		struct ems_frame_views last_views;
+		uint64_t last_push_ns;
+
+		//! Frames not sent because nothing changed.
+		uint64_t skipped;
+	} static_frames;
+
+	/*!
+	 * Foveated encoding, marks a region around the centre of each eye to
+	 * be encoded at higher quality than the periphery.
+	 */
+	struct
+	{
+		/*!
+		 * Set from the EMS_FOVEATION options and edited from the debug
+		 * UI, only read by layer_commit which takes a copy per frame.
+		 */
+		struct ems_foveation_params params;
+
+		//! The encoder uses the regions, otherwise foveation is never enabled.
+		bool supported;
+	} foveation;
+
+	//! Per-stage timings, see @ref ems_compositor_get_stage_timings.
+	struct
+	{
+		//! Protects @ref stages, they are written from the commit and readback threads.
+		struct os_mutex mutex;
+
+		struct ems_comp_stage_timing stages[EMS_COMP_STAGE_COUNT];
+
+		//! Timestamps around the blit and conversion, three per readback slot.
+		VkQueryPool query_pool;
+
+		//! Nanoseconds per timestamp tick.
+		float timestamp_period_ns;
+	} timing;
+
+	/*!
+	 * Fallback intermediate image the views are blitted into before the
+	 * conversion. Created with EMS_BOUNCE_IMAGE, or on the first frame
+	 * from a swapchain format the conversion can't sample, otherwise the
+	 * conversion samples the swapchains directly.
+	 */
+	struct
+	{
+		//! Set from EMS_BOUNCE_IMAGE, every frame goes through the bounce image.
+		bool forced;
+
 		VkDeviceMemory device_memory;
 		VkImage image;
+
+		//! sRGB view sampled by the NV12 conversion.
+		VkImageView view;
 	} bounce;
 
+	//! Swapchain format the conversion can't sample that was last logged, to only log it once.
+	VkFormat logged_unsupported_format;
+
 	bool pipeline_playing = false;
 	struct gstreamer_pipeline *gstreamer_pipeline;
-	struct gstreamer_sink *gstreamer_sink;
-	struct xrt_frame_sink *frame_sink;
 
 	uint64_t offset_ns;
 };
@@ -165,6 +436,17 @@ ems_compositor(struct xrt_compositor *xc)
 	return (struct ems_compositor *)xc;
 }
 
+/*!
+ * Copy out the stage timings accumulated so far, optionally starting over.
+ *
+ * @public @memberof ems_compositor
+ * @ingroup comp_ems
+ */
+void
+ems_compositor_get_stage_timings(struct ems_compositor *c,
+                                 struct ems_comp_stage_timing out_timings[EMS_COMP_STAGE_COUNT],
+                                 bool reset);
+
 /*!
  * Spew level logging.
  *
@@ -0,0 +1,466 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Per-frame latency tracing from layer commit to client display.
+ * @ingroup comp_ems
+ */
+
+#include "ems_frame_trace.h"
+#include "ems_clock_offset.h"
+
+#include "os/os_threading.h"
+
+#include "util/u_misc.h"
+#include "util/u_var.h"
+#include "util/u_time.h"
+#include "util/u_debug.h"
+#include "util/u_logging.h"
+
+#include "electricmaple.pb.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+
+
+DEBUG_GET_ONCE_BOOL_OPTION(frame_trace, "EMS_FRAME_TRACE", false)
+DEBUG_GET_ONCE_OPTION(frame_trace_file, "EMS_FRAME_TRACE_FILE", "ems_frame_trace.csv")
+
+//! Frames being traced at the same time, must cover everything in flight up to client display.
+#define RECORD_COUNT (128)
+
+//! Histogram resolution, 0.1ms.
+#define BIN_NS (100 * 1000)
+
+//! Bins up to 200ms, anything above lands in the last bin.
+#define BIN_COUNT (2000)
+
+//! Once warmed up, the percentiles are only recomputed every this many samples.
+#define PERCENTILE_INTERVAL (32)
+
+/*!
+ * Histogram of each stage is the time from the previous stage, the commit
+ * stage has no previous so its slot holds the total time spent on the server.
+ */
+#define HIST_SERVER (EMS_FRAME_TRACE_STAGE_COMMIT)
+#define HIST_TOTAL (EMS_FRAME_TRACE_STAGE_COUNT)
+
+//! From handing the frame to the encoder to its first packet, what slicing the frame shortens.
+#define HIST_FIRST_PACKET (EMS_FRAME_TRACE_STAGE_COUNT + 1)
+#define HIST_COUNT (EMS_FRAME_TRACE_STAGE_COUNT + 2)
+
+static const char *hist_names[HIST_COUNT] = {
+    "commit to payloaded",
+    "commit to readback",
+    "readback to push",
+    "push to encoded",
+    "encoded to payloaded",
+    "payloaded to decoded",
+    "decoded to displayed",
+    "commit to displayed",
+    "push to first packet",
+};
+
+struct histogram
+{
+	uint32_t bins[BIN_COUNT];
+	uint64_t count;
+	uint64_t max_ns;
+
+	//! For the debug UI, see @ref PERCENTILE_INTERVAL.
+	float p50_ms, p95_ms, p99_ms;
+};
+
+struct record
+{
+	int64_t frame_id;
+
+	uint64_t pts;
+	bool have_pts;
+
+	//! When each stage was reached, zero if it has not been.
+	uint64_t ns[EMS_FRAME_TRACE_STAGE_COUNT];
+};
+
+/*!
+ * There is only ever one frame stream, and the marks come from the
+ * compositor, the GStreamer streaming threads and the data channel, so keep
+ * one tracer for the process instead of threading it through all of them.
+ */
+static struct
+{
+	//! Only written by init and fini, when nothing else is running.
+	bool enabled;
+
+	//! Protects everything below.
+	struct os_mutex mutex;
+
+	//! Client report times are in the clock of the client the reports come from, only ever one.
+	struct ems_clock_offset clock;
+
+	struct record records[RECORD_COUNT];
+
+	struct histogram hists[HIST_COUNT];
+
+	uint64_t frames_displayed;
+
+	struct u_var_button dump_button;
+	struct u_var_button reset_button;
+} trace;
+
+
+/*
+ *
+ * Helpers.
+ *
+ */
+
+static float
+percentile_ms(const struct histogram *h, double p)
+{
+	uint64_t target = (uint64_t)ceil(p * (double)h->count);
+	uint64_t seen = 0;
+
+	for (uint32_t i = 0; i < BIN_COUNT; i++) {
+		seen += h->bins[i];
+		if (seen >= target) {
+			// Upper edge of the bin, so we never under report.
+			return (float)((i + 1) * BIN_NS) / (float)U_TIME_1MS_IN_NS;
+		}
+	}
+
+	return (float)(BIN_COUNT * BIN_NS) / (float)U_TIME_1MS_IN_NS;
+}
+
+static void
+update_percentiles(struct histogram *h)
+{
+	h->p50_ms = percentile_ms(h, 0.50);
+	h->p95_ms = percentile_ms(h, 0.95);
+	h->p99_ms = percentile_ms(h, 0.99);
+}
+
+static void
+histogram_add_locked(struct histogram *h, uint64_t start_ns, uint64_t end_ns)
+{
+	// Client times are estimates, they can land slightly before a server time.
+	uint64_t delta_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+	uint64_t bin = MIN(delta_ns / BIN_NS, BIN_COUNT - 1);
+
+	h->bins[bin]++;
+	h->count++;
+	h->max_ns = MAX(h->max_ns, delta_ns);
+
+	// Walking the bins is not free, the UI does not need every sample.
+	if (h->count < PERCENTILE_INTERVAL || h->count % PERCENTILE_INTERVAL == 0) {
+		update_percentiles(h);
+	}
+}
+
+static struct record *
+find_by_frame_id_locked(int64_t frame_id)
+{
+	struct record *r = &trace.records[(uint64_t)frame_id % RECORD_COUNT];
+
+	return r->frame_id == frame_id ? r : NULL;
+}
+
+static struct record *
+find_by_pts_locked(uint64_t pts)
+{
+	for (uint32_t i = 0; i < RECORD_COUNT; i++) {
+		struct record *r = &trace.records[i];
+		if (r->have_pts && r->pts == pts) {
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+mark_locked(struct record *r, enum ems_frame_trace_stage stage, uint64_t when_ns)
+{
+	if (r->ns[stage] != 0) {
+		return;
+	}
+
+	r->ns[stage] = when_ns;
+
+	if (stage > EMS_FRAME_TRACE_STAGE_COMMIT && r->ns[stage - 1] != 0) {
+		histogram_add_locked(&trace.hists[stage], r->ns[stage - 1], when_ns);
+	}
+
+	uint64_t commit_ns = r->ns[EMS_FRAME_TRACE_STAGE_COMMIT];
+	if (commit_ns == 0) {
+		return;
+	}
+
+	if (stage == EMS_FRAME_TRACE_STAGE_PAYLOADED) {
+		histogram_add_locked(&trace.hists[HIST_SERVER], commit_ns, when_ns);
+
+		uint64_t push_ns = r->ns[EMS_FRAME_TRACE_STAGE_PUSH];
+		if (push_ns != 0) {
+			histogram_add_locked(&trace.hists[HIST_FIRST_PACKET], push_ns, when_ns);
+		}
+	} else if (stage == EMS_FRAME_TRACE_STAGE_DISPLAYED) {
+		histogram_add_locked(&trace.hists[HIST_TOTAL], commit_ns, when_ns);
+		trace.frames_displayed++;
+	}
+}
+
+static void
+reset_locked(void)
+{
+	U_ZERO_ARRAY(trace.hists);
+	trace.frames_displayed = 0;
+}
+
+static void
+dump_button_cb(void *ptr)
+{
+	ems_frame_trace_dump(debug_get_option_frame_trace_file());
+}
+
+static void
+reset_button_cb(void *ptr)
+{
+	os_mutex_lock(&trace.mutex);
+	reset_locked();
+	os_mutex_unlock(&trace.mutex);
+}
+
+static void
+add_vars(void)
+{
+	u_var_add_root(&trace, "Electric Maple frame trace", false);
+	u_var_add_ro_u64(&trace, &trace.frames_displayed, "Frames traced to display");
+
+	for (uint32_t i = 0; i < HIST_COUNT; i++) {
+		struct histogram *h = &trace.hists[i];
+		char name[64];
+
+		snprintf(name, sizeof(name), "%s p50 (ms)", hist_names[i]);
+		u_var_add_ro_f32(&trace, &h->p50_ms, name);
+		snprintf(name, sizeof(name), "%s p95 (ms)", hist_names[i]);
+		u_var_add_ro_f32(&trace, &h->p95_ms, name);
+		snprintf(name, sizeof(name), "%s p99 (ms)", hist_names[i]);
+		u_var_add_ro_f32(&trace, &h->p99_ms, name);
+	}
+
+	trace.dump_button.cb = dump_button_cb;
+	trace.reset_button.cb = reset_button_cb;
+	u_var_add_button(&trace, &trace.dump_button, "Dump to EMS_FRAME_TRACE_FILE");
+	u_var_add_button(&trace, &trace.reset_button, "Reset");
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+void
+ems_frame_trace_init(void)
+{
+	if (!debug_get_bool_option_frame_trace()) {
+		return;
+	}
+
+	if (os_mutex_init(&trace.mutex) != 0) {
+		U_LOG_E("Failed to init frame trace mutex, not tracing.");
+		return;
+	}
+
+	ems_clock_offset_init(&trace.clock);
+
+	for (uint32_t i = 0; i < RECORD_COUNT; i++) {
+		trace.records[i].frame_id = -1;
+	}
+
+	add_vars();
+
+	trace.enabled = true;
+
+	U_LOG_I("Tracing frame latency, will dump to '%s'", debug_get_option_frame_trace_file());
+}
+
+void
+ems_frame_trace_fini(void)
+{
+	if (!trace.enabled) {
+		return;
+	}
+
+	ems_frame_trace_dump(debug_get_option_frame_trace_file());
+
+	u_var_remove_root(&trace);
+
+	trace.enabled = false;
+	os_mutex_destroy(&trace.mutex);
+}
+
+bool
+ems_frame_trace_enabled(void)
+{
+	return trace.enabled;
+}
+
+void
+ems_frame_trace_mark(int64_t frame_id, enum ems_frame_trace_stage stage, uint64_t when_ns)
+{
+	if (!trace.enabled || frame_id < 0) {
+		return;
+	}
+
+	os_mutex_lock(&trace.mutex);
+
+	struct record *r = NULL;
+	if (stage == EMS_FRAME_TRACE_STAGE_COMMIT) {
+		// Reuse the oldest record, whatever was left in it never made it through.
+		r = &trace.records[(uint64_t)frame_id % RECORD_COUNT];
+		U_ZERO(r);
+		r->frame_id = frame_id;
+	} else {
+		r = find_by_frame_id_locked(frame_id);
+	}
+
+	if (r != NULL) {
+		mark_locked(r, stage, when_ns);
+	}
+
+	os_mutex_unlock(&trace.mutex);
+}
+
+void
+ems_frame_trace_mark_push(int64_t frame_id, uint64_t pts, uint64_t when_ns)
+{
+	if (!trace.enabled || frame_id < 0) {
+		return;
+	}
+
+	os_mutex_lock(&trace.mutex);
+
+	struct record *r = find_by_frame_id_locked(frame_id);
+	if (r != NULL) {
+		r->pts = pts;
+		r->have_pts = true;
+		mark_locked(r, EMS_FRAME_TRACE_STAGE_PUSH, when_ns);
+	}
+
+	os_mutex_unlock(&trace.mutex);
+}
+
+void
+ems_frame_trace_mark_pts(uint64_t pts, enum ems_frame_trace_stage stage, uint64_t when_ns)
+{
+	if (!trace.enabled) {
+		return;
+	}
+
+	os_mutex_lock(&trace.mutex);
+
+	struct record *r = find_by_pts_locked(pts);
+	if (r != NULL) {
+		mark_locked(r, stage, when_ns);
+	}
+
+	os_mutex_unlock(&trace.mutex);
+}
+
+void
+ems_frame_trace_client_report(uint64_t now_ns, const em_proto_UpFrameMessage *msg)
+{
+	if (!trace.enabled || msg->begin_frame_time == 0) {
+		return;
+	}
+
+	os_mutex_lock(&trace.mutex);
+
+	/*
+	 * The offset includes the smallest one-way delay seen, so mapped client
+	 * times are late by about that much, which is good enough for telling
+	 * the stages apart.
+	 */
+	ems_clock_offset_add_sample(&trace.clock, now_ns, msg->begin_frame_time);
+
+	struct record *r = msg->frame_sequence_id > 0 ? find_by_frame_id_locked(msg->frame_sequence_id) : NULL;
+	if (r != NULL) {
+		if (msg->decode_complete_time != 0) {
+			uint64_t decoded_ns = ems_clock_offset_to_server(&trace.clock, msg->decode_complete_time);
+			mark_locked(r, EMS_FRAME_TRACE_STAGE_DECODED, decoded_ns);
+		}
+		if (msg->display_time != 0) {
+			uint64_t displayed_ns = ems_clock_offset_to_server(&trace.clock, msg->display_time);
+			mark_locked(r, EMS_FRAME_TRACE_STAGE_DISPLAYED, displayed_ns);
+		}
+	}
+
+	os_mutex_unlock(&trace.mutex);
+}
+
+void
+ems_frame_trace_client_changed(void)
+{
+	if (!trace.enabled) {
+		return;
+	}
+
+	os_mutex_lock(&trace.mutex);
+	ems_clock_offset_init(&trace.clock);
+	os_mutex_unlock(&trace.mutex);
+}
+
+bool
+ems_frame_trace_dump(const char *path)
+{
+	if (!trace.enabled) {
+		return false;
+	}
+
+	// Copy so the marks are not blocked on file IO.
+	struct histogram *hists = U_TYPED_ARRAY_CALLOC(struct histogram, HIST_COUNT);
+
+	os_mutex_lock(&trace.mutex);
+	memcpy(hists, trace.hists, sizeof(trace.hists));
+	os_mutex_unlock(&trace.mutex);
+
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		U_LOG_E("Could not open '%s' for writing the frame trace", path);
+		free(hists);
+		return false;
+	}
+
+	fprintf(file, "# stage, count, p50_ms, p95_ms, p99_ms, max_ms\n");
+	for (uint32_t i = 0; i < HIST_COUNT; i++) {
+		struct histogram *h = &hists[i];
+		update_percentiles(h);
+		fprintf(file, "# %s, %" PRIu64 ", %.1f, %.1f, %.1f, %.1f\n", hist_names[i], h->count, h->p50_ms,
+		        h->p95_ms, h->p99_ms, (double)h->max_ns / U_TIME_1MS_IN_NS);
+	}
+
+	fprintf(file, "stage,bin_start_ms,count\n");
+	for (uint32_t i = 0; i < HIST_COUNT; i++) {
+		const struct histogram *h = &hists[i];
+		for (uint32_t k = 0; k < BIN_COUNT; k++) {
+			if (h->bins[k] == 0) {
+				continue;
+			}
+			double bin_start_ms = (double)(k * BIN_NS) / U_TIME_1MS_IN_NS;
+			fprintf(file, "%s,%.1f,%u\n", hist_names[i], bin_start_ms, h->bins[k]);
+		}
+	}
+
+	fclose(file);
+	free(hists);
+
+	U_LOG_I("Wrote frame trace to '%s'", path);
+
+	return true;
+}
@@ -0,0 +1,109 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Per-frame latency tracing from layer commit to client display.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _em_proto_UpFrameMessage em_proto_UpFrameMessage;
+
+
+/*!
+ * The points a frame passes on its way to the client's display, in order.
+ *
+ * @ingroup comp_ems
+ */
+enum ems_frame_trace_stage
+{
+	//! The app committed the layers, the frame id is assigned here.
+	EMS_FRAME_TRACE_STAGE_COMMIT,
+	//! The NV12 readback of the frame is on the host.
+	EMS_FRAME_TRACE_STAGE_READBACK,
+	//! Pushed into the appsrc.
+	EMS_FRAME_TRACE_STAGE_PUSH,
+	//! Came out of the encoder.
+	EMS_FRAME_TRACE_STAGE_ENCODED,
+	//! Came out of the RTP payloader, about to go to the network.
+	EMS_FRAME_TRACE_STAGE_PAYLOADED,
+	//! Decoded on the client, mapped into our clock.
+	EMS_FRAME_TRACE_STAGE_DECODED,
+	//! Displayed on the client, mapped into our clock.
+	EMS_FRAME_TRACE_STAGE_DISPLAYED,
+
+	EMS_FRAME_TRACE_STAGE_COUNT,
+};
+
+/*!
+ * Start tracing if enabled with the EMS_FRAME_TRACE environment variable,
+ * all other functions are cheap no-ops when it is not.
+ */
+void
+ems_frame_trace_init(void);
+
+/*!
+ * Dump the histograms if tracing was enabled and stop tracing, nothing may
+ * call into the tracer anymore.
+ */
+void
+ems_frame_trace_fini(void);
+
+bool
+ems_frame_trace_enabled(void);
+
+/*!
+ * Record that the frame reached @p stage at @p when_ns, only the first mark
+ * of each stage is kept. Marking @ref EMS_FRAME_TRACE_STAGE_COMMIT starts a
+ * new record for the frame.
+ */
+void
+ems_frame_trace_mark(int64_t frame_id, enum ems_frame_trace_stage stage, uint64_t when_ns);
+
+/*!
+ * Mark @ref EMS_FRAME_TRACE_STAGE_PUSH and remember the buffer PTS, so the
+ * frame can be found from inside the GStreamer pipeline.
+ */
+void
+ems_frame_trace_mark_push(int64_t frame_id, uint64_t pts, uint64_t when_ns);
+
+/*!
+ * Like @ref ems_frame_trace_mark but finds the frame from the buffer PTS.
+ */
+void
+ems_frame_trace_mark_pts(uint64_t pts, enum ems_frame_trace_stage stage, uint64_t when_ns);
+
+/*!
+ * Feed a frame report from the client received at @p now_ns, the decode and
+ * display times are marked on the reported frame.
+ */
+void
+ems_frame_trace_client_report(uint64_t now_ns, const em_proto_UpFrameMessage *msg);
+
+/*!
+ * The reports come from a different client from now on, its clock has
+ * nothing to do with the last one's. Only one client is traced at a time.
+ */
+void
+ems_frame_trace_client_changed(void);
+
+/*!
+ * Write the histograms as CSV to @p path.
+ */
+bool
+ems_frame_trace_dump(const char *path);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,131 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Stepping encode resolution and frame rate with the server load.
+ * @ingroup comp_ems
+ */
+
+#include "ems_governor.h"
+
+#include "util/u_misc.h"
+#include "util/u_logging.h"
+
+
+//! Weight of a new load sample in the filtered load.
+#define LOAD_FILTER_ALPHA (0.1f)
+
+//! Step down above this load, the stage can't finish a frame per interval.
+#define STEP_DOWN_LOAD (0.9f)
+
+//! Step up below this load, a level up costs up to about twice as much.
+#define STEP_UP_LOAD (0.45f)
+
+//! Frames to let a new level settle before stepping down again.
+#define SETTLE_FRAMES (30)
+
+//! Frames of headroom needed before stepping up, keeps us from flapping.
+#define STEP_UP_FRAMES (180)
+
+//! From full quality down, resolution goes first as it degrades the most gracefully.
+static const struct ems_governor_level ladder[] = {
+    {1.0f, 1},
+    {0.75f, 1},
+    {0.5f, 1},
+    {0.5f, 2},
+};
+
+
+/*
+ *
+ * Helpers.
+ *
+ */
+
+static void
+set_level_locked(struct ems_governor *g, uint32_t level)
+{
+	U_LOG_I("Governor: level %u -> %u (scale %.2f, every %u frame(s)), load %.2f", g->level, level,
+	        ladder[level].scale, ladder[level].frame_divisor, g->load);
+
+	g->level = level;
+	g->frames_at_level = 0;
+	g->change_count++;
+
+	// The old level's load says little about the new one.
+	g->load = 0.f;
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+int
+ems_governor_init(struct ems_governor *g, uint64_t frame_interval_ns)
+{
+	g->frame_interval_ns = frame_interval_ns;
+	g->level = 0;
+
+	return os_mutex_init(&g->mutex);
+}
+
+void
+ems_governor_fini(struct ems_governor *g)
+{
+	os_mutex_destroy(&g->mutex);
+}
+
+bool
+ems_governor_update(struct ems_governor *g, uint64_t busy_ns, uint64_t dropped_frames)
+{
+	bool changed = false;
+
+	os_mutex_lock(&g->mutex);
+
+	// With a frame divisor we only need to finish a frame every few intervals.
+	uint64_t budget_ns = g->frame_interval_ns * ladder[g->level].frame_divisor;
+	float sample = (float)busy_ns / (float)budget_ns;
+
+	if (g->frames_at_level == 0) {
+		g->load = sample;
+	} else {
+		g->load += LOAD_FILTER_ALPHA * (sample - g->load);
+	}
+	g->frames_at_level++;
+
+	bool dropped = dropped_frames > g->last_dropped;
+	g->last_dropped = dropped_frames;
+
+	bool settled = g->frames_at_level >= SETTLE_FRAMES;
+	uint32_t last = ARRAY_SIZE(ladder) - 1;
+
+	if (settled && (g->load > STEP_DOWN_LOAD || dropped) && g->level < last) {
+		set_level_locked(g, g->level + 1);
+		changed = true;
+	} else if (g->frames_at_level >= STEP_UP_FRAMES && g->load < STEP_UP_LOAD && !dropped && g->level > 0) {
+		set_level_locked(g, g->level - 1);
+		changed = true;
+	} else if (dropped) {
+		// Restart the wait for headroom.
+		g->frames_at_level = MIN(g->frames_at_level, SETTLE_FRAMES);
+	}
+
+	os_mutex_unlock(&g->mutex);
+
+	return changed;
+}
+
+struct ems_governor_level
+ems_governor_get_level(struct ems_governor *g)
+{
+	os_mutex_lock(&g->mutex);
+	struct ems_governor_level level = ladder[g->level];
+	os_mutex_unlock(&g->mutex);
+
+	return level;
+}
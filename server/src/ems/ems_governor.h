@@ -0,0 +1,101 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Stepping encode resolution and frame rate with the server load.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_defines.h"
+
+#include "os/os_threading.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*!
+ * One step of the quality ladder.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_governor_level
+{
+	//! Applied to the configured readback size.
+	float scale;
+
+	//! Only every n-th frame is encoded.
+	uint32_t frame_divisor;
+};
+
+/*!
+ * Watches how long the slowest stage of getting a frame encoded takes
+ * compared to the frame interval. When we can't keep up it steps down a
+ * ladder of lower encode resolutions and then a halved frame rate, and
+ * steps back up once there is headroom again. That way a heavy scene makes
+ * the stream softer instead of stutter.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_governor
+{
+	//! Protects everything below, frames complete on the readback thread.
+	struct os_mutex mutex;
+
+	uint64_t frame_interval_ns;
+
+	//! Index into the ladder, zero is full quality.
+	uint32_t level;
+
+	//! Filtered busy time over frame interval, above one we can't keep up.
+	float load;
+
+	//! Frames seen since the last level change.
+	uint32_t frames_at_level;
+
+	//! Dropped frame count at the last update, new drops mean overload.
+	uint64_t last_dropped;
+
+	//! Number of level changes, for the debug UI.
+	uint64_t change_count;
+};
+
+/*!
+ * @public @memberof ems_governor
+ */
+int
+ems_governor_init(struct ems_governor *g, uint64_t frame_interval_ns);
+
+/*!
+ * @public @memberof ems_governor
+ */
+void
+ems_governor_fini(struct ems_governor *g);
+
+/*!
+ * Feed the time the busiest stage spent on a frame and the total number of
+ * frames dropped because the encoder was behind.
+ *
+ * @return True if the level changed.
+ * @public @memberof ems_governor
+ */
+bool
+ems_governor_update(struct ems_governor *g, uint64_t busy_ns, uint64_t dropped_frames);
+
+/*!
+ * The level frames should be produced at now.
+ *
+ * @public @memberof ems_governor
+ */
+struct ems_governor_level
+ems_governor_get_level(struct ems_governor *g);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,514 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  GPU RGBA to NV12 conversion and readback buffers.
+ * @ingroup comp_ems
+ */
+
+#include "ems_nv12_convert.h"
+
+#include "util/u_misc.h"
+#include "util/u_logging.h"
+
+#include "shaders/rgba_to_nv12.comp.h"
+
+#include <assert.h>
+
+
+/*!
+ * Must match the shader.
+ */
+struct nv12_push_constants
+{
+	int32_t width;
+	int32_t height;
+	uint32_t hash_offset;
+	int32_t _pad;
+	//! Offset and extent per view, a vec4 is 16 byte aligned.
+	float rects[2][4];
+};
+
+//! Each invocation handles a 4x2 block.
+#define BLOCK_W (4)
+#define BLOCK_H (2)
+
+//! Must match local_size in the shader.
+#define WORKGROUP_SIZE (8)
+
+
+/*
+ *
+ * Frame pool.
+ *
+ */
+
+static void
+frame_destroy(struct xrt_frame *xf)
+{
+	struct ems_nv12_frame *frame = container_of(xf, struct ems_nv12_frame, base);
+	struct ems_nv12_convert *conv = frame->conv;
+
+	os_mutex_lock(&conv->pool_mutex);
+	frame->in_use = false;
+	os_mutex_unlock(&conv->pool_mutex);
+}
+
+static VkResult
+create_frame(struct ems_nv12_convert *conv, struct ems_nv12_frame *frame)
+{
+	struct vk_bundle *vk = conv->vk;
+	VkResult ret;
+
+	VkBufferCreateInfo buffer_info = {};
+	buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	buffer_info.size = conv->hash_offset + EMS_NV12_HASH_SIZE;
+	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	ret = vk->vkCreateBuffer(vk->device, &buffer_info, NULL, &frame->buffer);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateBuffer: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkMemoryRequirements requirements = {};
+	vk->vkGetBufferMemoryRequirements(vk->device, frame->buffer, &requirements);
+
+	// Cached memory makes the CPU reads a lot faster, not available everywhere.
+	uint32_t memory_type_index = 0;
+	VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+	                               VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+	VkMemoryPropertyFlags coherent = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	if (!vk_get_memory_type(vk, requirements.memoryTypeBits, cached, &memory_type_index) &&
+	    !vk_get_memory_type(vk, requirements.memoryTypeBits, coherent, &memory_type_index)) {
+		VK_ERROR(vk, "No host visible memory type for NV12 buffer!");
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+
+	VkMemoryAllocateInfo alloc_info = {};
+	alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	alloc_info.allocationSize = requirements.size;
+	alloc_info.memoryTypeIndex = memory_type_index;
+
+	ret = vk->vkAllocateMemory(vk->device, &alloc_info, NULL, &frame->memory);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkAllocateMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	ret = vk->vkBindBufferMemory(vk->device, frame->buffer, frame->memory, 0);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkBindBufferMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	void *data = NULL;
+	ret = vk->vkMapMemory(vk->device, frame->memory, 0, VK_WHOLE_SIZE, 0, &data);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkMapMemory: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkDescriptorSetAllocateInfo set_info = {};
+	set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	set_info.descriptorPool = conv->descriptor_pool;
+	set_info.descriptorSetCount = 1;
+	set_info.pSetLayouts = &conv->descriptor_set_layout;
+
+	ret = vk->vkAllocateDescriptorSets(vk->device, &set_info, &frame->descriptor_set);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkAllocateDescriptorSets: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	frame->conv = conv;
+	frame->base.destroy = frame_destroy;
+	frame->base.data = (uint8_t *)data;
+	frame->base.format = XRT_FORMAT_L8;
+	frame->base.stereo_format = XRT_STEREO_FORMAT_SBS;
+
+	return VK_SUCCESS;
+}
+
+static void
+destroy_frame(struct ems_nv12_convert *conv, struct ems_nv12_frame *frame)
+{
+	struct vk_bundle *vk = conv->vk;
+
+	assert(!frame->in_use);
+
+	// The descriptor sets are freed with the pool.
+	if (frame->memory != VK_NULL_HANDLE) {
+		// Implicitly unmapped.
+		vk->vkFreeMemory(vk->device, frame->memory, NULL);
+		frame->memory = VK_NULL_HANDLE;
+	}
+
+	if (frame->buffer != VK_NULL_HANDLE) {
+		vk->vkDestroyBuffer(vk->device, frame->buffer, NULL);
+		frame->buffer = VK_NULL_HANDLE;
+	}
+
+	frame->base.data = NULL;
+}
+
+
+/*
+ *
+ * Pipeline.
+ *
+ */
+
+static VkResult
+create_pipeline(struct ems_nv12_convert *conv)
+{
+	struct vk_bundle *vk = conv->vk;
+	VkResult ret;
+
+	ret = vk_create_sampler(vk, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, &conv->sampler);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vk_create_sampler: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkShaderModuleCreateInfo module_info = {};
+	module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	module_info.codeSize = sizeof(shaders_rgba_to_nv12_comp);
+	module_info.pCode = shaders_rgba_to_nv12_comp;
+
+	ret = vk->vkCreateShaderModule(vk->device, &module_info, NULL, &conv->shader_module);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateShaderModule: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkDescriptorPoolSize pool_sizes[2] = {
+	    {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 * conv->frame_count},
+	    {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, conv->frame_count},
+	};
+
+	VkDescriptorPoolCreateInfo pool_info = {};
+	pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	pool_info.maxSets = conv->frame_count;
+	pool_info.poolSizeCount = ARRAY_SIZE(pool_sizes);
+	pool_info.pPoolSizes = pool_sizes;
+
+	ret = vk->vkCreateDescriptorPool(vk->device, &pool_info, NULL, &conv->descriptor_pool);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateDescriptorPool: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkDescriptorSetLayoutBinding bindings[3] = {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[0].descriptorCount = 1;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[1].descriptorCount = 1;
+	bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[2].binding = 2;
+	bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	bindings[2].descriptorCount = 1;
+	bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+	VkDescriptorSetLayoutCreateInfo set_layout_info = {};
+	set_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	set_layout_info.bindingCount = ARRAY_SIZE(bindings);
+	set_layout_info.pBindings = bindings;
+
+	ret = vk->vkCreateDescriptorSetLayout(vk->device, &set_layout_info, NULL, &conv->descriptor_set_layout);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateDescriptorSetLayout: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkPushConstantRange push_range = {};
+	push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	push_range.offset = 0;
+	push_range.size = sizeof(struct nv12_push_constants);
+
+	VkPipelineLayoutCreateInfo layout_info = {};
+	layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layout_info.setLayoutCount = 1;
+	layout_info.pSetLayouts = &conv->descriptor_set_layout;
+	layout_info.pushConstantRangeCount = 1;
+	layout_info.pPushConstantRanges = &push_range;
+
+	ret = vk->vkCreatePipelineLayout(vk->device, &layout_info, NULL, &conv->pipeline_layout);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreatePipelineLayout: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	VkComputePipelineCreateInfo pipeline_info = {};
+	pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipeline_info.stage.module = conv->shader_module;
+	pipeline_info.stage.pName = "main";
+	pipeline_info.layout = conv->pipeline_layout;
+
+	ret = vk->vkCreateComputePipelines(vk->device, VK_NULL_HANDLE, 1, &pipeline_info, NULL, &conv->pipeline);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "vkCreateComputePipelines: %s", vk_result_string(ret));
+		return ret;
+	}
+
+	return VK_SUCCESS;
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+VkResult
+ems_nv12_convert_init(
+    struct ems_nv12_convert *conv, struct vk_bundle *vk, uint32_t width, uint32_t height, uint32_t frame_count)
+{
+	VkResult ret;
+
+	if (width % BLOCK_W != 0 || height % BLOCK_H != 0) {
+		VK_ERROR(vk, "NV12 size %ux%u must be a multiple of %ux%u", width, height, BLOCK_W, BLOCK_H);
+		return VK_ERROR_INITIALIZATION_FAILED;
+	}
+
+	if (frame_count == 0 || frame_count > EMS_NV12_MAX_POOL_SIZE) {
+		VK_ERROR(vk, "NV12 pool of %u frames, must be 1 to %u", frame_count, EMS_NV12_MAX_POOL_SIZE);
+		return VK_ERROR_INITIALIZATION_FAILED;
+	}
+
+	conv->vk = vk;
+	conv->max_width = width;
+	conv->max_height = height;
+	conv->frame_count = frame_count;
+	conv->width = width;
+	conv->height = height;
+	conv->size = (VkDeviceSize)width * height * 3 / 2;
+	// Already a multiple of four with the size restrictions.
+	conv->hash_offset = conv->size;
+
+	if (os_mutex_init(&conv->pool_mutex) != 0) {
+		VK_ERROR(vk, "Failed to init pool mutex!");
+		return VK_ERROR_INITIALIZATION_FAILED;
+	}
+
+	ret = create_pipeline(conv);
+	if (ret != VK_SUCCESS) {
+		return ret;
+	}
+
+	for (uint32_t i = 0; i < conv->frame_count; i++) {
+		ret = create_frame(conv, &conv->frames[i]);
+		if (ret != VK_SUCCESS) {
+			return ret;
+		}
+	}
+
+	return VK_SUCCESS;
+}
+
+void
+ems_nv12_convert_fini(struct ems_nv12_convert *conv)
+{
+	struct vk_bundle *vk = conv->vk;
+
+	if (vk == NULL) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < conv->frame_count; i++) {
+		destroy_frame(conv, &conv->frames[i]);
+	}
+
+#define D(TYPE, thing)                                                                                                 \
+	if (thing != VK_NULL_HANDLE) {                                                                                 \
+		vk->vkDestroy##TYPE(vk->device, thing, NULL);                                                          \
+		thing = VK_NULL_HANDLE;                                                                                \
+	}
+
+	D(Pipeline, conv->pipeline);
+	D(PipelineLayout, conv->pipeline_layout);
+	D(DescriptorSetLayout, conv->descriptor_set_layout);
+	D(DescriptorPool, conv->descriptor_pool);
+	D(ShaderModule, conv->shader_module);
+	D(Sampler, conv->sampler);
+
+#undef D
+
+	os_mutex_destroy(&conv->pool_mutex);
+
+	conv->vk = NULL;
+}
+
+bool
+ems_nv12_convert_set_size(struct ems_nv12_convert *conv, uint32_t width, uint32_t height)
+{
+	if (width % BLOCK_W != 0 || height % BLOCK_H != 0 || width > conv->max_width || height > conv->max_height) {
+		U_LOG_E("NV12 size %ux%u must be a multiple of %ux%u and fit in %ux%u", width, height, BLOCK_W,
+		        BLOCK_H, conv->max_width, conv->max_height);
+		return false;
+	}
+
+	conv->width = width;
+	conv->height = height;
+	conv->size = (VkDeviceSize)width * height * 3 / 2;
+
+	return true;
+}
+
+bool
+ems_nv12_convert_get_unused_frame(struct ems_nv12_convert *conv, struct ems_nv12_frame **out_frame)
+{
+	struct ems_nv12_frame *frame = NULL;
+
+	os_mutex_lock(&conv->pool_mutex);
+
+	for (uint32_t i = 0; i < conv->frame_count; i++) {
+		if (!conv->frames[i].in_use) {
+			frame = &conv->frames[i];
+			frame->in_use = true;
+			break;
+		}
+	}
+
+	os_mutex_unlock(&conv->pool_mutex);
+
+	if (frame == NULL) {
+		return false;
+	}
+
+	// Tightly packed at whatever the size is now.
+	frame->base.width = conv->width;
+	frame->base.height = conv->height;
+	frame->base.stride = conv->width;
+	frame->base.size = conv->size;
+
+	// Give the caller the first reference.
+	struct xrt_frame *xf = NULL;
+	frame->base.reference.count = 0;
+	xrt_frame_reference(&xf, &frame->base);
+
+	*out_frame = frame;
+
+	return true;
+}
+
+uint64_t
+ems_nv12_convert_get_hash(const struct ems_nv12_frame *frame)
+{
+	const uint32_t *hash = (const uint32_t *)(frame->base.data + frame->conv->hash_offset);
+
+	return ((uint64_t)hash[1] << 32) | hash[0];
+}
+
+void
+ems_nv12_convert_record(struct ems_nv12_convert *conv,
+                        VkCommandBuffer cmd,
+                        const struct ems_nv12_source sources[2],
+                        struct ems_nv12_frame *frame)
+{
+	struct vk_bundle *vk = conv->vk;
+
+	// The frame is not in flight, so it's safe to update its set here.
+	VkDescriptorImageInfo image_infos[2] = {};
+	for (uint32_t i = 0; i < 2; i++) {
+		image_infos[i].sampler = conv->sampler;
+		image_infos[i].imageView = sources[i].view;
+		image_infos[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	}
+
+	VkDescriptorBufferInfo buffer_info = {};
+	buffer_info.buffer = frame->buffer;
+	buffer_info.offset = 0;
+	buffer_info.range = VK_WHOLE_SIZE;
+
+	VkWriteDescriptorSet writes[3] = {};
+	for (uint32_t i = 0; i < 2; i++) {
+		writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[i].dstSet = frame->descriptor_set;
+		writes[i].dstBinding = i;
+		writes[i].descriptorCount = 1;
+		writes[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		writes[i].pImageInfo = &image_infos[i];
+	}
+	writes[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writes[2].dstSet = frame->descriptor_set;
+	writes[2].dstBinding = 2;
+	writes[2].descriptorCount = 1;
+	writes[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	writes[2].pBufferInfo = &buffer_info;
+
+	vk->vkUpdateDescriptorSets(vk->device, ARRAY_SIZE(writes), writes, 0, NULL);
+
+	struct nv12_push_constants constants = {};
+	constants.width = (int32_t)frame->base.width;
+	constants.height = (int32_t)frame->base.height;
+	constants.hash_offset = (uint32_t)(conv->hash_offset / sizeof(uint32_t));
+	for (uint32_t i = 0; i < 2; i++) {
+		constants.rects[i][0] = sources[i].rect.x;
+		constants.rects[i][1] = sources[i].rect.y;
+		constants.rects[i][2] = sources[i].rect.w;
+		constants.rects[i][3] = sources[i].rect.h;
+	}
+
+	// The shader accumulates into the hash.
+	vk->vkCmdFillBuffer(cmd, frame->buffer, conv->hash_offset, EMS_NV12_HASH_SIZE, 0);
+
+	VkBufferMemoryBarrier clear_barrier = {};
+	clear_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	clear_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	clear_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	clear_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	clear_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	clear_barrier.buffer = frame->buffer;
+	clear_barrier.offset = conv->hash_offset;
+	clear_barrier.size = EMS_NV12_HASH_SIZE;
+
+	vk->vkCmdPipelineBarrier(cmd,                                  //
+	                         VK_PIPELINE_STAGE_TRANSFER_BIT,       // srcStageMask
+	                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, // dstStageMask
+	                         0,                                    // dependencyFlags
+	                         0, NULL,                              // memoryBarriers
+	                         1, &clear_barrier,                    // bufferMemoryBarriers
+	                         0, NULL);                             // imageMemoryBarriers
+
+	vk->vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, conv->pipeline);
+	vk->vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, conv->pipeline_layout, 0, 1,
+	                            &frame->descriptor_set, 0, NULL);
+	vk->vkCmdPushConstants(cmd, conv->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+	                       &constants);
+
+	uint32_t blocks_x = frame->base.width / BLOCK_W;
+	uint32_t blocks_y = frame->base.height / BLOCK_H;
+	vk->vkCmdDispatch(cmd,                                                //
+	                  (blocks_x + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, //
+	                  (blocks_y + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, //
+	                  1);                                               //
+
+	// Make the writes visible to the host once the fence has signalled.
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = frame->buffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+
+	vk->vkCmdPipelineBarrier(cmd,                                  //
+	                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, // srcStageMask
+	                         VK_PIPELINE_STAGE_HOST_BIT,           // dstStageMask
+	                         0,                                    // dependencyFlags
+	                         0, NULL,                              // memoryBarriers
+	                         1, &barrier,                          // bufferMemoryBarriers
+	                         0, NULL);                             // imageMemoryBarriers
+}
@@ -0,0 +1,203 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  GPU RGBA to NV12 conversion and readback buffers.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_frame.h"
+
+#include "os/os_threading.h"
+
+#include "vk/vk_helpers.h"
+
+#include "gst/ems_gstreamer_pipeline.h"
+#include "gst/ems_gstreamer_src.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*!
+ * How many readback frames may be in flight on the GPU at the same time.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_READBACK_MAX_IN_FLIGHT (3)
+
+/*!
+ * Number of NV12 readback buffers of a layer, needs to cover the frames in
+ * flight on the GPU plus whatever is held downstream at the same time. The
+ * GStreamer buffers wrap this memory, so that is every frame in the appsrc,
+ * in front of and inside the encoder. One more is kept by the debug sink.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_NV12_POOL_SIZE                                                                                             \
+	(EMS_READBACK_MAX_IN_FLIGHT + 1 + EMS_GSTREAMER_SRC_MAX_QUEUED_FRAMES + EMS_GSTREAMER_ENCODER_FRAMES)
+
+/*!
+ * Largest pool, the first layer also feeds every client encoder branch.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_NV12_MAX_POOL_SIZE                                                                                         \
+	(EMS_NV12_POOL_SIZE + EMS_GSTREAMER_MAX_CLIENT_ENCODERS * EMS_GSTREAMER_CLIENT_BRANCH_FRAMES)
+
+/*!
+ * Bytes after the planes of each buffer holding the hash of the frame, two
+ * uints accumulated by the conversion shader.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_NV12_HASH_SIZE (8)
+
+struct ems_nv12_convert;
+
+/*!
+ * A host visible buffer holding one tightly packed NV12 image, the Y plane
+ * followed by the interleaved CbCr plane. Returned to the pool when the last
+ * reference to @ref base is dropped.
+ *
+ * The xrt_frame is described as a L8 image of the luma plane, so generic
+ * sinks like the debug sink can look at it, @ref xrt_frame::size covers both
+ * planes.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_nv12_frame
+{
+	struct xrt_frame base;
+
+	//! Owning converter.
+	struct ems_nv12_convert *conv;
+
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+
+	//! Updated when recording, only while the frame is not in flight.
+	VkDescriptorSet descriptor_set;
+
+	//! Protected by the pool mutex on the converter.
+	bool in_use;
+};
+
+/*!
+ * One of the two views going into the side-by-side NV12 image.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_nv12_source
+{
+	//! Must be in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+	VkImageView view;
+
+	//! Part of the image to use, in normalized coordinates.
+	struct xrt_normalized_rect rect;
+};
+
+/*!
+ * Compute pipeline scaling two sRGB views side by side and converting them to
+ * NV12 (BT.709 limited range), written straight into a pool of host visible
+ * buffers for readback.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_nv12_convert
+{
+	struct vk_bundle *vk;
+
+	//! Largest size of the luma plane, the buffers are allocated for this.
+	uint32_t max_width, max_height;
+
+	//! Size of the luma plane frames are handed out with, width is a multiple of 4 and height of 2.
+	uint32_t width, height;
+
+	//! Size in bytes of both planes at the current size.
+	VkDeviceSize size;
+
+	//! Where the frame hash goes in each buffer, after the largest planes.
+	VkDeviceSize hash_offset;
+
+	VkSampler sampler;
+	VkShaderModule shader_module;
+	VkDescriptorPool descriptor_pool;
+	VkDescriptorSetLayout descriptor_set_layout;
+	VkPipelineLayout pipeline_layout;
+	VkPipeline pipeline;
+
+	//! Protects the in_use field of the frames.
+	struct os_mutex pool_mutex;
+
+	//! Frames in the pool, at most @ref EMS_NV12_MAX_POOL_SIZE.
+	uint32_t frame_count;
+	struct ems_nv12_frame frames[EMS_NV12_MAX_POOL_SIZE];
+};
+
+/*!
+ * Create the pipeline and a pool of @p frame_count buffers.
+ *
+ * @public @memberof ems_nv12_convert
+ */
+VkResult
+ems_nv12_convert_init(
+    struct ems_nv12_convert *conv, struct vk_bundle *vk, uint32_t width, uint32_t height, uint32_t frame_count);
+
+/*!
+ * Destroy everything, no frames may be in flight or referenced.
+ *
+ * @public @memberof ems_nv12_convert
+ */
+void
+ems_nv12_convert_fini(struct ems_nv12_convert *conv);
+
+/*!
+ * Change the size of frames handed out from now on, at most the size the
+ * converter was created with. Frames already handed out keep their size.
+ *
+ * @public @memberof ems_nv12_convert
+ */
+bool
+ems_nv12_convert_set_size(struct ems_nv12_convert *conv, uint32_t width, uint32_t height);
+
+/*!
+ * Get a free frame from the pool, the caller holds one reference to it.
+ *
+ * @public @memberof ems_nv12_convert
+ */
+bool
+ems_nv12_convert_get_unused_frame(struct ems_nv12_convert *conv, struct ems_nv12_frame **out_frame);
+
+/*!
+ * Hash of the NV12 image written into @p frame, computed by the conversion.
+ * Only valid once the GPU work is done.
+ *
+ * @public @memberof ems_nv12_convert
+ */
+uint64_t
+ems_nv12_convert_get_hash(const struct ems_nv12_frame *frame);
+
+/*!
+ * Record the conversion of the left and right @p sources into @p frame
+ * followed by a barrier making the buffer available to the host. Each source
+ * is scaled to fill its half of the frame, at the size the frame was handed
+ * out with.
+ *
+ * @public @memberof ems_nv12_convert
+ */
+void
+ems_nv12_convert_record(struct ems_nv12_convert *conv,
+                        VkCommandBuffer cmd,
+                        const struct ems_nv12_source sources[2],
+                        struct ems_nv12_frame *frame);
+
+
+#ifdef __cplusplus
+}
+#endif
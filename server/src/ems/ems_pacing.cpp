@@ -0,0 +1,229 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Phase locking server frame production to client frame reports.
+ * @ingroup comp_ems
+ */
+
+#include "ems_pacing.h"
+
+#include "util/u_misc.h"
+#include "util/u_logging.h"
+
+#include "electricmaple.pb.h"
+
+
+//! Weight of a new slack sample in the filtered slack.
+#define SLACK_FILTER_ALPHA (0.1)
+
+//! Fraction of the slack error corrected per report.
+#define PHASE_GAIN (0.25)
+
+//! Largest phase correction per report, keeps a single outlier from jumping.
+#define MAX_PHASE_STEP_NS (500 * 1000)
+
+
+/*
+ *
+ * Helpers.
+ *
+ */
+
+//! Keep the offset within half a frame either way, a full frame is the same phase.
+static int64_t
+wrap_phase(int64_t offset_ns, int64_t interval_ns)
+{
+	while (offset_ns > interval_ns / 2) {
+		offset_ns -= interval_ns;
+	}
+	while (offset_ns <= -interval_ns / 2) {
+		offset_ns += interval_ns;
+	}
+
+	return offset_ns;
+}
+
+static bool
+find_frame_locked(struct ems_pacing *p,
+                  int64_t frame_id,
+                  uint64_t *out_desired_present_time_ns,
+                  int64_t *out_offset_ns)
+{
+	for (uint32_t i = 0; i < EMS_PACING_FRAME_HISTORY; i++) {
+		if (p->frames[i].frame_id == frame_id) {
+			*out_desired_present_time_ns = p->frames[i].desired_present_time_ns;
+			*out_offset_ns = p->frames[i].offset_ns;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static uint64_t
+unshift(uint64_t time_ns, int64_t offset_ns)
+{
+	return (uint64_t)((int64_t)time_ns - offset_ns);
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+int
+ems_pacing_init(struct ems_pacing *p, uint64_t frame_interval_ns, int64_t target_slack_ns)
+{
+	p->frame_interval_ns = frame_interval_ns;
+	p->target_slack_ns = target_slack_ns;
+	ems_clock_offset_init(&p->clock);
+
+	for (uint32_t i = 0; i < EMS_PACING_FRAME_HISTORY; i++) {
+		p->frames[i].frame_id = -1;
+	}
+
+	return os_mutex_init(&p->mutex);
+}
+
+void
+ems_pacing_fini(struct ems_pacing *p)
+{
+	os_mutex_destroy(&p->mutex);
+}
+
+void
+ems_pacing_adjust_prediction(struct ems_pacing *p,
+                             int64_t frame_id,
+                             uint64_t *inout_wake_up_time_ns,
+                             uint64_t *inout_predicted_display_time_ns)
+{
+	os_mutex_lock(&p->mutex);
+
+	int64_t offset_ns = p->phase_offset_ns;
+
+	p->frames[p->next_frame].frame_id = frame_id;
+	p->frames[p->next_frame].desired_present_time_ns = *inout_predicted_display_time_ns;
+	p->frames[p->next_frame].offset_ns = offset_ns;
+	p->next_frame = (p->next_frame + 1) % EMS_PACING_FRAME_HISTORY;
+
+	*inout_wake_up_time_ns = (uint64_t)((int64_t)*inout_wake_up_time_ns + offset_ns);
+	*inout_predicted_display_time_ns = (uint64_t)((int64_t)*inout_predicted_display_time_ns + offset_ns);
+
+	os_mutex_unlock(&p->mutex);
+}
+
+uint64_t
+ems_pacing_to_pacer_time(struct ems_pacing *p, int64_t frame_id, uint64_t time_ns)
+{
+	uint64_t desired_present_time_ns = 0;
+	int64_t offset_ns = 0;
+
+	os_mutex_lock(&p->mutex);
+	find_frame_locked(p, frame_id, &desired_present_time_ns, &offset_ns);
+	os_mutex_unlock(&p->mutex);
+
+	return unshift(time_ns, offset_ns);
+}
+
+void
+ems_pacing_client_report(struct ems_pacing *p, uint64_t now_ns, const em_proto_UpFrameMessage *msg)
+{
+	if (msg->decode_complete_time == 0 || msg->begin_frame_time == 0) {
+		return;
+	}
+
+	os_mutex_lock(&p->mutex);
+
+	ems_clock_offset_add_sample(&p->clock, now_ns, msg->begin_frame_time);
+
+	// The client reports every frame, but only the first use of a decoded frame says anything about phase.
+	if (msg->decode_complete_time == p->last_decode_complete_time) {
+		os_mutex_unlock(&p->mutex);
+		return;
+	}
+	p->last_decode_complete_time = msg->decode_complete_time;
+
+	int64_t slack_ns = msg->begin_frame_time - msg->decode_complete_time;
+	int64_t interval_ns = (int64_t)p->frame_interval_ns;
+
+	if (p->report_count == 0) {
+		p->slack_ns = slack_ns;
+	} else {
+		p->slack_ns += (int64_t)(SLACK_FILTER_ALPHA * (double)(slack_ns - p->slack_ns));
+	}
+	p->report_count++;
+
+	/*
+	 * More slack than wanted means the frame sat decoded waiting for the
+	 * client, so produce later; negative means it missed, produce earlier.
+	 */
+	int64_t error_ns = p->slack_ns - p->target_slack_ns;
+	int64_t step_ns = (int64_t)(PHASE_GAIN * (double)error_ns);
+	step_ns = CLAMP(step_ns, -MAX_PHASE_STEP_NS, MAX_PHASE_STEP_NS);
+
+	p->phase_offset_ns = wrap_phase(p->phase_offset_ns + step_ns, interval_ns);
+
+	uint64_t desired_present_time_ns = 0;
+	int64_t offset_ns = 0;
+	if (msg->frame_sequence_id > 0 &&
+	    find_frame_locked(p, msg->frame_sequence_id, &desired_present_time_ns, &offset_ns)) {
+		// The pacer knows nothing of the offset, give it times on its own schedule.
+		uint64_t actual_ns = ems_clock_offset_to_server(&p->clock, msg->display_time);
+		uint64_t earliest_ns = ems_clock_offset_to_server(&p->clock, msg->decode_complete_time);
+
+		struct ems_pacing_present_info info = {};
+		info.frame_id = msg->frame_sequence_id;
+		info.desired_present_time_ns = desired_present_time_ns;
+		info.actual_present_time_ns = unshift(actual_ns, offset_ns);
+		info.earliest_present_time_ns = unshift(earliest_ns, offset_ns);
+		info.present_margin_ns = slack_ns > 0 ? (uint64_t)slack_ns : 0;
+
+		// Drop the oldest if the compositor is not keeping up.
+		if (p->info_count == EMS_PACING_INFO_QUEUE) {
+			p->info_head = (p->info_head + 1) % EMS_PACING_INFO_QUEUE;
+			p->info_count--;
+		}
+
+		p->infos[(p->info_head + p->info_count) % EMS_PACING_INFO_QUEUE] = info;
+		p->info_count++;
+	}
+
+	os_mutex_unlock(&p->mutex);
+}
+
+void
+ems_pacing_client_changed(struct ems_pacing *p)
+{
+	os_mutex_lock(&p->mutex);
+
+	ems_clock_offset_init(&p->clock);
+	p->last_decode_complete_time = 0;
+	// Starts the slack filter over.
+	p->report_count = 0;
+
+	os_mutex_unlock(&p->mutex);
+}
+
+bool
+ems_pacing_pop_present_info(struct ems_pacing *p, struct ems_pacing_present_info *out_info)
+{
+	bool ret = false;
+
+	os_mutex_lock(&p->mutex);
+
+	if (p->info_count > 0) {
+		*out_info = p->infos[p->info_head];
+		p->info_head = (p->info_head + 1) % EMS_PACING_INFO_QUEUE;
+		p->info_count--;
+		ret = true;
+	}
+
+	os_mutex_unlock(&p->mutex);
+
+	return ret;
+}
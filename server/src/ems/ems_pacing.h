@@ -0,0 +1,167 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Phase locking server frame production to client frame reports.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_defines.h"
+
+#include "os/os_threading.h"
+
+#include "ems_clock_offset.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _em_proto_UpFrameMessage em_proto_UpFrameMessage;
+
+
+//! How many produced frames we remember for matching client reports.
+#define EMS_PACING_FRAME_HISTORY (32)
+
+//! How many matched reports can be queued before the oldest is dropped.
+#define EMS_PACING_INFO_QUEUE (8)
+
+/*!
+ * Present information derived from a client report, in the server clock
+ * domain and moved back by the phase offset the frame was shifted with, so
+ * it lines up with what the pacer predicted. Ready to be given to u_pc_info.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_pacing_present_info
+{
+	int64_t frame_id;
+	uint64_t desired_present_time_ns;
+	uint64_t actual_present_time_ns;
+	uint64_t earliest_present_time_ns;
+	uint64_t present_margin_ns;
+};
+
+/*!
+ * Uses the UpFrameMessage reports from the client to shift when the server
+ * wakes the app, so decoded frames land just before the client's frame loop
+ * picks them up instead of drifting against it.
+ *
+ * The measured quantity is the slack between a frame finishing decode and
+ * the client beginning the frame that displays it, both in the client clock
+ * so no clock sync is needed for the control loop itself.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_pacing
+{
+	//! Protects everything below, reports come in on the GStreamer thread.
+	struct os_mutex mutex;
+
+	uint64_t frame_interval_ns;
+
+	//! Slack we aim for between decode complete and client begin frame.
+	int64_t target_slack_ns;
+
+	//! Filtered measured slack, for the debug UI.
+	int64_t slack_ns;
+
+	//! Added to the predicted wake up and display times.
+	int64_t phase_offset_ns;
+
+	//! Used to ignore repeated reports for the same decoded frame.
+	int64_t last_decode_complete_time;
+
+	//! Maps client times into our clock, sampled with the begin frame time.
+	struct ems_clock_offset clock;
+
+	//! Number of reports used, for the debug UI.
+	uint64_t report_count;
+
+	struct
+	{
+		int64_t frame_id;
+
+		//! As predicted by the pacer, before the offset.
+		uint64_t desired_present_time_ns;
+
+		//! Phase offset the frame was shifted with.
+		int64_t offset_ns;
+	} frames[EMS_PACING_FRAME_HISTORY];
+	uint32_t next_frame;
+
+	//! Matched reports waiting for the compositor thread, oldest at info_head.
+	struct ems_pacing_present_info infos[EMS_PACING_INFO_QUEUE];
+	uint32_t info_head;
+	uint32_t info_count;
+};
+
+/*!
+ * @public @memberof ems_pacing
+ */
+int
+ems_pacing_init(struct ems_pacing *p, uint64_t frame_interval_ns, int64_t target_slack_ns);
+
+/*!
+ * @public @memberof ems_pacing
+ */
+void
+ems_pacing_fini(struct ems_pacing *p);
+
+/*!
+ * Shift a prediction from the pacer by the current phase offset, and
+ * remember the frame so later reports can be matched to it.
+ *
+ * @public @memberof ems_pacing
+ */
+void
+ems_pacing_adjust_prediction(struct ems_pacing *p,
+                             int64_t frame_id,
+                             uint64_t *inout_wake_up_time_ns,
+                             uint64_t *inout_predicted_display_time_ns);
+
+/*!
+ * Move a time point of a frame, like when the app woke up for it, from the
+ * shifted schedule back onto the pacer's, see @ref ems_pacing_adjust_prediction.
+ * Times of frames that have not been predicted are returned unchanged.
+ *
+ * @public @memberof ems_pacing
+ */
+uint64_t
+ems_pacing_to_pacer_time(struct ems_pacing *p, int64_t frame_id, uint64_t time_ns);
+
+/*!
+ * Feed a report from the client, received at @p now_ns. If it could be
+ * matched to a server frame its present info is queued, see
+ * @ref ems_pacing_pop_present_info.
+ *
+ * @public @memberof ems_pacing
+ */
+void
+ems_pacing_client_report(struct ems_pacing *p, uint64_t now_ns, const em_proto_UpFrameMessage *msg);
+
+/*!
+ * The reports come from a different client from now on, forget the clock
+ * offset and slack of the last one. The phase offset is kept as the
+ * starting point.
+ *
+ * @public @memberof ems_pacing
+ */
+void
+ems_pacing_client_changed(struct ems_pacing *p);
+
+/*!
+ * Pop queued present info, so it can be given to the pacer on the
+ * compositor thread.
+ *
+ * @public @memberof ems_pacing
+ */
+bool
+ems_pacing_pop_present_info(struct ems_pacing *p, struct ems_pacing_present_info *out_info);
+
+#ifdef __cplusplus
+}
+#endif
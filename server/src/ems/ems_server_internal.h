@@ -34,6 +34,7 @@
 
 
 struct ems_callbacks;
+struct ems_compositor;
 struct ems_instance;
 struct ems_hmd;
 
@@ -100,13 +101,22 @@ struct ems_instance
 
 
 /*!
- * Creates a @ref ems_compositor.
+ * Creates a @ref ems_compositor wrapped in a system compositor.
  *
  * @ingroup comp_ems
  */
 xrt_result_t
 ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **out_xsysc);
 
+/*!
+ * Creates just the @ref ems_compositor, for driving it directly without a
+ * system compositor, like the compositor benchmark does.
+ *
+ * @ingroup comp_ems
+ */
+xrt_result_t
+ems_compositor_create(ems_instance &emsi, struct ems_compositor **out_c);
+
 
 // driver interface functions
 
@@ -0,0 +1,280 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Encoder backends the pipeline can be built with.
+ * @ingroup aux_util
+ */
+
+#include "ems_gstreamer_encoder.h"
+
+#include "util/u_misc.h"
+#include "util/u_debug.h"
+#include "util/u_logging.h"
+
+#include <gst/gst.h>
+
+#include <string.h>
+
+
+// Name of the backend to use, see the table below.
+DEBUG_GET_ONCE_OPTION(encoder, "EMS_ENCODER", "x264enc")
+
+// Avoids the bitrate spike of key frames, which turns into loss over Wi-Fi.
+DEBUG_GET_ONCE_BOOL_OPTION(intra_refresh, "EMS_INTRA_REFRESH", true)
+
+// Slices per frame, encoded in parallel, one turns it off.
+DEBUG_GET_ONCE_NUM_OPTION(slices, "EMS_SLICES", 4)
+
+//! Keeps each slice big enough to be worth its header and a thread.
+#define MAX_SLICES (16)
+
+/*!
+ * The H.264 ones all produce constrained baseline, no B-frames and nothing
+ * the client decoder could need to wait on.
+ *
+ * Output stays alignment=au: these encoders emit a whole picture at once, and
+ * the SEI insertion and the client key-frame gate work on access units.
+ */
+static const struct ems_gstreamer_encoder encoders[] = {
+    {
+        .name = "x264enc",
+        .codec = EMS_GSTREAMER_CODEC_H264,
+        .factory = "x264enc",
+        .properties = "tune=zerolatency",
+        .intra_refresh = "intra-refresh=true bframes=0",
+        .keyint_property = "key-int-max",
+        .slices_format = "option-string=\"slices=%u\"",
+        .bitrate_property = "bitrate",
+        .bitrate_scale = 1,
+        .caps = "video/x-h264,profile=baseline,stream-format=byte-stream,alignment=au",
+        .parser = "h264parse",
+        .payloader = "rtph264pay config-interval=1",
+        .encoding_name = "H264",
+    },
+    {
+        .name = "openh264enc",
+        .codec = EMS_GSTREAMER_CODEC_H264,
+        .factory = "openh264enc",
+        .properties = "usage-type=camera complexity=low rate-control=bitrate",
+        .slices_format = "slice-mode=n-slices num-slices=%u",
+        .bitrate_property = "bitrate",
+        .bitrate_scale = 1000,
+        .caps = "video/x-h264,profile=constrained-baseline,stream-format=byte-stream,alignment=au",
+        .parser = "h264parse",
+        .payloader = "rtph264pay config-interval=1",
+        .encoding_name = "H264",
+    },
+    {
+        .name = "vaapih264enc",
+        .codec = EMS_GSTREAMER_CODEC_H264,
+        .factory = "vaapih264enc",
+        .properties = "rate-control=cbr max-bframes=0",
+        .slices_format = "num-slices=%u",
+        .roi = true,
+        .bitrate_property = "bitrate",
+        .bitrate_scale = 1,
+        .caps = "video/x-h264,profile=constrained-baseline,stream-format=byte-stream,alignment=au",
+        .parser = "h264parse",
+        .payloader = "rtph264pay config-interval=1",
+        .encoding_name = "H264",
+    },
+    {
+        .name = "nvh264enc",
+        .codec = EMS_GSTREAMER_CODEC_H264,
+        .factory = "nvh264enc",
+        .properties = "preset=low-latency-hq rc-mode=cbr zerolatency=true bframes=0",
+        .bitrate_property = "bitrate",
+        .bitrate_scale = 1,
+        .caps = "video/x-h264,profile=baseline,stream-format=byte-stream,alignment=au",
+        .parser = "h264parse",
+        .payloader = "rtph264pay config-interval=1",
+        .encoding_name = "H264",
+    },
+    {
+        .name = "x265enc",
+        .codec = EMS_GSTREAMER_CODEC_H265,
+        .factory = "x265enc",
+        .properties = "tune=zerolatency speed-preset=ultrafast",
+        .bitrate_property = "bitrate",
+        .bitrate_scale = 1,
+        .caps = "video/x-h265,stream-format=byte-stream,alignment=au",
+        .parser = "h265parse",
+        .payloader = "rtph265pay config-interval=1",
+        .encoding_name = "H265",
+    },
+    {
+        .name = "svtav1enc",
+        .codec = EMS_GSTREAMER_CODEC_AV1,
+        .factory = "svtav1enc",
+        .properties = "preset=12",
+        .bitrate_property = "target-bitrate",
+        .bitrate_scale = 1,
+        .caps = "video/x-av1,stream-format=obu-stream,alignment=tu",
+        .parser = "av1parse",
+        .payloader = "rtpav1pay",
+        .encoding_name = "AV1",
+    },
+};
+
+
+/*
+ *
+ * Helpers.
+ *
+ */
+
+static const struct ems_gstreamer_encoder *
+find_encoder(const char *name)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(encoders); i++) {
+		if (strcmp(encoders[i].name, name) == 0) {
+			return &encoders[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool
+is_installed(const struct ems_gstreamer_encoder *enc)
+{
+	GstElementFactory *factory = gst_element_factory_find(enc->factory);
+	if (factory == NULL) {
+		return false;
+	}
+
+	gst_object_unref(factory);
+
+	return true;
+}
+
+/*!
+ * Lowest H.264 level (as level_idc) whose frame size and macroblock rate
+ * limits fit the stream, from table A-1 of the H.264 spec.
+ */
+static uint8_t
+h264_level_idc(uint32_t width, uint32_t height, uint32_t fps)
+{
+	static const struct
+	{
+		uint8_t level_idc;
+		uint32_t max_fs;
+		uint32_t max_mbps;
+	} levels[] = {
+	    {31, 3600, 108000},   //
+	    {32, 5120, 216000},   //
+	    {40, 8192, 245760},   //
+	    {42, 8704, 522240},   //
+	    {50, 22080, 589824},  //
+	    {51, 36864, 983040},  //
+	    {52, 36864, 2073600}, //
+	};
+
+	uint64_t frame_size = (uint64_t)((width + 15) / 16) * ((height + 15) / 16);
+	uint64_t mb_rate = frame_size * fps;
+
+	for (size_t i = 0; i < ARRAY_SIZE(levels); i++) {
+		if (frame_size <= levels[i].max_fs && mb_rate <= levels[i].max_mbps) {
+			return levels[i].level_idc;
+		}
+	}
+
+	U_LOG_W("%ux%u@%u exceeds H.264 level 5.2, advertising it anyway", width, height, fps);
+
+	return 52;
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+const struct ems_gstreamer_encoder *
+ems_gstreamer_encoder_select(void)
+{
+	const char *name = debug_get_option_encoder();
+	const struct ems_gstreamer_encoder *enc = find_encoder(name);
+
+	if (enc == NULL) {
+		U_LOG_W("Unknown encoder '%s', using x264enc", name);
+		enc = &encoders[0];
+	} else if (!is_installed(enc)) {
+		U_LOG_W("Element '%s' is not installed, using x264enc", enc->factory);
+		enc = &encoders[0];
+	}
+
+	U_LOG_I("Encoding %s with %s", enc->encoding_name, enc->name);
+
+	return enc;
+}
+
+void
+ems_gstreamer_encoder_append_description(const struct ems_gstreamer_encoder *enc,
+                                         GString *desc,
+                                         const char *name,
+                                         uint32_t bitrate_kbps,
+                                         uint32_t width,
+                                         uint32_t height,
+                                         uint32_t fps)
+{
+	g_string_append_printf(desc, "%s name=%s %s %s=%u ",                                //
+	                       enc->factory, name, enc->properties, enc->bitrate_property, //
+	                       bitrate_kbps * enc->bitrate_scale);                         //
+
+	// A full refresh every second, a lost frame is repaired within that.
+	uint32_t refresh_frames = ems_gstreamer_encoder_get_refresh_frames(enc, fps);
+	if (refresh_frames > 0) {
+		g_string_append_printf(desc, "%s %s=%u ", enc->intra_refresh, enc->keyint_property, refresh_frames);
+	}
+
+	// Cuts the encode time of a frame, the slices are also independently decodable if a packet is lost.
+	uint32_t slices = (uint32_t)CLAMP(debug_get_num_option_slices(), 1, MAX_SLICES);
+	if (enc->slices_format != NULL && slices > 1) {
+		g_string_append_printf(desc, enc->slices_format, slices);
+		g_string_append(desc, " ");
+	}
+
+	g_string_append_printf(desc, "! %s", enc->caps);
+
+	// The level we put in the SDP, the encoder picks its own limits otherwise.
+	if (enc->codec == EMS_GSTREAMER_CODEC_H264) {
+		uint8_t level_idc = h264_level_idc(width, height, fps);
+		if (level_idc % 10 == 0) {
+			g_string_append_printf(desc, ",level=(string)%u", level_idc / 10);
+		} else {
+			g_string_append_printf(desc, ",level=(string)%u.%u", level_idc / 10, level_idc % 10);
+		}
+	}
+
+	g_string_append_printf(desc, " ! queue ! %s ", enc->parser);
+}
+
+uint32_t
+ems_gstreamer_encoder_get_refresh_frames(const struct ems_gstreamer_encoder *enc, uint32_t fps)
+{
+	if (enc->intra_refresh == NULL || !debug_get_bool_option_intra_refresh()) {
+		return 0;
+	}
+
+	return MAX(fps, 1);
+}
+
+gchar *
+ems_gstreamer_encoder_get_rtp_caps(const struct ems_gstreamer_encoder *enc,
+                                   uint32_t width,
+                                   uint32_t height,
+                                   uint32_t fps)
+{
+	const char *common = "application/x-rtp,payload=96,clock-rate=90000,media=video";
+
+	if (enc->codec != EMS_GSTREAMER_CODEC_H264) {
+		return g_strdup_printf("%s,encoding-name=%s", common, enc->encoding_name);
+	}
+
+	// Constrained baseline at a level that fits our resolution and frame rate.
+	return g_strdup_printf("%s,encoding-name=%s,packetization-mode=(string)1,profile-level-id=(string)42e0%02x",
+	                       common, enc->encoding_name, h264_level_idc(width, height, fps));
+}
@@ -0,0 +1,127 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Encoder backends the pipeline can be built with.
+ * @ingroup aux_util
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum ems_gstreamer_codec
+{
+	EMS_GSTREAMER_CODEC_H264,
+	EMS_GSTREAMER_CODEC_H265,
+	EMS_GSTREAMER_CODEC_AV1,
+};
+
+/*!
+ * A GStreamer encoder element with the properties that make it produce low
+ * latency output for us, and what is needed to packetize and describe its
+ * output over RTP.
+ */
+struct ems_gstreamer_encoder
+{
+	//! What EMS_ENCODER is set to for this backend.
+	const char *name;
+
+	enum ems_gstreamer_codec codec;
+
+	//! Element factory, the backend is only usable if it is installed.
+	const char *factory;
+
+	//! Latency oriented preset, in gst-launch syntax.
+	const char *properties;
+
+	/*!
+	 * Spreads intra coding over the frames of a period rather than sending
+	 * key frames, NULL if the encoder can't do it. The period is set with
+	 * @ref keyint_property, in frames.
+	 */
+	const char *intra_refresh;
+	const char *keyint_property;
+
+	/*!
+	 * Splits each frame into slices that are encoded in parallel, formatted
+	 * with the slice count. NULL if the encoder can't do it.
+	 */
+	const char *slices_format;
+
+	/*!
+	 * Takes per-region QP offsets from GstVideoRegionOfInterestMeta, needed
+	 * for foveated encoding, see ems_gstreamer_src_set_regions.
+	 */
+	bool roi;
+
+	//! Property taking the target bitrate, multiplied by @ref bitrate_scale from kbit/s.
+	const char *bitrate_property;
+	uint32_t bitrate_scale;
+
+	//! Caps forced on the encoder output, always whole byte-stream access units.
+	const char *caps;
+
+	//! Parser between the encoder and the tee.
+	const char *parser;
+
+	//! Payloader with its properties, in gst-launch syntax.
+	const char *payloader;
+
+	//! RTP encoding-name put in the SDP.
+	const char *encoding_name;
+};
+
+/*!
+ * Backend picked with EMS_ENCODER, falling back to x264enc if that names an
+ * unknown backend or one whose element is not installed. GStreamer must be
+ * initialised.
+ */
+const struct ems_gstreamer_encoder *
+ems_gstreamer_encoder_select(void);
+
+/*!
+ * Append the encode segment, from the encoder to the parser, to a pipeline
+ * description. The encoder element is called @p name and uses intra refresh
+ * if it can, unless EMS_INTRA_REFRESH is off, and EMS_SLICES slices per frame.
+ * H.264 encoders are held to the level of a stream of at most @p width by
+ * @p height at @p fps, the one ems_gstreamer_encoder_get_rtp_caps offers.
+ */
+void
+ems_gstreamer_encoder_append_description(const struct ems_gstreamer_encoder *enc,
+                                         GString *desc,
+                                         const char *name,
+                                         uint32_t bitrate_kbps,
+                                         uint32_t width,
+                                         uint32_t height,
+                                         uint32_t fps);
+
+/*!
+ * Frames a full intra refresh is spread over at @p fps, zero if the encode
+ * segment from @ref ems_gstreamer_encoder_append_description doesn't use it.
+ */
+uint32_t
+ems_gstreamer_encoder_get_refresh_frames(const struct ems_gstreamer_encoder *enc, uint32_t fps);
+
+/*!
+ * Caps for the send-only transceiver, for a stream of at most @p width by
+ * @p height at @p fps. Free with g_free.
+ */
+gchar *
+ems_gstreamer_encoder_get_rtp_caps(const struct ems_gstreamer_encoder *enc,
+                                   uint32_t width,
+                                   uint32_t height,
+                                   uint32_t fps);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -15,15 +15,22 @@
  */
 
 #include "ems_gstreamer_pipeline.h"
+#include "ems_gstreamer_encoder.h"
+#include "ems_gstreamer_src.h"
 
 #include "ems_callbacks.h"
+#include "ems_frame_trace.h"
 
+#include "os/os_time.h"
 #include "os/os_threading.h"
 #include "util/u_misc.h"
 #include "util/u_debug.h"
+#include "util/u_time.h"
+#include "util/u_var.h"
 
 #include "pb_decode.h"
 #include "electricmaple.pb.h"
+#include "em_data_channels.h"
 
 // Monado includes
 #include "gstreamer/gst_internal.h"
@@ -34,16 +41,95 @@
 #include <glib-unix.h>
 #include <gst/gst.h>
 #include <gst/gststructure.h>
+#include <gst/video/video.h>
 
 #define GST_USE_UNSTABLE_API
 #include <gst/webrtc/datachannel.h>
 #include <gst/webrtc/rtcsessiondescription.h>
 #undef GST_USE_UNSTABLE_API
 
+#include <math.h>
 #include <stdio.h>
 #include <assert.h>
+#include <inttypes.h>
 
-#define WEBRTC_TEE_NAME "webrtctee"
+#define WEBRTC_TEE_NAME_FMT "webrtctee_%u"
+#define PAYLOADER_NAME "payloader"
+
+//! Raw frames of the first layer, for clients with their own encoder.
+#define RAW_TEE_NAME "rawtee"
+
+//! Elements in the bin of a client with its own encoder.
+#define CLIENT_ENCODER_NAME "encoder"
+#define CLIENT_SCALE_CAPS_NAME "scale_caps"
+
+//! Frames a client encoder can have in flight, for timing them.
+#define CLIENT_ENCODER_FRAMES (4)
+
+//! Errors from the rest of a layer follow the first one within this, they are handled with one restart.
+#define LAYER_RESTART_DELAY_MS (20)
+
+//! Restarts without a frame coming through in between before a layer is given up on.
+#define LAYER_MAX_RESTARTS (3)
+
+//! How often the receiver reports of each client are looked at to pick its layer and bitrate.
+#define CLIENT_CHECK_INTERVAL_S (1)
+
+//! Reported loss above which a client moves to a smaller layer.
+#define LAYER_DOWN_FRACTION_LOST (0.05)
+
+//! Reported loss below which a client may move back to a larger layer.
+#define LAYER_UP_FRACTION_LOST (0.01)
+
+//! Consecutive checks over or under the thresholds before moving, up is slow to avoid flapping.
+#define LAYER_DOWN_CHECKS (2)
+#define LAYER_UP_CHECKS (10)
+
+//! Reported loss above which the bitrate estimate of a client is cut by half the loss.
+#define ABR_DECREASE_FRACTION_LOST (0.10)
+
+//! Reported loss below which the estimate grows, in between it is held.
+#define ABR_INCREASE_FRACTION_LOST (0.02)
+
+//! Growth per check, about what GCC allows in a second.
+#define ABR_INCREASE_FACTOR (1.08)
+
+//! Round trip time over the lowest seen by this much means queues are building up.
+#define ABR_RTT_MARGIN_S (0.05)
+#define ABR_RTT_DECREASE_FACTOR (0.85)
+
+//! Encoder bitrate changes smaller than this are not worth a reconfigure.
+#define ABR_MIN_CHANGE (0.05)
+
+//! FEC percentage per percent of loss, ULPFEC only recovers a packet if the rest of its group arrived.
+#define FEC_LOSS_FACTOR (3.0)
+
+//! Lowest the FEC percentage drops per check, loss comes in bursts.
+#define FEC_DECREASE_STEP (2)
+
+// Key frames of a layer are forced at most this often, requests in between are coalesced into one.
+DEBUG_GET_ONCE_NUM_OPTION(keyframe_min_interval_ms, "EMS_KEYFRAME_MIN_INTERVAL_MS", 500)
+
+// Target bitrate of the first layer, the others get a share by their size.
+DEBUG_GET_ONCE_NUM_OPTION(bitrate, "EMS_BITRATE_KBPS", 2048)
+
+// Adapt the encoder bitrate to what the clients receive, between the limits below.
+DEBUG_GET_ONCE_BOOL_OPTION(abr, "EMS_ABR", true)
+DEBUG_GET_ONCE_NUM_OPTION(min_bitrate, "EMS_MIN_BITRATE_KBPS", 500)
+DEBUG_GET_ONCE_NUM_OPTION(max_bitrate, "EMS_MAX_BITRATE_KBPS", 20000)
+
+// Loss recovery, retransmission on NACK and FEC adapting to the loss between the limits.
+DEBUG_GET_ONCE_BOOL_OPTION(nack, "EMS_NACK", true)
+DEBUG_GET_ONCE_BOOL_OPTION(fec, "EMS_FEC", true)
+DEBUG_GET_ONCE_NUM_OPTION(fec_min_percent, "EMS_FEC_MIN_PERCENT", 0)
+DEBUG_GET_ONCE_NUM_OPTION(fec_max_percent, "EMS_FEC_MAX_PERCENT", 50)
+
+// Give clients their own encoder fed with raw frames, up to the max, the rest share the layers.
+DEBUG_GET_ONCE_BOOL_OPTION(client_encoders, "EMS_CLIENT_ENCODERS", false)
+DEBUG_GET_ONCE_NUM_OPTION(max_client_encoders, "EMS_MAX_CLIENT_ENCODERS", 3)
+
+// Where to write the stats of each client every check, JSON lines if it ends in .jsonl, CSV otherwise.
+DEBUG_GET_ONCE_OPTION(stats_file, "EMS_STATS_FILE", NULL)
 
 #ifdef __aarch64__
 #define DEFAULT_VIDEOSINK " queue max-size-bytes=0 ! kmssink bus-id=a0070000.v_mix"
@@ -53,99 +139,1204 @@
 
 
 
-EmsSignalingServer *signaling_server;
+EmsSignalingServer *signaling_server;
+
+
+/*!
+ * Key frame requests for the encoder of one layer, from clients joining or
+ * switching to it and from their PLIs.
+ */
+struct ems_keyframe_limiter
+{
+	struct ems_gstreamer_pipeline *egp;
+	uint32_t layer;
+
+	//! When a key frame was last forced, protected by the keyframe mutex of the pipeline.
+	uint64_t last_ns;
+
+	//! Forces the coalesced requests once the interval has passed, protected like last_ns.
+	guint timeout_id;
+
+	//! A key frame was forced and has not left the encoder yet, use g_atomic_int_*.
+	gint pending;
+};
+
+/*!
+ * Restarting the branch of one layer, from the appsrc to its tee, after an
+ * error in it.
+ */
+struct ems_layer_restart
+{
+	struct ems_gstreamer_pipeline *egp;
+	uint32_t layer;
+
+	//! When the first error since frames last came through was seen.
+	uint64_t error_ns;
+
+	//! Restarts since, only touched from the main loop like the rest.
+	uint32_t attempts;
+	guint timeout_id;
+
+	//! Set once frames reach the tee, use g_atomic_int_*.
+	gint streaming;
+};
+
+struct ems_gstreamer_pipeline
+{
+	struct gstreamer_pipeline base;
+
+
+	// struct GstElement *pipeline;
+	GstElement *webrtc;
+
+
+	struct ems_callbacks *callbacks;
+
+	//! Backend the encode segment of each layer was built with.
+	const struct ems_gstreamer_encoder *encoder;
+
+	//! Caps of the transceiver we add for each client, owned.
+	gchar *rtp_caps;
+
+	//! Number of encoder branches, see @ref ems_gstreamer_layer_info.
+	uint32_t layer_count;
+	struct ems_gstreamer_layer_info layers[EMS_GSTREAMER_MAX_LAYERS];
+	uint32_t fps;
+
+	//! Connected clients, only touched from the main loop.
+	GList *clients;
+
+	//! Picks the layer and bitrate of each client.
+	guint client_timeout_id;
+
+	struct
+	{
+		//! The replies come in on the threads of the webrtcbins.
+		struct os_mutex mutex;
+
+		//! Handles the replies on the main loop, zero if none is scheduled.
+		guint idle_id;
+	} client_stats;
+
+	/*!
+	 * Only the reports of one client are passed on, the clocks and frame
+	 * loops of different clients have nothing to do with each other.
+	 */
+	struct
+	{
+		//! Reports come in on the threads of the webrtcbins.
+		struct os_mutex mutex;
+
+		//! The first client to send one, until it goes away. Not referenced.
+		struct ems_gstreamer_client *client;
+	} frame_reports;
+
+	//! Pixels of each layer over the first, scales the bitrate limits.
+	double layer_ratio[EMS_GSTREAMER_MAX_LAYERS];
+
+	struct
+	{
+		bool enabled;
+
+		//! For the first layer, the others are scaled by their ratio.
+		uint32_t min_kbps;
+		uint32_t max_kbps;
+
+		//! Lowest estimate of all clients, for the debug UI.
+		uint32_t estimate_kbps;
+
+		//! Bitrate each encoder is set to.
+		uint32_t target_kbps[EMS_GSTREAMER_MAX_LAYERS];
+	} abr;
+
+	struct
+	{
+		//! Requests come from streaming threads and the main loop.
+		struct os_mutex mutex;
+
+		uint64_t min_interval_ns;
+
+		struct ems_keyframe_limiter layers[EMS_GSTREAMER_MAX_LAYERS];
+
+		//! For the debug UI.
+		uint32_t requested;
+		uint32_t forced;
+
+		//! Encoders, of layers and clients, with a key frame pending, use g_atomic_int_*.
+		gint pending;
+	} keyframes;
+
+	struct
+	{
+		//! Set on the transceiver of new clients.
+		bool nack;
+		bool fec;
+
+		uint32_t fec_min_percentage;
+		uint32_t fec_max_percentage;
+
+		//! Highest FEC percentage and NACKs from all clients, for the debug UI.
+		uint32_t fec_percentage;
+		uint32_t nack_count;
+	} recovery;
+
+	struct
+	{
+		bool enabled;
+
+		//! Each one holds on to frames of the compositor, and takes a share of the CPU.
+		uint32_t max;
+
+		//! Clients with their own encoder, only touched from the main loop.
+		uint32_t active;
+
+		//! Highest share of the last check any of them spent encoding, for the debug UI.
+		uint32_t busy_percent;
+	} client_encoders;
+
+	//! Numbers the clients in the stats file.
+	uint32_t next_client_id;
+
+	struct
+	{
+		struct ems_layer_restart layers[EMS_GSTREAMER_MAX_LAYERS];
+
+		//! For the debug UI, the recovery times are written from a streaming thread.
+		uint32_t count;
+		uint32_t restarts;
+		uint32_t clients_dropped;
+		float last_recovery_ms;
+		float max_recovery_ms;
+	} errors;
+
+	//! See EMS_STATS_FILE, NULL if not set, only written from the main loop.
+	FILE *stats_file;
+	bool stats_jsonl;
+	uint64_t created_ns;
+};
+
+/*!
+ * What the stats of the stream to a client came to at the last check, in
+ * its own debug UI root and the stats file.
+ */
+struct ems_gstreamer_client_metrics
+{
+	float rtt_ms;
+	float jitter_ms;
+	float loss_percent;
+	uint64_t packets_lost;
+
+	//! Feedback received from the client so far.
+	uint64_t nack_count;
+	uint64_t pli_count;
+
+	//! RTP sent since the previous check, retransmissions and FEC included.
+	float bitrate_kbps;
+
+	//! Frames that reached the payloader of the client.
+	uint64_t frames_encoded;
+
+	uint64_t data_channel_bytes_sent;
+	uint64_t data_channel_bytes_received;
+};
+
+//! What the client said about our stream, from its receiver reports and feedback.
+struct client_stats
+{
+	//! Set if it has sent a receiver report, nothing else is valid without one.
+	bool have_report;
+
+	double fraction_lost;
+
+	//! Negative if not known yet.
+	double rtt_s;
+
+	double jitter_s;
+	uint64_t packets_lost;
+
+	//! NACKs and PLIs received from the client so far.
+	uint64_t nack_count;
+	uint64_t pli_count;
+
+	//! Summed over all outbound streams and data channels.
+	uint64_t bytes_sent;
+	uint64_t data_channel_bytes_sent;
+	uint64_t data_channel_bytes_received;
+};
+
+/*!
+ * A connected client, attached to its webrtcbin as "client" and freed with
+ * it. Only used from the main loop, apart from @ref wait_keyframe and
+ * @ref stats.
+ */
+struct ems_gstreamer_client
+{
+	struct ems_gstreamer_pipeline *egp;
+
+	//! Not referenced, the pipeline holds it.
+	GstElement *webrtcbin;
+
+	//! Queue and payloader, and the encode segment if it has its own encoder, in the pipeline.
+	GstElement *bin;
+
+	/*!
+	 * Own encoder in the bin, fed from the raw tee and scaled to the size
+	 * of the layer with the capsfilter. NULL when fed from a layer. Neither
+	 * is referenced, the bin holds them.
+	 */
+	GstElement *encoder;
+	GstElement *scale_caps;
+
+	//! Layer the client is fed from, or the size of it with its own encoder.
+	uint32_t layer;
+
+	//! Consecutive layer checks with the loss over and under the thresholds.
+	uint32_t lossy_checks;
+	uint32_t clean_checks;
+
+	//! Bitrate the link to the client is estimated to carry, at the size of the first layer.
+	uint32_t estimate_kbps;
+
+	//! Lowest round trip time reported, negative before the first report.
+	double min_rtt_s;
+
+	//! FEC percentage set on the transceiver.
+	uint32_t fec_percentage;
+
+	//! Bitrate the own encoder is set to.
+	uint32_t target_kbps;
+
+	/*!
+	 * Time the own encoder spent on frames, from input to output matched by
+	 * PTS. Written from the streaming threads, protected by the mutex.
+	 */
+	struct
+	{
+		struct os_mutex mutex;
+
+		struct
+		{
+			uint64_t pts;
+			uint64_t start_ns;
+		} frames[CLIENT_ENCODER_FRAMES];
+		uint32_t next;
+
+		uint64_t busy_ns;
+	} usage;
+
+	//! Share of the last check the own encoder was busy.
+	uint32_t busy_percent;
+
+	//! Created by us and referenced, see em_data_channels.h.
+	GObject *tracking_channel;
+	GObject *frame_channel;
+	GObject *control_channel;
+
+	//! Greets the client on the control channel.
+	guint hello_timeout_id;
+
+	//! Newest tracking message passed on, older ones can arrive after it.
+	int64_t last_tracking_id;
+
+	//! For the stats file.
+	uint32_t id;
+
+	//! Counted on the payloader sink pad, use g_atomic_int_*.
+	gint frames_encoded;
+
+	//! RTP bytes sent as of the previous check, for the bitrate.
+	uint64_t last_bytes_sent;
+	uint64_t last_stats_ns;
+
+	struct ems_gstreamer_client_metrics metrics;
+
+	/*!
+	 * Newest reply to get-stats, written from the thread of the webrtcbin
+	 * and handled on the main loop, protected by the mutex.
+	 */
+	struct
+	{
+		struct os_mutex mutex;
+		struct client_stats reply;
+		uint64_t reply_ns;
+		bool pending;
+	} stats;
+
+	//! Drop frames until the next key frame, set when linked to a layer, use g_atomic_int_*.
+	gint wait_keyframe;
+
+	//! A key frame was forced on the own encoder and has not left it yet, use g_atomic_int_*.
+	gint keyframe_pending;
+};
+
+
+static gboolean
+sigint_handler(gpointer user_data)
+{
+	g_main_loop_quit(user_data);
+	return G_SOURCE_REMOVE;
+}
+
+static GstElement *
+get_webrtcbin_for_client(GstBin *pipeline, EmsClientId client_id)
+{
+	gchar *name;
+	GstElement *webrtcbin;
+
+	name = g_strdup_printf("webrtcbin_%p", client_id);
+	webrtcbin = gst_bin_get_by_name(pipeline, name);
+	g_free(name);
+
+	return webrtcbin;
+}
+
+static GstPadProbeReturn
+frame_trace_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	enum ems_frame_trace_stage stage = (enum ems_frame_trace_stage)GPOINTER_TO_INT(user_data);
+	uint64_t now_ns = os_monotonic_get_ns();
+	GstBuffer *buffer = NULL;
+
+	// The payloader pushes lists, all packets of a frame carry its PTS so the first one is enough.
+	if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+		GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+		if (gst_buffer_list_length(list) > 0) {
+			buffer = gst_buffer_list_get(list, 0);
+		}
+	} else {
+		buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	}
+
+	if (buffer != NULL && GST_BUFFER_PTS_IS_VALID(buffer)) {
+		ems_frame_trace_mark_pts(GST_BUFFER_PTS(buffer), stage, now_ns);
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+add_frame_trace_probe(GstElement *pipeline, const char *element_name, enum ems_frame_trace_stage stage)
+{
+	GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), element_name);
+	g_assert(element != NULL);
+
+	GstPad *pad = gst_element_get_static_pad(element, "src");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, frame_trace_probe_cb,
+	                  GINT_TO_POINTER(stage), NULL);
+
+	gst_object_unref(pad);
+	gst_object_unref(element);
+}
+
+static GstElement *
+get_layer_tee(struct ems_gstreamer_pipeline *egp, uint32_t layer)
+{
+	gchar *name = g_strdup_printf(WEBRTC_TEE_NAME_FMT, layer);
+	GstElement *tee = gst_bin_get_by_name(GST_BIN(egp->base.pipeline), name);
+	g_free(name);
+
+	return tee;
+}
+
+//! Counts the encoder in @ref ems_gstreamer_pipeline_keyframe_pending until the key frame is out.
+static void
+set_keyframe_pending(struct ems_gstreamer_pipeline *egp, gint *pending)
+{
+	if (g_atomic_int_compare_and_exchange(pending, 0, 1)) {
+		g_atomic_int_inc(&egp->keyframes.pending);
+	}
+}
+
+static void
+clear_keyframe_pending(struct ems_gstreamer_pipeline *egp, gint *pending)
+{
+	if (g_atomic_int_compare_and_exchange(pending, 1, 0)) {
+		g_atomic_int_add(&egp->keyframes.pending, -1);
+	}
+}
+
+static void
+send_force_keyframe(GstElement *encoder)
+{
+	// With all headers, so the payloader sends SPS and PPS along with it.
+	GstPad *pad = gst_element_get_static_pad(encoder, "src");
+	gst_pad_send_event(pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+	gst_object_unref(pad);
+}
+
+static void
+force_keyframe_locked(struct ems_keyframe_limiter *kl, uint64_t now_ns)
+{
+	struct ems_gstreamer_pipeline *egp = kl->egp;
+
+	gchar *name = g_strdup_printf(EMS_GSTREAMER_ENCODER_NAME_FMT, kl->layer);
+	GstElement *encoder = gst_bin_get_by_name(GST_BIN(egp->base.pipeline), name);
+	g_free(name);
+
+	if (encoder == NULL) {
+		return;
+	}
+
+	// Before sending, the encoder may have it out before we get to mark it.
+	set_keyframe_pending(egp, &kl->pending);
+	send_force_keyframe(encoder);
+	gst_object_unref(encoder);
+
+	kl->last_ns = now_ns;
+	egp->keyframes.forced++;
+}
+
+static gboolean
+keyframe_timeout_cb(gpointer user_data)
+{
+	struct ems_keyframe_limiter *kl = (struct ems_keyframe_limiter *)user_data;
+	struct ems_gstreamer_pipeline *egp = kl->egp;
+
+	os_mutex_lock(&egp->keyframes.mutex);
+	kl->timeout_id = 0;
+	force_keyframe_locked(kl, os_monotonic_get_ns());
+	os_mutex_unlock(&egp->keyframes.mutex);
+
+	return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Ask the encoder of @p layer for a key frame. Every client on the layer
+ * pays for the bitrate spike, so they are forced at most once per interval
+ * and requests in between are served by a single key frame at the end of
+ * it. Safe to call from any thread.
+ */
+static void
+request_keyframe(struct ems_gstreamer_pipeline *egp, uint32_t layer)
+{
+	struct ems_keyframe_limiter *kl = &egp->keyframes.layers[layer];
+	uint64_t now_ns = os_monotonic_get_ns();
+
+	os_mutex_lock(&egp->keyframes.mutex);
+
+	egp->keyframes.requested++;
+
+	if (kl->timeout_id != 0) {
+		// Already coming.
+	} else if (kl->last_ns == 0 || now_ns - kl->last_ns >= egp->keyframes.min_interval_ns) {
+		force_keyframe_locked(kl, now_ns);
+	} else {
+		uint64_t wait_ns = egp->keyframes.min_interval_ns - (now_ns - kl->last_ns);
+		kl->timeout_id = g_timeout_add((guint)(wait_ns / U_TIME_1MS_IN_NS) + 1, keyframe_timeout_cb, kl);
+	}
+
+	os_mutex_unlock(&egp->keyframes.mutex);
+}
+
+//! A key frame for the client, only limited if it is shared with others.
+static void
+request_client_keyframe(struct ems_gstreamer_client *client)
+{
+	if (client->encoder == NULL) {
+		request_keyframe(client->egp, client->layer);
+		return;
+	}
+
+	// The counters are shared with the limiter, which runs on other threads.
+	os_mutex_lock(&client->egp->keyframes.mutex);
+	client->egp->keyframes.requested++;
+	client->egp->keyframes.forced++;
+	os_mutex_unlock(&client->egp->keyframes.mutex);
+
+	set_keyframe_pending(client->egp, &client->keyframe_pending);
+	send_force_keyframe(client->encoder);
+}
+
+//! Clears the pending key frame of a layer once its encoder has put one out.
+static GstPadProbeReturn
+layer_keyframe_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_keyframe_limiter *kl = (struct ems_keyframe_limiter *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+	if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+		clear_keyframe_pending(kl->egp, &kl->pending);
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+//! Routes the PLIs of a client, turned into force-key-unit by rtpsession, through the limiter.
+static GstPadProbeReturn
+client_keyframe_request_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)user_data;
+	GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+
+	if (!gst_video_event_is_force_key_unit(event)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	request_keyframe(client->egp, client->layer);
+
+	return GST_PAD_PROBE_DROP;
+}
+
+static GstPadProbeReturn
+wait_keyframe_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+	if (!g_atomic_int_get(&client->wait_keyframe)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	// Nothing before it decodes, at best it would show up as garbage.
+	if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+		return GST_PAD_PROBE_DROP;
+	}
+
+	g_atomic_int_set(&client->wait_keyframe, 0);
+
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+client_encoder_input_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+	if (!GST_BUFFER_PTS_IS_VALID(buffer)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	os_mutex_lock(&client->usage.mutex);
+	client->usage.frames[client->usage.next].pts = GST_BUFFER_PTS(buffer);
+	client->usage.frames[client->usage.next].start_ns = os_monotonic_get_ns();
+	client->usage.next = (client->usage.next + 1) % CLIENT_ENCODER_FRAMES;
+	os_mutex_unlock(&client->usage.mutex);
+
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+client_encoder_output_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	uint64_t now_ns = os_monotonic_get_ns();
+
+	if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+		clear_keyframe_pending(client->egp, &client->keyframe_pending);
+	}
+
+	if (!GST_BUFFER_PTS_IS_VALID(buffer)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	os_mutex_lock(&client->usage.mutex);
+	for (uint32_t i = 0; i < CLIENT_ENCODER_FRAMES; i++) {
+		if (client->usage.frames[i].start_ns != 0 && client->usage.frames[i].pts == GST_BUFFER_PTS(buffer)) {
+			client->usage.busy_ns += now_ns - client->usage.frames[i].start_ns;
+			client->usage.frames[i].start_ns = 0;
+			break;
+		}
+	}
+	os_mutex_unlock(&client->usage.mutex);
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+setup_client_encoder(struct ems_gstreamer_client *client)
+{
+	struct ems_gstreamer_pipeline *egp = client->egp;
+
+	// The bin keeps them alive for as long as the client.
+	client->encoder = gst_bin_get_by_name(GST_BIN(client->bin), CLIENT_ENCODER_NAME);
+	client->scale_caps = gst_bin_get_by_name(GST_BIN(client->bin), CLIENT_SCALE_CAPS_NAME);
+	gst_object_unref(client->encoder);
+	gst_object_unref(client->scale_caps);
+
+	GstPad *sinkpad = gst_element_get_static_pad(client->encoder, "sink");
+	gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, client_encoder_input_probe_cb, client, NULL);
+	gst_object_unref(sinkpad);
+
+	GstPad *srcpad = gst_element_get_static_pad(client->encoder, "src");
+	gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER, client_encoder_output_probe_cb, client, NULL);
+
+	// The frame data comes with the frames of the first layer, which we are fed with.
+	gchar *appsrc_name = g_strdup_printf(EMS_GSTREAMER_APPSRC_NAME_FMT, 0);
+	GstElement *appsrc = gst_bin_get_by_name(GST_BIN(egp->base.pipeline), appsrc_name);
+	g_free(appsrc_name);
+
+	struct ems_gstreamer_src *gs = g_object_get_data(G_OBJECT(appsrc), EMS_GSTREAMER_SRC_DATA_KEY);
+	if (gs != NULL) {
+		ems_gstreamer_src_add_branch_probe(gs, srcpad);
+	}
+
+	gst_object_unref(appsrc);
+	gst_object_unref(srcpad);
+
+	egp->client_encoders.active++;
+}
+
+//! Bitrate for the own encoder of the client, at the size it is scaled to.
+static uint32_t
+get_client_bitrate(struct ems_gstreamer_client *client)
+{
+	return (uint32_t)MAX(client->estimate_kbps * client->egp->layer_ratio[client->layer], 100);
+}
+
+/*!
+ * Link the client to the tee of @p layer, or the raw tee if it has its own
+ * encoder. With @p force_keyframe a key frame is requested instead of the
+ * client waiting for the next one, see @ref request_client_keyframe.
+ */
+static void
+link_client_to_layer(struct ems_gstreamer_client *client, uint32_t layer, bool force_keyframe)
+{
+	GstElement *tee = NULL;
+	if (client->encoder != NULL) {
+		tee = gst_bin_get_by_name(GST_BIN(client->egp->base.pipeline), RAW_TEE_NAME);
+	} else {
+		tee = get_layer_tee(client->egp, layer);
+	}
+	GstPad *srcpad = gst_element_request_pad_simple(tee, "src_%u");
+	GstPad *sinkpad = gst_element_get_static_pad(client->bin, "sink");
+
+	g_atomic_int_set(&client->wait_keyframe, 1);
+	client->layer = layer;
+
+	GstPadLinkReturn ret = gst_pad_link(srcpad, sinkpad);
+	g_assert(ret == GST_PAD_LINK_OK);
+
+	if (force_keyframe) {
+		request_client_keyframe(client);
+	}
+
+	gst_object_unref(srcpad);
+	gst_object_unref(sinkpad);
+	gst_object_unref(tee);
+}
+
+static GstPadProbeReturn
+switch_layer_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)user_data;
+	GstElement *tee = gst_pad_get_parent_element(pad);
+	GstPad *sinkpad = gst_element_get_static_pad(client->bin, "sink");
+
+	gst_pad_unlink(pad, sinkpad);
+	gst_element_release_request_pad(tee, pad);
+
+	gst_object_unref(sinkpad);
+	gst_object_unref(tee);
+
+	link_client_to_layer(client, GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(client->bin), "next_layer")), true);
+
+	return GST_PAD_PROBE_REMOVE;
+}
+
+//! Scale the input of the own encoder to the size of the layer of the client.
+static void
+set_client_size(struct ems_gstreamer_client *client)
+{
+	const struct ems_gstreamer_layer_info *size = &client->egp->layers[client->layer];
+
+	GstCaps *caps = gst_caps_new_simple("video/x-raw",                     //
+	                                    "width", G_TYPE_INT, size->width,   //
+	                                    "height", G_TYPE_INT, size->height, //
+	                                    NULL);                              //
+	g_object_set(client->scale_caps, "caps", caps, NULL);
+	gst_caps_unref(caps);
+}
+
+/*!
+ * Move the client over to the tee of another layer once nothing is flowing
+ * to it, the payloader stays so the RTP stream continues seamlessly. With
+ * its own encoder only the size it is scaled to changes, the encoder starts
+ * over at the new size with a key frame.
+ */
+static void
+switch_client_layer(struct ems_gstreamer_client *client, uint32_t layer)
+{
+	U_LOG_I("Moving client %p from layer %u to %u", (void *)client, client->layer, layer);
+
+	client->lossy_checks = 0;
+	client->clean_checks = 0;
+
+	if (client->encoder != NULL) {
+		client->layer = layer;
+		set_client_size(client);
+		return;
+	}
+
+	GstPad *sinkpad = gst_element_get_static_pad(client->bin, "sink");
+	GstPad *peer = gst_pad_get_peer(sinkpad);
+
+	if (peer == NULL) {
+		// Not linked yet, happens once the offer is created.
+		client->layer = layer;
+	} else {
+		g_object_set_data(G_OBJECT(client->bin), "next_layer", GUINT_TO_POINTER(layer));
+		gst_pad_add_probe(peer, GST_PAD_PROBE_TYPE_IDLE, switch_layer_probe_cb, client, NULL);
+		gst_object_unref(peer);
+	}
+
+	gst_object_unref(sinkpad);
+}
+
+//! Integers in the stats are of different types between GStreamer versions, negative ones are clamped.
+static bool
+get_stat_u64(const GstStructure *s, const char *field, uint64_t *out_value)
+{
+	const GValue *value = gst_structure_get_value(s, field);
+	if (value == NULL) {
+		return false;
+	}
+
+	GValue i64 = G_VALUE_INIT;
+	g_value_init(&i64, G_TYPE_INT64);
+
+	bool ret = g_value_transform(value, &i64);
+	if (ret) {
+		*out_value = (uint64_t)MAX(g_value_get_int64(&i64), 0);
+	}
+
+	g_value_unset(&i64);
+
+	return ret;
+}
+
+static void
+add_stat_u64(const GstStructure *s, const char *field, uint64_t *sum)
+{
+	uint64_t value = 0;
+	if (get_stat_u64(s, field, &value)) {
+		*sum += value;
+	}
+}
+
+static gboolean
+collect_stats_cb(GQuark field_id, const GValue *value, gpointer user_data)
+{
+	struct client_stats *out_stats = (struct client_stats *)user_data;
+
+	if (!GST_VALUE_HOLDS_STRUCTURE(value)) {
+		return TRUE;
+	}
+
+	const GstStructure *s = gst_value_get_structure(value);
+	GstWebRTCStatsType type = 0;
+
+	if (!gst_structure_get(s, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL)) {
+		return TRUE;
+	}
+
+	if (type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP &&
+	    gst_structure_get_double(s, "fraction-lost", &out_stats->fraction_lost)) {
+		out_stats->have_report = true;
+		// Not there until the round trip could be worked out from a report.
+		if (!gst_structure_get_double(s, "round-trip-time", &out_stats->rtt_s)) {
+			out_stats->rtt_s = -1.0;
+		}
+		gst_structure_get_double(s, "jitter", &out_stats->jitter_s);
+		get_stat_u64(s, "packets-lost", &out_stats->packets_lost);
+	} else if (type == GST_WEBRTC_STATS_OUTBOUND_RTP) {
+		add_stat_u64(s, "nack-count", &out_stats->nack_count);
+		add_stat_u64(s, "pli-count", &out_stats->pli_count);
+		add_stat_u64(s, "bytes-sent", &out_stats->bytes_sent);
+	} else if (type == GST_WEBRTC_STATS_DATA_CHANNEL) {
+		add_stat_u64(s, "bytes-sent", &out_stats->data_channel_bytes_sent);
+		add_stat_u64(s, "bytes-received", &out_stats->data_channel_bytes_received);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+handle_client_stats(gpointer user_data);
+
+/*!
+ * Reply to get-stats, on the thread of the webrtcbin, which the promise
+ * holds a reference to and with it the client. Hands the stats to the main
+ * loop.
+ */
+static void
+on_client_stats(GstPromise *promise, gpointer user_data)
+{
+	GstElement *webrtcbin = GST_ELEMENT(user_data);
+	struct ems_gstreamer_client *client = g_object_get_data(G_OBJECT(webrtcbin), "client");
+	struct ems_gstreamer_pipeline *egp = client->egp;
+
+	// Interrupted when the webrtcbin stops.
+	if (gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED) {
+		return;
+	}
+
+	struct client_stats stats = {0};
+	const GstStructure *reply = gst_promise_get_reply(promise);
+	if (reply != NULL) {
+		gst_structure_foreach(reply, collect_stats_cb, &stats);
+	}
+
+	os_mutex_lock(&client->stats.mutex);
+	client->stats.reply = stats;
+	client->stats.reply_ns = os_monotonic_get_ns();
+	client->stats.pending = true;
+	os_mutex_unlock(&client->stats.mutex);
+
+	os_mutex_lock(&egp->client_stats.mutex);
+	if (egp->client_stats.idle_id == 0) {
+		egp->client_stats.idle_id = g_idle_add(handle_client_stats, egp);
+	}
+	os_mutex_unlock(&egp->client_stats.mutex);
+}
+
+//! Asks for the stats of the stream to the client without waiting for them, see @ref on_client_stats.
+static void
+request_client_stats(struct ems_gstreamer_client *client)
+{
+	GstPromise *promise = gst_promise_new_with_change_func( //
+	    on_client_stats, gst_object_ref(client->webrtcbin), gst_object_unref);
 
+	g_signal_emit_by_name(client->webrtcbin, "get-stats", NULL, promise);
 
-struct ems_gstreamer_pipeline
+	gst_promise_unref(promise);
+}
+
+static void
+check_client_layer(struct ems_gstreamer_client *client, const struct client_stats *stats)
 {
-	struct gstreamer_pipeline base;
+	struct ems_gstreamer_pipeline *egp = client->egp;
+	double fraction_lost = stats->fraction_lost;
 
+	client->lossy_checks = fraction_lost > LAYER_DOWN_FRACTION_LOST ? client->lossy_checks + 1 : 0;
+	client->clean_checks = fraction_lost < LAYER_UP_FRACTION_LOST ? client->clean_checks + 1 : 0;
 
-	// struct GstElement *pipeline;
-	GstElement *webrtc;
+	if (client->lossy_checks >= LAYER_DOWN_CHECKS && client->layer + 1 < egp->layer_count) {
+		switch_client_layer(client, client->layer + 1);
+	} else if (client->clean_checks >= LAYER_UP_CHECKS && client->layer > 0) {
+		switch_client_layer(client, client->layer - 1);
+	}
+}
+
+/*!
+ * Loss based control like the one in GCC, backing off on a growing round
+ * trip time too as that is queues filling up before anything is lost.
+ */
+static void
+update_client_estimate(struct ems_gstreamer_client *client, const struct client_stats *stats)
+{
+	struct ems_gstreamer_pipeline *egp = client->egp;
+	double estimate = client->estimate_kbps;
 
-	GObject *data_channel;
-	guint timeout_src_id;
+	if (stats->rtt_s >= 0.0 && (client->min_rtt_s < 0.0 || stats->rtt_s < client->min_rtt_s)) {
+		client->min_rtt_s = stats->rtt_s;
+	}
 
+	bool queueing = stats->rtt_s >= 0.0 && stats->rtt_s > client->min_rtt_s + ABR_RTT_MARGIN_S;
 
-	struct ems_callbacks *callbacks;
-};
+	if (stats->fraction_lost > ABR_DECREASE_FRACTION_LOST) {
+		estimate *= 1.0 - 0.5 * stats->fraction_lost;
+	} else if (queueing) {
+		estimate *= ABR_RTT_DECREASE_FACTOR;
+	} else if (stats->fraction_lost < ABR_INCREASE_FRACTION_LOST) {
+		estimate *= ABR_INCREASE_FACTOR;
+	}
 
+	client->estimate_kbps = (uint32_t)CLAMP(estimate, egp->abr.min_kbps, egp->abr.max_kbps);
+}
 
-static gboolean
-sigint_handler(gpointer user_data)
+static void
+apply_client_bitrate(struct ems_gstreamer_client *client)
 {
-	g_main_loop_quit(user_data);
-	return G_SOURCE_REMOVE;
+	const struct ems_gstreamer_encoder *enc = client->egp->encoder;
+	uint32_t target = get_client_bitrate(client);
+	uint32_t current = client->target_kbps;
+
+	if (fabs((double)target - (double)current) < ABR_MIN_CHANGE * current) {
+		return;
+	}
+
+	g_object_set(client->encoder, enc->bitrate_property, (guint)(target * enc->bitrate_scale), NULL);
+	client->target_kbps = target;
 }
 
-static gboolean
-gst_bus_cb(GstBus *bus, GstMessage *message, gpointer user_data)
+/*!
+ * Sets the encoder of each layer to what the worst client fed from it can
+ * take, and those of clients with their own to what that client can take.
+ */
+static void
+apply_layer_bitrates(struct ems_gstreamer_pipeline *egp)
 {
-	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)user_data;
-	GstBin *pipeline = GST_BIN(egp->base.pipeline);
+	uint32_t lowest[EMS_GSTREAMER_MAX_LAYERS];
+	for (uint32_t i = 0; i < egp->layer_count; i++) {
+		lowest[i] = UINT32_MAX;
+	}
 
-	switch (GST_MESSAGE_TYPE(message)) {
-	case GST_MESSAGE_ERROR: {
-		GError *gerr;
-		gchar *debug_msg;
-		gst_message_parse_error(message, &gerr, &debug_msg);
-		GST_DEBUG_BIN_TO_DOT_FILE(pipeline, GST_DEBUG_GRAPH_SHOW_ALL, "mss-pipeline-ERROR");
-		g_error("Error: %s (%s)", gerr->message, debug_msg);
-		g_error_free(gerr);
-		g_free(debug_msg);
-	} break;
-	case GST_MESSAGE_WARNING: {
-		GError *gerr;
-		gchar *debug_msg;
-		gst_message_parse_warning(message, &gerr, &debug_msg);
-		GST_DEBUG_BIN_TO_DOT_FILE(pipeline, GST_DEBUG_GRAPH_SHOW_ALL, "mss-pipeline-WARNING");
-		g_warning("Warning: %s (%s)", gerr->message, debug_msg);
-		g_error_free(gerr);
-		g_free(debug_msg);
-	} break;
-	case GST_MESSAGE_EOS: {
-		g_error("Got EOS!!");
-	} break;
-	default: break;
+	egp->abr.estimate_kbps = 0;
+
+	for (GList *l = egp->clients; l != NULL; l = l->next) {
+		struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)l->data;
+
+		if (client->encoder != NULL) {
+			apply_client_bitrate(client);
+		} else {
+			lowest[client->layer] = MIN(lowest[client->layer], client->estimate_kbps);
+		}
+
+		if (egp->abr.estimate_kbps == 0 || client->estimate_kbps < egp->abr.estimate_kbps) {
+			egp->abr.estimate_kbps = client->estimate_kbps;
+		}
+	}
+
+	const struct ems_gstreamer_encoder *enc = egp->encoder;
+
+	for (uint32_t i = 0; i < egp->layer_count; i++) {
+		// Nobody to adapt to.
+		if (lowest[i] == UINT32_MAX) {
+			continue;
+		}
+
+		// The estimate is for the first layer, smaller ones need less for the same quality.
+		uint32_t target = (uint32_t)MAX(lowest[i] * egp->layer_ratio[i], 100);
+		uint32_t current = egp->abr.target_kbps[i];
+
+		if (fabs((double)target - (double)current) < ABR_MIN_CHANGE * current) {
+			continue;
+		}
+
+		gchar *name = g_strdup_printf(EMS_GSTREAMER_ENCODER_NAME_FMT, i);
+		GstElement *encoder = gst_bin_get_by_name(GST_BIN(egp->base.pipeline), name);
+		g_free(name);
+
+		if (encoder == NULL) {
+			continue;
+		}
+
+		U_LOG_D("Layer %u bitrate %u -> %u kbit/s", i, current, target);
+
+		g_object_set(encoder, enc->bitrate_property, (guint)(target * enc->bitrate_scale), NULL);
+		egp->abr.target_kbps[i] = target;
+
+		gst_object_unref(encoder);
 	}
-	return TRUE;
 }
 
-static GstElement *
-get_webrtcbin_for_client(GstBin *pipeline, EmsClientId client_id)
+/*!
+ * Follow the loss with the FEC percentage, going up at once but only down
+ * step by step.
+ */
+static void
+update_client_fec(struct ems_gstreamer_client *client, const struct client_stats *stats)
 {
-	gchar *name;
-	GstElement *webrtcbin;
+	struct ems_gstreamer_pipeline *egp = client->egp;
 
-	name = g_strdup_printf("webrtcbin_%p", client_id);
-	webrtcbin = gst_bin_get_by_name(pipeline, name);
-	g_free(name);
+	long wanted = lround(stats->fraction_lost * 100.0 * FEC_LOSS_FACTOR);
+	long lowest = (long)client->fec_percentage - FEC_DECREASE_STEP;
+	uint32_t percentage = (uint32_t)CLAMP(MAX(wanted, lowest), (long)egp->recovery.fec_min_percentage,
+	                                      (long)egp->recovery.fec_max_percentage);
 
-	return webrtcbin;
+	if (percentage == client->fec_percentage) {
+		return;
+	}
+
+	GstWebRTCRTPTransceiver *transceiver = NULL;
+	g_signal_emit_by_name(client->webrtcbin, "get-transceiver", 0, &transceiver);
+	if (transceiver == NULL) {
+		return;
+	}
+
+	// Bound to the percentage of the ulpfecenc inside of webrtcbin.
+	g_object_set(transceiver, "fec-percentage", percentage, NULL);
+	client->fec_percentage = percentage;
+
+	gst_object_unref(transceiver);
 }
 
+/*!
+ * Wall time the own encoder of the client spent on frames since the last
+ * check, x264 and friends encode on threads of their own so it is not the
+ * CPU time but includes it.
+ */
 static void
-connect_webrtc_to_tee(GstElement *webrtcbin)
+update_client_usage(struct ems_gstreamer_client *client)
 {
-	GstElement *pipeline;
-	GstElement *tee;
-	GstPad *srcpad;
-	GstPad *sinkpad;
-	GstPadLinkReturn ret;
+	os_mutex_lock(&client->usage.mutex);
+	uint64_t busy_ns = client->usage.busy_ns;
+	client->usage.busy_ns = 0;
+	os_mutex_unlock(&client->usage.mutex);
+
+	client->busy_percent = (uint32_t)(busy_ns * 100 / ((uint64_t)CLIENT_CHECK_INTERVAL_S * U_TIME_1S_IN_NS));
+}
+
+static void
+update_client_metrics(struct ems_gstreamer_client *client, const struct client_stats *stats, uint64_t now_ns)
+{
+	struct ems_gstreamer_client_metrics *m = &client->metrics;
 
-	pipeline = GST_ELEMENT(gst_element_get_parent(webrtcbin));
-	if (pipeline == NULL)
+	if (stats->have_report) {
+		m->rtt_ms = stats->rtt_s >= 0.0 ? (float)(stats->rtt_s * 1000.0) : 0.0f;
+		m->jitter_ms = (float)(stats->jitter_s * 1000.0);
+		m->loss_percent = (float)(stats->fraction_lost * 100.0);
+		m->packets_lost = stats->packets_lost;
+	}
+
+	m->nack_count = stats->nack_count;
+	m->pli_count = stats->pli_count;
+
+	// The counters start over if the stream does.
+	if (client->last_stats_ns != 0 && stats->bytes_sent >= client->last_bytes_sent) {
+		double dt_s = (double)(now_ns - client->last_stats_ns) / (double)U_TIME_1S_IN_NS;
+		m->bitrate_kbps = (float)((double)(stats->bytes_sent - client->last_bytes_sent) * 8.0 / 1000.0 / dt_s);
+	}
+	client->last_bytes_sent = stats->bytes_sent;
+	client->last_stats_ns = now_ns;
+
+	m->frames_encoded = (uint64_t)g_atomic_int_get(&client->frames_encoded);
+	m->data_channel_bytes_sent = stats->data_channel_bytes_sent;
+	m->data_channel_bytes_received = stats->data_channel_bytes_received;
+}
+
+static void
+write_client_metrics(struct ems_gstreamer_pipeline *egp, struct ems_gstreamer_client *client, uint64_t now_ns)
+{
+	const struct ems_gstreamer_client_metrics *m = &client->metrics;
+	double time_s = (double)(now_ns - egp->created_ns) / (double)U_TIME_1S_IN_NS;
+
+	if (egp->stats_jsonl) {
+		fprintf(egp->stats_file,
+		        "{\"time_s\":%.3f,\"client\":%u,\"layer\":%u,\"rtt_ms\":%.2f,\"jitter_ms\":%.2f,"
+		        "\"loss_percent\":%.2f,\"packets_lost\":%" PRIu64 ",\"nack_count\":%" PRIu64
+		        ",\"pli_count\":%" PRIu64 ",\"bitrate_kbps\":%.1f,\"frames_encoded\":%" PRIu64
+		        ",\"data_channel_bytes_sent\":%" PRIu64 ",\"data_channel_bytes_received\":%" PRIu64 "}\n",
+		        time_s, client->id, client->layer, m->rtt_ms, m->jitter_ms, m->loss_percent, m->packets_lost,
+		        m->nack_count, m->pli_count, m->bitrate_kbps, m->frames_encoded, m->data_channel_bytes_sent,
+		        m->data_channel_bytes_received);
+	} else {
+		fprintf(egp->stats_file,
+		        "%.3f,%u,%u,%.2f,%.2f,%.2f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.1f,%" PRIu64 ",%" PRIu64
+		        ",%" PRIu64 "\n",
+		        time_s, client->id, client->layer, m->rtt_ms, m->jitter_ms, m->loss_percent, m->packets_lost,
+		        m->nack_count, m->pli_count, m->bitrate_kbps, m->frames_encoded, m->data_channel_bytes_sent,
+		        m->data_channel_bytes_received);
+	}
+}
+
+static void
+open_stats_file(struct ems_gstreamer_pipeline *egp)
+{
+	const char *path = debug_get_option_stats_file();
+	if (path == NULL) {
 		return;
-	tee = gst_bin_get_by_name(GST_BIN(pipeline), WEBRTC_TEE_NAME);
-	srcpad = gst_element_request_pad_simple(tee, "src_%u");
-	sinkpad = gst_element_request_pad_simple(webrtcbin, "sink_0");
-	ret = gst_pad_link(srcpad, sinkpad);
-	g_assert(ret == GST_PAD_LINK_OK);
-	gst_object_unref(srcpad);
-	gst_object_unref(sinkpad);
-	gst_object_unref(tee);
-	gst_object_unref(pipeline);
+	}
+
+	egp->stats_file = fopen(path, "w");
+	if (egp->stats_file == NULL) {
+		U_LOG_E("Could not open '%s' for the stats", path);
+		return;
+	}
+
+	egp->stats_jsonl = g_str_has_suffix(path, ".jsonl");
+	if (!egp->stats_jsonl) {
+		fprintf(egp->stats_file,
+		        "time_s,client,layer,rtt_ms,jitter_ms,loss_percent,packets_lost,nack_count,pli_count,"
+		        "bitrate_kbps,frames_encoded,data_channel_bytes_sent,data_channel_bytes_received\n");
+	}
+
+	U_LOG_I("Writing client stats to '%s'", path);
+}
+
+/*!
+ * Takes in the newest stats of each client for the debug UI and the stats
+ * file, moves clients between layers and adapts the bitrate and FEC to what
+ * they report. On the main loop, once the replies to @ref check_clients come
+ * in.
+ */
+static gboolean
+handle_client_stats(gpointer user_data)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)user_data;
+	uint32_t fec_percentage = 0;
+	uint32_t nack_count = 0;
+
+	os_mutex_lock(&egp->client_stats.mutex);
+	egp->client_stats.idle_id = 0;
+	os_mutex_unlock(&egp->client_stats.mutex);
+
+	for (GList *l = egp->clients; l != NULL; l = l->next) {
+		struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)l->data;
+
+		os_mutex_lock(&client->stats.mutex);
+		struct client_stats stats = client->stats.reply;
+		uint64_t reply_ns = client->stats.reply_ns;
+		bool pending = client->stats.pending;
+		client->stats.pending = false;
+		os_mutex_unlock(&client->stats.mutex);
+
+		if (pending) {
+			update_client_metrics(client, &stats, reply_ns);
+			if (egp->stats_file != NULL) {
+				write_client_metrics(egp, client, reply_ns);
+			}
+		}
+
+		if (pending && stats.have_report) {
+			if (egp->recovery.fec) {
+				update_client_fec(client, &stats);
+			}
+
+			if (egp->layer_count > 1) {
+				check_client_layer(client, &stats);
+			}
+
+			if (egp->abr.enabled) {
+				update_client_estimate(client, &stats);
+			}
+		}
+
+		// Clients that haven't replied yet count with what they last reported.
+		fec_percentage = MAX(fec_percentage, client->fec_percentage);
+		nack_count += (uint32_t)client->metrics.nack_count;
+	}
+
+	if (egp->abr.enabled) {
+		apply_layer_bitrates(egp);
+	}
+
+	egp->recovery.fec_percentage = fec_percentage;
+	egp->recovery.nack_count = nack_count;
+
+	if (egp->stats_file != NULL) {
+		fflush(egp->stats_file);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Asks each client for its stats, they are handled in
+ * @ref handle_client_stats so the main loop doesn't wait on the webrtcbins.
+ */
+static gboolean
+check_clients(gpointer user_data)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)user_data;
+	uint32_t busy_percent = 0;
+
+	for (GList *l = egp->clients; l != NULL; l = l->next) {
+		struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)l->data;
+
+		if (client->encoder != NULL) {
+			update_client_usage(client);
+			busy_percent = MAX(busy_percent, client->busy_percent);
+		}
+
+		request_client_stats(client);
+	}
+
+	egp->client_encoders.busy_percent = busy_percent;
+
+	return G_SOURCE_CONTINUE;
 }
 
 static void
@@ -165,7 +1356,15 @@ on_offer_created(GstPromise *promise, GstElement *webrtcbin)
 
 	gst_webrtc_session_description_free(offer);
 
-	connect_webrtc_to_tee(webrtcbin);
+	// Only now, requesting the pad before would have added a second transceiver.
+	struct ems_gstreamer_client *client = g_object_get_data(G_OBJECT(webrtcbin), "client");
+	if (!gst_element_link_pads(client->bin, "src", webrtcbin, "sink_0")) {
+		U_LOG_E("Couldn't link payloader to webrtcbin!");
+		return;
+	}
+
+	// Nothing can reach the client yet, its key frame is requested once connected.
+	link_client_to_layer(client, client->layer, false);
 }
 
 static void
@@ -190,6 +1389,26 @@ data_channel_error_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_pi
 	U_LOG_E("error");
 }
 
+static GObject *
+create_data_channel(struct ems_gstreamer_client *client, const char *label, const char *options)
+{
+	GObject *channel = NULL;
+
+	GstStructure *data_channel_options = gst_structure_new_from_string(options);
+	g_signal_emit_by_name(client->webrtcbin, "create-data-channel", label, data_channel_options, &channel);
+	gst_clear_structure(&data_channel_options);
+
+	if (channel == NULL) {
+		U_LOG_E("Couldn't make data channel '%s'!", label);
+		assert(false);
+		return NULL;
+	}
+
+	g_signal_connect(channel, "on-error", G_CALLBACK(data_channel_error_cb), client->egp);
+
+	return channel;
+}
+
 gboolean
 datachannel_send_message(GstWebRTCDataChannel *datachannel)
 {
@@ -203,47 +1422,183 @@ datachannel_send_message(GstWebRTCDataChannel *datachannel)
 }
 
 static void
-data_channel_open_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_pipeline *egp)
+data_channel_open_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_client *client)
 {
 	U_LOG_I("data channel opened");
 
-	egp->timeout_src_id = g_timeout_add_seconds(3, G_SOURCE_FUNC(datachannel_send_message), datachannel);
+	client->hello_timeout_id = g_timeout_add_seconds(3, G_SOURCE_FUNC(datachannel_send_message), datachannel);
 }
 
 static void
-data_channel_close_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_pipeline *egp)
+data_channel_close_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_client *client)
 {
 	U_LOG_I("data channel closed");
 
-	g_clear_handle_id(&egp->timeout_src_id, g_source_remove);
-	g_clear_object(&egp->data_channel);
+	g_clear_handle_id(&client->hello_timeout_id, g_source_remove);
 }
 
-static void
-data_channel_message_data_cb(GstWebRTCDataChannel *datachannel, GBytes *data, struct ems_gstreamer_pipeline *egp)
+static bool
+decode_up_message(GBytes *data, em_proto_UpMessage *out_message)
 {
-	em_proto_UpMessage message = em_proto_UpMessage_init_default;
 	size_t n = 0;
 
 	const unsigned char *buf = (const unsigned char *)g_bytes_get_data(data, &n);
 	pb_istream_t our_istream = pb_istream_from_buffer(buf, n);
 
-	bool result = pb_decode_ex(&our_istream, &em_proto_UpMessage_msg, &message, PB_DECODE_NULLTERMINATED);
+	bool result = pb_decode_ex(&our_istream, &em_proto_UpMessage_msg, out_message, PB_DECODE_NULLTERMINATED);
 
 	if (!result) {
 		U_LOG_E("Error! %s", PB_GET_ERROR(&our_istream));
+	}
+
+	return result;
+}
+
+static void
+handle_tracking_message(struct ems_gstreamer_client *client, em_proto_UpMessage *message)
+{
+	// Overtaken by a newer pose on the unordered channel, which is already in use.
+	if (message->up_message_id <= client->last_tracking_id) {
+		return;
+	}
+
+	client->last_tracking_id = message->up_message_id;
+	ems_callbacks_call(client->egp->callbacks, EMS_CALLBACKS_EVENT_TRACKING, message);
+}
+
+static void
+handle_frame_message(struct ems_gstreamer_client *client, em_proto_UpMessage *message)
+{
+	struct ems_gstreamer_pipeline *egp = client->egp;
+
+	// Held while calling, so the change is seen before any report of the new client.
+	os_mutex_lock(&egp->frame_reports.mutex);
+
+	if (egp->frame_reports.client == NULL) {
+		egp->frame_reports.client = client;
+
+		em_proto_UpMessage empty = em_proto_UpMessage_init_default;
+		ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_FRAME_CLIENT, &empty);
+	}
+
+	if (egp->frame_reports.client == client) {
+		ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_FRAME, message);
+	}
+
+	os_mutex_unlock(&egp->frame_reports.mutex);
+}
+
+static void
+tracking_channel_message_cb(GstWebRTCDataChannel *datachannel, GBytes *data, struct ems_gstreamer_client *client)
+{
+	em_proto_UpMessage message = em_proto_UpMessage_init_default;
+
+	if (decode_up_message(data, &message) && message.has_tracking) {
+		handle_tracking_message(client, &message);
+	}
+}
+
+static void
+frame_channel_message_cb(GstWebRTCDataChannel *datachannel, GBytes *data, struct ems_gstreamer_client *client)
+{
+	em_proto_UpMessage message = em_proto_UpMessage_init_default;
+
+	if (decode_up_message(data, &message) && message.has_frame) {
+		handle_frame_message(client, &message);
+	}
+}
+
+//! The control channel takes anything, for clients that only know of one channel.
+static void
+data_channel_message_data_cb(GstWebRTCDataChannel *datachannel, GBytes *data, struct ems_gstreamer_client *client)
+{
+	em_proto_UpMessage message = em_proto_UpMessage_init_default;
+
+	if (!decode_up_message(data, &message)) {
 		return;
 	}
-	ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_TRACKING, &message);
+	if (message.has_tracking) {
+		handle_tracking_message(client, &message);
+	}
+	if (message.has_frame) {
+		handle_frame_message(client, &message);
+	}
 }
 
 static void
-data_channel_message_string_cb(GstWebRTCDataChannel *datachannel, gchar *str, struct ems_gstreamer_pipeline *egp)
+data_channel_message_string_cb(GstWebRTCDataChannel *datachannel, gchar *str, struct ems_gstreamer_client *client)
 {
 	U_LOG_I("Received data channel message: %s\n", str);
 }
 
 
+static void
+webrtc_connection_state_cb(GstElement *webrtcbin, GParamSpec *pspec, struct ems_gstreamer_client *client)
+{
+	GstWebRTCPeerConnectionState state;
+	g_object_get(webrtcbin, "connection-state", &state, NULL);
+
+	if (state != GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED) {
+		return;
+	}
+
+	/*
+	 * Anything sent before now was lost, and with intra refresh there is no
+	 * next key frame to wait for. Shares the key frame with other clients
+	 * joining around the same time.
+	 */
+	g_atomic_int_set(&client->wait_keyframe, 1);
+	request_client_keyframe(client);
+}
+
+static GstPadProbeReturn
+count_frames_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)user_data;
+
+	g_atomic_int_inc(&client->frames_encoded);
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+add_client_vars(struct ems_gstreamer_client *client)
+{
+	struct ems_gstreamer_client_metrics *m = &client->metrics;
+
+	u_var_add_root(client, "Electric Maple client", true);
+	u_var_add_ro_u32(client, &client->layer, "Layer");
+	u_var_add_ro_u32(client, &client->estimate_kbps, "Bitrate estimate (kbit/s)");
+	u_var_add_ro_f32(client, &m->bitrate_kbps, "Bitrate sent (kbit/s)");
+	u_var_add_ro_f32(client, &m->rtt_ms, "Round trip time (ms)");
+	u_var_add_ro_f32(client, &m->jitter_ms, "Jitter (ms)");
+	u_var_add_ro_f32(client, &m->loss_percent, "Loss (%)");
+	u_var_add_ro_u64(client, &m->packets_lost, "Packets lost");
+	u_var_add_ro_u64(client, &m->nack_count, "NACKs received");
+	u_var_add_ro_u64(client, &m->pli_count, "PLIs received");
+	u_var_add_ro_u32(client, &client->fec_percentage, "FEC percentage");
+	u_var_add_ro_u64(client, &m->frames_encoded, "Frames encoded");
+	u_var_add_ro_u64(client, &m->data_channel_bytes_sent, "Data channel bytes sent");
+	u_var_add_ro_u64(client, &m->data_channel_bytes_received, "Data channel bytes received");
+}
+
+static void
+free_client(gpointer user_data)
+{
+	struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)user_data;
+
+	u_var_remove_root(client);
+
+	g_clear_handle_id(&client->hello_timeout_id, g_source_remove);
+	g_clear_object(&client->tracking_channel);
+	g_clear_object(&client->frame_channel);
+	g_clear_object(&client->control_channel);
+
+	os_mutex_destroy(&client->usage.mutex);
+	os_mutex_destroy(&client->stats.mutex);
+	g_free(client);
+}
+
 static void
 webrtc_client_connected_cb(EmsSignalingServer *server, EmsClientId client_id, struct ems_gstreamer_pipeline *egp)
 {
@@ -261,6 +1616,89 @@ webrtc_client_connected_cb(EmsSignalingServer *server, EmsClientId client_id, st
 	g_object_set_data(G_OBJECT(webrtcbin), "client_id", client_id);
 	gst_bin_add(pipeline, webrtcbin);
 
+	/*
+	 * Each client has its own payloader, so it can be moved between the
+	 * layers without the RTP stream (SSRC and sequence numbers) changing.
+	 */
+	struct ems_gstreamer_client *client = g_new0(struct ems_gstreamer_client, 1);
+	client->egp = egp;
+	client->webrtcbin = webrtcbin;
+	client->estimate_kbps = (uint32_t)CLAMP(debug_get_num_option_bitrate(), egp->abr.min_kbps, egp->abr.max_kbps);
+	client->min_rtt_s = -1.0;
+	client->fec_percentage = egp->recovery.fec_min_percentage;
+	client->id = egp->next_client_id++;
+	int mutex_ret = os_mutex_init(&client->usage.mutex);
+	g_assert(mutex_ret == 0);
+	mutex_ret = os_mutex_init(&client->stats.mutex);
+	g_assert(mutex_ret == 0);
+	g_object_set_data_full(G_OBJECT(webrtcbin), "client", client, free_client);
+
+	bool own_encoder = egp->client_encoders.enabled && egp->client_encoders.active < egp->client_encoders.max;
+
+	GString *bin_desc = g_string_new(NULL);
+	if (own_encoder) {
+		/*
+		 * Leaky, so a slow encoder drops frames for its client only instead
+		 * of holding up the shared appsrc. Scaled to the size of the layer.
+		 */
+		const struct ems_gstreamer_layer_info *size = &egp->layers[client->layer];
+		client->target_kbps = get_client_bitrate(client);
+
+		g_string_append_printf(                                                                          //
+		    bin_desc,                                                                                    //
+		    "queue leaky=downstream max-size-buffers=1 max-size-bytes=0 max-size-time=0 ! videoscale ! " //
+		    "capsfilter name=" CLIENT_SCALE_CAPS_NAME " caps=video/x-raw,width=%u,height=%u ! ",         //
+		    size->width, size->height);
+		ems_gstreamer_encoder_append_description( //
+		    egp->encoder,                         // enc
+		    bin_desc,                             // desc
+		    CLIENT_ENCODER_NAME,                  // name
+		    client->target_kbps,                  // bitrate_kbps
+		    egp->layers[0].width,                 // width
+		    egp->layers[0].height,                // height
+		    egp->fps);                            // fps
+		g_string_append(bin_desc, "! ");
+	} else {
+		g_string_append(bin_desc, "queue ! ");
+	}
+	g_string_append_printf(bin_desc, "%s name=" PAYLOADER_NAME " ! application/x-rtp,payload=96",
+	                       egp->encoder->payloader);
+
+	GError *error = NULL;
+	client->bin = gst_parse_bin_from_description(bin_desc->str, TRUE, &error);
+	g_assert_no_error(error);
+	g_string_free(bin_desc, TRUE);
+	gst_bin_add(pipeline, client->bin);
+
+	if (own_encoder) {
+		// Its PLIs reach the encoder directly, nobody else shares the key frames.
+		setup_client_encoder(client);
+		U_LOG_I("Client %p has its own encoder, %u of %u", (void *)client, egp->client_encoders.active,
+		        egp->client_encoders.max);
+	} else {
+		GstPad *bin_sinkpad = gst_element_get_static_pad(client->bin, "sink");
+		gst_pad_add_probe(bin_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, wait_keyframe_probe_cb, client, NULL);
+		gst_pad_add_probe(bin_sinkpad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, client_keyframe_request_probe_cb,
+		                  client, NULL);
+		gst_object_unref(bin_sinkpad);
+	}
+
+	if (ems_frame_trace_enabled()) {
+		add_frame_trace_probe(client->bin, PAYLOADER_NAME, EMS_FRAME_TRACE_STAGE_PAYLOADED);
+	}
+
+	GstElement *payloader = gst_bin_get_by_name(GST_BIN(client->bin), PAYLOADER_NAME);
+	GstPad *payloader_sinkpad = gst_element_get_static_pad(payloader, "sink");
+	gst_pad_add_probe(payloader_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, count_frames_probe_cb, client, NULL);
+	gst_object_unref(payloader_sinkpad);
+	gst_object_unref(payloader);
+
+	add_client_vars(client);
+
+	gst_element_sync_state_with_parent(client->bin);
+
+	egp->clients = g_list_append(egp->clients, client);
+
 	ret = gst_element_set_state(webrtcbin, GST_STATE_READY);
 	g_assert(ret != GST_STATE_CHANGE_FAILURE);
 
@@ -268,38 +1706,57 @@ webrtc_client_connected_cb(EmsSignalingServer *server, EmsClientId client_id, st
 
 	// I also think this would work if the pipeline state is READY but /shrug
 
-	// TODO add priority
-	GstStructure *data_channel_options = gst_structure_new_from_string("data-channel-options, ordered=true");
-	g_signal_emit_by_name(webrtcbin, "create-data-channel", "channel", data_channel_options, &egp->data_channel);
-	gst_clear_structure(&data_channel_options);
-
-	if (!egp->data_channel) {
-		U_LOG_E("Couldn't make datachannel!");
-		assert(false);
-	} else {
-		U_LOG_I("Successfully created datachannel!");
-
-		g_signal_connect(egp->data_channel, "on-open", G_CALLBACK(data_channel_open_cb), egp);
-		g_signal_connect(egp->data_channel, "on-close", G_CALLBACK(data_channel_close_cb), egp);
-		g_signal_connect(egp->data_channel, "on-error", G_CALLBACK(data_channel_error_cb), egp);
-		g_signal_connect(egp->data_channel, "on-message-data", G_CALLBACK(data_channel_message_data_cb), egp);
-		g_signal_connect(egp->data_channel, "on-message-string", G_CALLBACK(data_channel_message_string_cb),
-		                 egp);
+	/*
+	 * A lost pose held up everything behind it on a reliable, ordered
+	 * channel, so tracking gets its own that never retransmits, see
+	 * em_data_channels.h.
+	 *
+	 * TODO add priority
+	 */
+	const char *unreliable = "data-channel-options, ordered=(boolean)false, max-retransmits=(int)0";
+	const char *reliable = "data-channel-options, ordered=(boolean)true";
+	client->tracking_channel = create_data_channel(client, EM_DATA_CHANNEL_TRACKING, unreliable);
+	client->frame_channel = create_data_channel(client, EM_DATA_CHANNEL_FRAME, reliable);
+	client->control_channel = create_data_channel(client, EM_DATA_CHANNEL_CONTROL, reliable);
+
+	if (client->tracking_channel != NULL && client->frame_channel != NULL && client->control_channel != NULL) {
+		U_LOG_I("Successfully created datachannels!");
+
+		g_signal_connect(client->tracking_channel, "on-message-data", G_CALLBACK(tracking_channel_message_cb),
+		                 client);
+		g_signal_connect(client->frame_channel, "on-message-data", G_CALLBACK(frame_channel_message_cb),
+		                 client);
+
+		g_signal_connect(client->control_channel, "on-open", G_CALLBACK(data_channel_open_cb), client);
+		g_signal_connect(client->control_channel, "on-close", G_CALLBACK(data_channel_close_cb), client);
+		g_signal_connect(client->control_channel, "on-message-data", G_CALLBACK(data_channel_message_data_cb),
+		                 client);
+		g_signal_connect(client->control_channel, "on-message-string",
+		                 G_CALLBACK(data_channel_message_string_cb), client);
 	}
 
 	ret = gst_element_set_state(webrtcbin, GST_STATE_PLAYING);
 	g_assert(ret != GST_STATE_CHANGE_FAILURE);
 
 	g_signal_connect(webrtcbin, "on-ice-candidate", G_CALLBACK(webrtc_on_ice_candidate_cb), NULL);
+	g_signal_connect(webrtcbin, "notify::connection-state", G_CALLBACK(webrtc_connection_state_cb), client);
 
-	caps = gst_caps_from_string(
-	    "application/x-rtp, "
-	    "payload=96,encoding-name=H264,clock-rate=90000,media=video,packetization-mode=(string)1,profile-level-id=("
-	    "string)42e01f");
+	// Follows the encoder backend, see ems_gstreamer_encoder_get_rtp_caps.
+	caps = gst_caps_from_string(egp->rtp_caps);
 	g_signal_emit_by_name(webrtcbin, "add-transceiver", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY, caps,
 	                      &transceiver);
 
 	gst_caps_unref(caps);
+
+	// RTX is set up along with NACK, the FEC is ULPFEC carried in RED.
+	g_object_set(transceiver, "do-nack", egp->recovery.nack, NULL);
+	if (egp->recovery.fec) {
+		g_object_set(transceiver,                              //
+		             "fec-type", GST_WEBRTC_FEC_TYPE_ULP_RED,  //
+		             "fec-percentage", client->fec_percentage, //
+		             NULL);
+	}
+
 	gst_clear_object(&transceiver);
 
 	g_signal_emit_by_name(
@@ -373,17 +1830,78 @@ webrtc_candidate_cb(EmsSignalingServer *server,
 	g_debug("Remote candidate: %s", candidate);
 }
 
+static void
+remove_client(struct ems_gstreamer_client *client)
+{
+	GstBin *pipeline = GST_BIN(GST_ELEMENT_PARENT(client->webrtcbin));
+
+	// The pipeline holds the only references, keep them alive until stopped.
+	GstElement *bin = gst_object_ref(client->bin);
+	GstElement *webrtcbin = gst_object_ref(client->webrtcbin);
+
+	gst_element_set_state(bin, GST_STATE_NULL);
+	gst_element_set_state(webrtcbin, GST_STATE_NULL);
+	gst_bin_remove(pipeline, bin);
+	gst_bin_remove(pipeline, webrtcbin);
+
+	// Frees the client along with the webrtcbin.
+	gst_object_unref(bin);
+	gst_object_unref(webrtcbin);
+}
+
 static GstPadProbeReturn
 remove_webrtcbin_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 {
 	GstElement *webrtcbin = GST_ELEMENT(user_data);
+	struct ems_gstreamer_client *client = g_object_get_data(G_OBJECT(webrtcbin), "client");
+	GstElement *tee = gst_pad_get_parent_element(pad);
 
-	gst_bin_remove(GST_BIN(GST_ELEMENT_PARENT(webrtcbin)), webrtcbin);
-	gst_element_set_state(webrtcbin, GST_STATE_NULL);
+	gst_element_release_request_pad(tee, pad);
+	gst_object_unref(tee);
+
+	remove_client(client);
 
 	return GST_PAD_PROBE_REMOVE;
 }
 
+//! Unlink and remove the branch of the client, takes over the reference to @p webrtcbin.
+static void
+drop_client(struct ems_gstreamer_pipeline *egp, GstElement *webrtcbin)
+{
+	struct ems_gstreamer_client *client = g_object_get_data(G_OBJECT(webrtcbin), "client");
+	egp->clients = g_list_remove(egp->clients, client);
+
+	// The next client to send a report takes over.
+	os_mutex_lock(&egp->frame_reports.mutex);
+	if (egp->frame_reports.client == client) {
+		egp->frame_reports.client = NULL;
+	}
+	os_mutex_unlock(&egp->frame_reports.mutex);
+
+	if (client->encoder != NULL) {
+		egp->client_encoders.active--;
+	}
+
+	// Its key frame may never come out now.
+	clear_keyframe_pending(egp, &client->keyframe_pending);
+
+	GstPad *sinkpad = gst_element_get_static_pad(client->bin, "sink");
+	GstPad *peer = gst_pad_get_peer(sinkpad);
+
+	if (peer != NULL) {
+		// Takes over our reference to the webrtcbin.
+		gst_pad_add_probe(peer, GST_PAD_PROBE_TYPE_BLOCK_DOWNSTREAM, remove_webrtcbin_probe_cb, webrtcbin,
+		                  gst_object_unref);
+		gst_object_unref(peer);
+	} else {
+		// Never got linked to a layer.
+		remove_client(client);
+		gst_object_unref(webrtcbin);
+	}
+
+	gst_clear_object(&sinkpad);
+}
+
 static void
 webrtc_client_disconnected_cb(EmsSignalingServer *server, EmsClientId client_id, struct ems_gstreamer_pipeline *egp)
 {
@@ -393,16 +1911,284 @@ webrtc_client_disconnected_cb(EmsSignalingServer *server, EmsClientId client_id,
 	webrtcbin = get_webrtcbin_for_client(pipeline, client_id);
 
 	if (webrtcbin) {
-		GstPad *sinkpad;
+		drop_client(egp, webrtcbin);
+	}
+}
+
+
+/*
+ *
+ * Error recovery.
+ *
+ */
+
+//! The element directly in the pipeline that @p object is in, or is.
+static GstElement *
+get_top_level_element(struct ems_gstreamer_pipeline *egp, GstObject *object)
+{
+	GstObject *pipeline = GST_OBJECT(egp->base.pipeline);
+
+	while (object != NULL && GST_OBJECT_PARENT(object) != pipeline) {
+		object = GST_OBJECT_PARENT(object);
+	}
+
+	return object != NULL && GST_IS_ELEMENT(object) ? GST_ELEMENT(object) : NULL;
+}
+
+static struct ems_gstreamer_client *
+find_client_of_element(struct ems_gstreamer_pipeline *egp, GstElement *element)
+{
+	for (GList *l = egp->clients; l != NULL; l = l->next) {
+		struct ems_gstreamer_client *client = (struct ems_gstreamer_client *)l->data;
+		if (client->bin == element || client->webrtcbin == element) {
+			return client;
+		}
+	}
+
+	return NULL;
+}
+
+//! Next element downstream through the "src" pad, NULL at the end or a request pad, returns a reference.
+static GstElement *
+get_next_element(GstElement *element)
+{
+	GstPad *srcpad = gst_element_get_static_pad(element, "src");
+	if (srcpad == NULL) {
+		return NULL;
+	}
 
-		sinkpad = gst_element_get_static_pad(webrtcbin, "sink_0");
-		if (sinkpad) {
-			gst_pad_add_probe(GST_PAD_PEER(sinkpad), GST_PAD_PROBE_TYPE_BLOCK_DOWNSTREAM,
-			                  remove_webrtcbin_probe_cb, webrtcbin, gst_object_unref);
+	GstPad *peer = gst_pad_get_peer(srcpad);
+	gst_object_unref(srcpad);
+	if (peer == NULL) {
+		return NULL;
+	}
+
+	GstElement *next = gst_pad_get_parent_element(peer);
+	gst_object_unref(peer);
+
+	return next;
+}
+
+/*!
+ * Which layer a top level element is part of, going downstream until the
+ * appsrc or tee of the layer, whose names have the index.
+ */
+static bool
+find_layer_of_element(GstElement *element, uint32_t *out_layer)
+{
+	GstElement *e = gst_object_ref(element);
+
+	while (e != NULL) {
+		const gchar *name = GST_OBJECT_NAME(e);
+		unsigned int layer = 0;
+
+		bool found = sscanf(name, EMS_GSTREAMER_APPSRC_NAME_FMT, &layer) == 1 ||
+		             sscanf(name, WEBRTC_TEE_NAME_FMT, &layer) == 1;
+
+		// Only the first layer has one.
+		if (g_str_equal(name, RAW_TEE_NAME)) {
+			found = true;
+		}
 
-			gst_clear_object(&sinkpad);
+		if (found) {
+			gst_object_unref(e);
+			*out_layer = layer;
+			return true;
 		}
+
+		GstElement *next = get_next_element(e);
+		gst_object_unref(e);
+		e = next;
+	}
+
+	return false;
+}
+
+//! The elements of the branch of @p layer, from the appsrc up to but not including its tee, upstream first.
+static GList *
+get_layer_elements(struct ems_gstreamer_pipeline *egp, uint32_t layer)
+{
+	GstBin *pipeline = GST_BIN(egp->base.pipeline);
+	GList *elements = NULL;
+
+	gchar *name = g_strdup_printf(EMS_GSTREAMER_APPSRC_NAME_FMT, layer);
+	elements = g_list_append(elements, gst_bin_get_by_name(pipeline, name));
+	g_free(name);
+
+	// Clients with their own encoder are fed from it, they see the same gap as the others.
+	if (layer == 0 && egp->client_encoders.enabled) {
+		elements = g_list_append(elements, gst_bin_get_by_name(pipeline, RAW_TEE_NAME));
+	}
+
+	name = g_strdup_printf(EMS_GSTREAMER_ENCODER_QUEUE_NAME_FMT, layer);
+	GstElement *e = gst_bin_get_by_name(pipeline, name);
+	g_free(name);
+
+	GstElement *tee = get_layer_tee(egp, layer);
+
+	while (e != NULL && e != tee) {
+		elements = g_list_append(elements, e);
+		e = get_next_element(e);
+	}
+
+	gst_clear_object(&e);
+	gst_object_unref(tee);
+
+	return elements;
+}
+
+static GstPadProbeReturn
+layer_recovered_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_layer_restart *lr = (struct ems_layer_restart *)user_data;
+	struct ems_gstreamer_pipeline *egp = lr->egp;
+
+	float recovery_ms = (float)(os_monotonic_get_ns() - lr->error_ns) / (float)U_TIME_1MS_IN_NS;
+
+	egp->errors.last_recovery_ms = recovery_ms;
+	egp->errors.max_recovery_ms = MAX(egp->errors.max_recovery_ms, recovery_ms);
+	g_atomic_int_set(&lr->streaming, 1);
+
+	U_LOG_I("Layer %u streaming again %.1fms after the error", lr->layer, recovery_ms);
+
+	return GST_PAD_PROBE_REMOVE;
+}
+
+/*!
+ * Takes the branch of the layer down to NULL and back up, which makes the
+ * encoder start over with a key frame. The clients stay linked to the tee,
+ * they just see a gap.
+ */
+static gboolean
+restart_layer_cb(gpointer user_data)
+{
+	struct ems_layer_restart *lr = (struct ems_layer_restart *)user_data;
+	struct ems_gstreamer_pipeline *egp = lr->egp;
+
+	lr->timeout_id = 0;
+
+	U_LOG_W("Restarting layer %u, attempt %u", lr->layer, lr->attempts);
+
+	GList *elements = get_layer_elements(egp, lr->layer);
+
+	// Stop the flow from the source on, then start from the sink end so nothing pushes into a stopped element.
+	for (GList *l = elements; l != NULL; l = l->next) {
+		gst_element_set_state(GST_ELEMENT(l->data), GST_STATE_NULL);
+	}
+	for (GList *l = g_list_last(elements); l != NULL; l = l->prev) {
+		gst_element_sync_state_with_parent(GST_ELEMENT(l->data));
+	}
+
+	g_list_free_full(elements, gst_object_unref);
+
+	// Only the first, it stays until frames come through however many attempts it takes.
+	if (lr->attempts == 1) {
+		GstElement *tee = get_layer_tee(egp, lr->layer);
+		GstPad *sinkpad = gst_element_get_static_pad(tee, "sink");
+		gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, layer_recovered_probe_cb, lr, NULL);
+		gst_object_unref(sinkpad);
+		gst_object_unref(tee);
+	}
+
+	egp->errors.restarts++;
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_layer_restart(struct ems_gstreamer_pipeline *egp, uint32_t layer)
+{
+	struct ems_layer_restart *lr = &egp->errors.layers[layer];
+
+	// The first error makes the elements around it fail too, one restart covers them all.
+	if (lr->timeout_id != 0) {
+		return;
+	}
+
+	// First error since it last worked, otherwise the recovery time includes the failed attempts.
+	if (g_atomic_int_get(&lr->streaming)) {
+		lr->error_ns = os_monotonic_get_ns();
+		lr->attempts = 0;
+	}
+
+	if (lr->attempts >= LAYER_MAX_RESTARTS) {
+		U_LOG_E("Layer %u failed %u restarts in a row, giving up on it", layer, lr->attempts);
+		return;
+	}
+
+	g_atomic_int_set(&lr->streaming, 0);
+	lr->attempts++;
+	lr->timeout_id = g_timeout_add(LAYER_RESTART_DELAY_MS, restart_layer_cb, lr);
+}
+
+/*!
+ * Recover from an error by rebuilding only the part of the pipeline it came
+ * from, the compositor keeps pushing frames throughout. A client with a
+ * failing branch or webrtcbin is dropped so it can connect again, a failing
+ * layer is restarted.
+ */
+static void
+handle_pipeline_error(struct ems_gstreamer_pipeline *egp, GstMessage *message)
+{
+	GstElement *element = get_top_level_element(egp, GST_MESSAGE_SRC(message));
+	uint32_t layer = 0;
+
+	egp->errors.count++;
+
+	if (element == NULL) {
+		U_LOG_E("Error from outside of the pipeline elements, nothing to restart");
+		return;
+	}
+
+	struct ems_gstreamer_client *client = find_client_of_element(egp, element);
+	if (client != NULL) {
+		U_LOG_W("Dropping client %p after an error in its branch", (void *)client);
+		egp->errors.clients_dropped++;
+		drop_client(egp, gst_object_ref(client->webrtcbin));
+		return;
+	}
+
+	if (find_layer_of_element(element, &layer)) {
+		schedule_layer_restart(egp, layer);
+		return;
+	}
+
+	U_LOG_E("Error from %s, which is not part of a layer or client, nothing to restart", GST_ELEMENT_NAME(element));
+}
+
+static gboolean
+gst_bus_cb(GstBus *bus, GstMessage *message, gpointer user_data)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)user_data;
+	GstBin *pipeline = GST_BIN(egp->base.pipeline);
+
+	switch (GST_MESSAGE_TYPE(message)) {
+	case GST_MESSAGE_ERROR: {
+		GError *gerr;
+		gchar *debug_msg;
+		gst_message_parse_error(message, &gerr, &debug_msg);
+		GST_DEBUG_BIN_TO_DOT_FILE(pipeline, GST_DEBUG_GRAPH_SHOW_ALL, "mss-pipeline-ERROR");
+		U_LOG_E("Error from %s: %s (%s)", GST_MESSAGE_SRC_NAME(message), gerr->message, debug_msg);
+		g_error_free(gerr);
+		g_free(debug_msg);
+		handle_pipeline_error(egp, message);
+	} break;
+	case GST_MESSAGE_WARNING: {
+		GError *gerr;
+		gchar *debug_msg;
+		gst_message_parse_warning(message, &gerr, &debug_msg);
+		GST_DEBUG_BIN_TO_DOT_FILE(pipeline, GST_DEBUG_GRAPH_SHOW_ALL, "mss-pipeline-WARNING");
+		g_warning("Warning: %s (%s)", gerr->message, debug_msg);
+		g_error_free(gerr);
+		g_free(debug_msg);
+	} break;
+	case GST_MESSAGE_EOS: {
+		// Only once every sink is done, which we never ask for other than when stopping.
+		U_LOG_W("Got EOS");
+	} break;
+	default: break;
 	}
+	return TRUE;
 }
 
 struct RestartData
@@ -465,22 +2251,6 @@ src_event_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 	return GST_PAD_PROBE_DROP;
 }
 
-static gboolean
-print_stats(gpointer user_data)
-{
-	GstElement *src = user_data;
-	GstStructure *s;
-	char *str;
-
-	g_object_get(src, "stats", &s, NULL);
-	str = gst_structure_to_string(s);
-	// g_debug ("%s", str);
-	g_free(str);
-	gst_structure_free(s);
-
-	return G_SOURCE_CONTINUE;
-}
-
 
 /*
  *
@@ -492,6 +2262,7 @@ static void
 break_apart(struct xrt_frame_node *node)
 {
 	struct gstreamer_pipeline *gp = container_of(node, struct gstreamer_pipeline, node);
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
 
 	/*
 	 * This function is called when we are shutting down, after returning
@@ -501,19 +2272,52 @@ break_apart(struct xrt_frame_node *node)
 	 * objects it will call destroy on them.
 	 */
 
-	(void)gp;
+	g_clear_handle_id(&egp->client_timeout_id, g_source_remove);
+
+	os_mutex_lock(&egp->keyframes.mutex);
+	for (uint32_t i = 0; i < egp->layer_count; i++) {
+		g_clear_handle_id(&egp->keyframes.layers[i].timeout_id, g_source_remove);
+	}
+	os_mutex_unlock(&egp->keyframes.mutex);
+
+	for (uint32_t i = 0; i < egp->layer_count; i++) {
+		g_clear_handle_id(&egp->errors.layers[i].timeout_id, g_source_remove);
+	}
+
+	// Buffers wrap memory owned by the compositor, make sure all are released.
+	gst_element_set_state(gp->pipeline, GST_STATE_NULL);
+
+	// Only once the webrtcbins are stopped, that interrupts the stats requests still in flight.
+	os_mutex_lock(&egp->client_stats.mutex);
+	g_clear_handle_id(&egp->client_stats.idle_id, g_source_remove);
+	os_mutex_unlock(&egp->client_stats.mutex);
 }
 
 static void
 destroy(struct xrt_frame_node *node)
 {
 	struct gstreamer_pipeline *gp = container_of(node, struct gstreamer_pipeline, node);
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
 
 	/*
 	 * All of the nodes has been broken apart and none of our functions will
 	 * be called, it's now safe to destroy and free ourselves.
 	 */
 
+	u_var_remove_root(egp);
+
+	if (egp->stats_file != NULL) {
+		fclose(egp->stats_file);
+	}
+
+	os_mutex_destroy(&egp->keyframes.mutex);
+	os_mutex_destroy(&egp->client_stats.mutex);
+	os_mutex_destroy(&egp->frame_reports.mutex);
+
+	// The clients themselves went with their webrtcbins.
+	g_list_free(egp->clients);
+	g_free(egp->rtp_caps);
+
 	free(gp);
 }
 
@@ -548,6 +2352,9 @@ ems_gstreamer_pipeline_play(struct gstreamer_pipeline *gp)
 
 	g_signal_connect(signaling_server, "ws-client-connected", G_CALLBACK(webrtc_client_connected_cb), egp);
 
+	// Always, adaptive bitrate can be turned on from the debug UI.
+	egp->client_timeout_id = g_timeout_add_seconds(CLIENT_CHECK_INTERVAL_S, check_clients, egp);
+
 	pthread_t thread;
 	pthread_create(&thread, NULL, loop_thread, NULL);
 }
@@ -579,8 +2386,10 @@ ems_gstreamer_pipeline_stop(struct gstreamer_pipeline *gp)
 
 void
 ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
-                              const char *appsrc_name,
                               struct ems_callbacks *callbacks_collection,
+                              const struct ems_gstreamer_layer_info *layers,
+                              uint32_t layer_count,
+                              uint32_t fps,
                               struct gstreamer_pipeline **out_gp)
 {
 	gchar *pipeline_str;
@@ -591,33 +2400,103 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 
 	signaling_server = ems_signaling_server_new();
 
-	pipeline_str = g_strdup_printf(
-	    "appsrc name=%s ! "                //
-	    "queue ! "                         //
-	    "videoconvert ! "                  //
-	    "video/x-raw,format=NV12 ! "       //
-	    "queue !"                          //
-	    "x264enc tune=zerolatency ! "      //
-	    "video/x-h264,profile=baseline ! " //
-	    "queue !"                          //
-	    "h264parse ! "                     //
-	    "rtph264pay config-interval=1 ! "  //
-	    "application/x-rtp,payload=96 ! "  //
-	    "tee name=%s allow-not-linked=true",
-	    appsrc_name, WEBRTC_TEE_NAME);
+	layer_count = CLAMP(layer_count, 1, EMS_GSTREAMER_MAX_LAYERS);
 
-	// no webrtc bin yet until later!
+	// Needed to look up which encoders are installed.
+	gst_init(NULL, NULL);
 
-	printf("%s\n\n\n\n", pipeline_str);
+	const struct ems_gstreamer_encoder *encoder = ems_gstreamer_encoder_select();
 
+	/*
+	 * The compositor already hands us NV12, see ems_gstreamer_src. It also
+	 * puts the frame data SEI into the encoder output, which needs to be
+	 * whole byte-stream access units. One branch per layer, with the encode
+	 * segment from the backend, ending in a tee that the payloader of each
+	 * client is linked to.
+	 */
 	struct ems_gstreamer_pipeline *egp = U_TYPED_CALLOC(struct ems_gstreamer_pipeline);
 	egp->base.node.break_apart = break_apart;
 	egp->base.node.destroy = destroy;
 	egp->base.xfctx = xfctx;
 	egp->callbacks = callbacks_collection;
+	egp->layer_count = layer_count;
+	egp->fps = fps;
+	egp->encoder = encoder;
+
+	egp->abr.enabled = debug_get_bool_option_abr();
+	egp->abr.min_kbps = (uint32_t)MAX(debug_get_num_option_min_bitrate(), 100);
+	egp->abr.max_kbps = (uint32_t)MAX(debug_get_num_option_max_bitrate(), egp->abr.min_kbps);
+
+	egp->keyframes.min_interval_ns = (uint64_t)debug_get_num_option_keyframe_min_interval_ms() * U_TIME_1MS_IN_NS;
+	for (uint32_t i = 0; i < layer_count; i++) {
+		egp->keyframes.layers[i].egp = egp;
+		egp->keyframes.layers[i].layer = i;
+		egp->errors.layers[i].egp = egp;
+		egp->errors.layers[i].layer = i;
+		egp->errors.layers[i].streaming = 1;
+	}
+	int mutex_ret = os_mutex_init(&egp->keyframes.mutex);
+	g_assert(mutex_ret == 0);
+	mutex_ret = os_mutex_init(&egp->client_stats.mutex);
+	g_assert(mutex_ret == 0);
+	mutex_ret = os_mutex_init(&egp->frame_reports.mutex);
+	g_assert(mutex_ret == 0);
+
+	egp->recovery.nack = debug_get_bool_option_nack();
+	egp->recovery.fec = debug_get_bool_option_fec();
+	egp->recovery.fec_max_percentage = (uint32_t)CLAMP(debug_get_num_option_fec_max_percent(), 0, 100);
+	egp->recovery.fec_min_percentage =
+	    (uint32_t)CLAMP(debug_get_num_option_fec_min_percent(), 0, egp->recovery.fec_max_percentage);
+
+	egp->client_encoders.enabled = debug_get_bool_option_client_encoders();
+	// The compositor sized the readback pool of the first layer for this many.
+	egp->client_encoders.max = ems_gstreamer_pipeline_max_client_encoders();
+
+	egp->created_ns = os_monotonic_get_ns();
+	open_stats_file(egp);
+
+	GString *desc = g_string_new(NULL);
+	uint64_t first_pixels = (uint64_t)layers[0].width * layers[0].height;
+
+	for (uint32_t i = 0; i < layer_count; i++) {
+		uint64_t pixels = (uint64_t)layers[i].width * layers[i].height;
+		egp->layer_ratio[i] = (double)pixels / (double)first_pixels;
+		egp->layers[i] = layers[i];
+
+		uint32_t bitrate = (uint32_t)MAX(debug_get_num_option_bitrate() * egp->layer_ratio[i], 100);
+		egp->abr.target_kbps[i] = bitrate;
+
+		g_string_append_printf(desc, "appsrc name=" EMS_GSTREAMER_APPSRC_NAME_FMT " ! ", i);
+
+		// Clients with their own encoder scale the largest frames down themselves.
+		if (i == 0 && egp->client_encoders.enabled) {
+			g_string_append(desc, "tee name=" RAW_TEE_NAME " allow-not-linked=true ! ");
+		}
 
+		g_string_append_printf(                                        //
+		    desc,                                                      //
+		    "queue name=" EMS_GSTREAMER_ENCODER_QUEUE_NAME_FMT         //
+		    " max-size-buffers=1 max-size-bytes=0 max-size-time=0 ! ", //
+		    i);
+
+		gchar *encoder_name = g_strdup_printf(EMS_GSTREAMER_ENCODER_NAME_FMT, i);
+		// Every layer at the level offered for the first, the largest.
+		ems_gstreamer_encoder_append_description(encoder, desc, encoder_name, bitrate, layers[0].width,
+		                                         layers[0].height, fps);
+		g_free(encoder_name);
+
+		g_string_append_printf(desc, "! tee name=" WEBRTC_TEE_NAME_FMT " allow-not-linked=true ", i);
+	}
+
+	pipeline_str = g_string_free(desc, FALSE);
+
+	// no webrtc bin yet until later!
+
+	printf("%s\n\n\n\n", pipeline_str);
+
+	// Clients can be moved to the largest layer at any time.
+	egp->rtp_caps = ems_gstreamer_encoder_get_rtp_caps(encoder, layers[0].width, layers[0].height, fps);
 
-	gst_init(NULL, NULL);
 
 	pipeline = gst_parse_launch(pipeline_str, &error);
 	g_assert_no_error(error);
@@ -627,6 +2506,25 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 	gst_bus_add_watch(bus, gst_bus_cb, egp);
 	gst_object_unref(bus);
 
+	for (uint32_t i = 0; i < layer_count; i++) {
+		gchar *encoder_name = g_strdup_printf(EMS_GSTREAMER_ENCODER_NAME_FMT, i);
+		GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), encoder_name);
+		g_free(encoder_name);
+
+		GstPad *pad = gst_element_get_static_pad(encoder, "src");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, layer_keyframe_probe_cb, &egp->keyframes.layers[i],
+		                  NULL);
+		gst_object_unref(pad);
+		gst_object_unref(encoder);
+	}
+
+	// All layers share the PTS, so following the first is enough.
+	if (ems_frame_trace_enabled()) {
+		gchar *encoder_name = g_strdup_printf(EMS_GSTREAMER_ENCODER_NAME_FMT, 0);
+		add_frame_trace_probe(pipeline, encoder_name, EMS_FRAME_TRACE_STAGE_ENCODED);
+		g_free(encoder_name);
+	}
+
 	g_signal_connect(signaling_server, "ws-client-disconnected", G_CALLBACK(webrtc_client_disconnected_cb), egp);
 	g_signal_connect(signaling_server, "sdp-answer", G_CALLBACK(webrtc_sdp_answer_cb), egp);
 	g_signal_connect(signaling_server, "candidate", G_CALLBACK(webrtc_candidate_cb), egp);
@@ -645,6 +2543,25 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 	// GstElement *scale = gst_element_factory_make("videoscale", "scale");
 	// GstElement *videosink = gst_element_factory_make("autovideosink", "videosink");
 
+	u_var_add_root(egp, "Electric Maple streaming", false);
+	u_var_add_bool(egp, &egp->abr.enabled, "Adaptive bitrate");
+	u_var_add_ro_u32(egp, &egp->abr.estimate_kbps, "Lowest client estimate (kbit/s)");
+	u_var_add_ro_u32(egp, &egp->recovery.fec_percentage, "Highest FEC percentage");
+	u_var_add_ro_u32(egp, &egp->recovery.nack_count, "NACKs received");
+	u_var_add_ro_u32(egp, &egp->keyframes.requested, "Key frames requested");
+	u_var_add_ro_u32(egp, &egp->keyframes.forced, "Key frames forced");
+	u_var_add_ro_u32(egp, &egp->client_encoders.active, "Client encoders");
+	u_var_add_ro_u32(egp, &egp->client_encoders.busy_percent, "Highest client encoder busy (%)");
+	u_var_add_ro_u32(egp, &egp->errors.count, "Pipeline errors");
+	u_var_add_ro_u32(egp, &egp->errors.restarts, "Layer restarts");
+	u_var_add_ro_u32(egp, &egp->errors.clients_dropped, "Clients dropped on error");
+	u_var_add_ro_f32(egp, &egp->errors.last_recovery_ms, "Last recovery (ms)");
+	u_var_add_ro_f32(egp, &egp->errors.max_recovery_ms, "Longest recovery (ms)");
+	for (uint32_t i = 0; i < layer_count; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "Layer %u target bitrate (kbit/s)", i);
+		u_var_add_ro_u32(egp, &egp->abr.target_kbps[i], name);
+	}
 
 	/*
 	 * Add ourselves to the context so we are destroyed.
@@ -654,3 +2571,27 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 
 	*out_gp = &egp->base;
 }
+
+bool
+ems_gstreamer_pipeline_keyframe_pending(struct gstreamer_pipeline *gp)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+
+	return g_atomic_int_get(&egp->keyframes.pending) > 0;
+}
+
+uint32_t
+ems_gstreamer_pipeline_max_client_encoders(void)
+{
+	if (!debug_get_bool_option_client_encoders()) {
+		return 0;
+	}
+
+	return (uint32_t)CLAMP(debug_get_num_option_max_client_encoders(), 0, EMS_GSTREAMER_MAX_CLIENT_ENCODERS);
+}
+
+const struct ems_gstreamer_encoder *
+ems_gstreamer_pipeline_get_encoder(struct gstreamer_pipeline *gp)
+{
+	return ((struct ems_gstreamer_pipeline *)gp)->encoder;
+}
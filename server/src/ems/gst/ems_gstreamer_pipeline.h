@@ -20,6 +20,49 @@ extern "C" {
 struct gstreamer_pipeline;
 
 struct ems_callbacks;
+struct ems_gstreamer_encoder;
+
+//! Most simulcast layers, encoded resolutions of the same frames.
+#define EMS_GSTREAMER_MAX_LAYERS (3)
+
+/*!
+ * Name of the appsrc of each layer, formatted with the layer index.
+ */
+#define EMS_GSTREAMER_APPSRC_NAME_FMT "appsrc_%u"
+
+/*!
+ * Name of the H.264 encoder element of each layer, formatted with the layer
+ * index. It produces Annex B byte-stream access units.
+ */
+#define EMS_GSTREAMER_ENCODER_NAME_FMT "encoder_%u"
+
+/*!
+ * Name of the queue in front of each encoder, formatted with the layer
+ * index. It only holds a single frame and blocks, so a slow encoder backs up
+ * into the appsrc, where the compositor can see it, instead of building up
+ * latency.
+ */
+#define EMS_GSTREAMER_ENCODER_QUEUE_NAME_FMT "encoder_queue_%u"
+
+//! Most raw frames held by the encoder queue and the encoder of a layer.
+#define EMS_GSTREAMER_ENCODER_FRAMES (2)
+
+/*!
+ * Most clients with an encoder of their own, EMS_MAX_CLIENT_ENCODERS is
+ * clamped to it as their frames come from the readback pool.
+ */
+#define EMS_GSTREAMER_MAX_CLIENT_ENCODERS (4)
+
+//! Most raw frames held by a client encoder branch, in its queue, scaler and encoder.
+#define EMS_GSTREAMER_CLIENT_BRANCH_FRAMES (3)
+
+/*!
+ * Size of the frames pushed into one layer, layer 0 is the largest.
+ */
+struct ems_gstreamer_layer_info
+{
+	uint32_t width, height;
+};
 
 void
 ems_gstreamer_pipeline_play(struct gstreamer_pipeline *gp);
@@ -27,12 +70,47 @@ ems_gstreamer_pipeline_play(struct gstreamer_pipeline *gp);
 void
 ems_gstreamer_pipeline_stop(struct gstreamer_pipeline *gp);
 
+/*!
+ * Create the encode and streaming pipeline with one encoder per layer. Each
+ * client is fed from one of the layers, starting with the first, and moved
+ * between them with the packet loss it reports. The encoder backend is
+ * picked with EMS_ENCODER, see ems_gstreamer_encoder_select. The first layer
+ * and @p fps pick the level we offer to clients.
+ *
+ * With EMS_CLIENT_ENCODERS up to EMS_MAX_CLIENT_ENCODERS clients instead get
+ * an encoder of their own, fed with the frames of the first layer scaled to
+ * the size of the layer they would be on, at the bitrate only they can take.
+ */
 void
 ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
-                              const char *appsrc_name,
                               struct ems_callbacks *callbacks_collection,
+                              const struct ems_gstreamer_layer_info *layers,
+                              uint32_t layer_count,
+                              uint32_t fps,
                               struct gstreamer_pipeline **out_gp);
 
+/*!
+ * Has an encoder been asked for a key frame it has not put out yet, for a
+ * joining client or a PLI. It needs a frame pushed to make one. Safe to call
+ * from any thread.
+ */
+bool
+ems_gstreamer_pipeline_keyframe_pending(struct gstreamer_pipeline *gp);
+
+/*!
+ * How many clients may get an encoder of their own, zero without
+ * EMS_CLIENT_ENCODERS. Known before the pipeline is created, so the readback
+ * pool of the first layer can hold their frames too.
+ */
+uint32_t
+ems_gstreamer_pipeline_max_client_encoders(void);
+
+/*!
+ * The encoder backend the pipeline was created with.
+ */
+const struct ems_gstreamer_encoder *
+ems_gstreamer_pipeline_get_encoder(struct gstreamer_pipeline *gp);
+
 #ifdef __cplusplus
 }
 #endif
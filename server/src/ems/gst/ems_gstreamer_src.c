@@ -0,0 +1,553 @@
+// Copyright 2019-2023, Collabora, Ltd.
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Frame sink feeding NV12 frames into the appsrc of our pipeline.
+ * @author Jakob Bornecrantz <jakob@collabora.com>
+ * @ingroup aux_util
+ */
+
+#include "ems_gstreamer_src.h"
+#include "ems_gstreamer_pipeline.h"
+#include "ems_gstreamer_encoder.h"
+#include "ems_frame_trace.h"
+#include "em_frame_sei.h"
+
+#include "os/os_time.h"
+
+#include "util/u_misc.h"
+#include "util/u_logging.h"
+#include "util/u_trace_marker.h"
+
+// Monado includes
+#include "gstreamer/gst_internal.h"
+#include "gstreamer/gst_pipeline.h"
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/gstvideometa.h>
+
+#include <math.h>
+#include <string.h>
+#include <inttypes.h>
+
+
+/*
+ *
+ * Sink functions.
+ *
+ */
+
+/*!
+ * The ROI param structure names the GStreamer encoders look for, all of them
+ * take a delta-qp field.
+ */
+static const char *roi_param_names[] = {
+    "roi/va",
+    "roi/vaapi",
+    "roi/msdk",
+};
+
+static void
+add_regions(struct ems_gstreamer_src *gs, GstBuffer *buffer)
+{
+	for (uint32_t i = 0; i < gs->region_count; i++) {
+		const struct ems_gstreamer_src_region *r = &gs->regions[i];
+
+		GstVideoRegionOfInterestMeta *meta =
+		    gst_buffer_add_video_region_of_interest_meta(buffer, "foveation", r->x, r->y, r->w, r->h);
+
+		for (size_t k = 0; k < ARRAY_SIZE(roi_param_names); k++) {
+			GstStructure *s =
+			    gst_structure_new(roi_param_names[k], "delta-qp", G_TYPE_INT, r->delta_qp, NULL);
+			// Takes ownership.
+			gst_video_region_of_interest_meta_add_param(meta, s);
+		}
+	}
+}
+
+static void
+queue_frame_data(struct ems_gstreamer_src *gs, uint64_t pts)
+{
+	os_mutex_lock(&gs->frame_data_mutex);
+
+	// Drop the oldest, the encoder must have dropped that frame.
+	if (gs->frame_data_count == EMS_GSTREAMER_SRC_FRAME_DATA_QUEUE) {
+		gs->frame_data_head = (gs->frame_data_head + 1) % EMS_GSTREAMER_SRC_FRAME_DATA_QUEUE;
+		gs->frame_data_count--;
+	}
+
+	// Queued even without frame data, to time the encoder.
+	uint32_t index = (gs->frame_data_head + gs->frame_data_count) % EMS_GSTREAMER_SRC_FRAME_DATA_QUEUE;
+	gs->pending[index].pts = pts;
+	gs->pending[index].push_ns = os_monotonic_get_ns();
+	gs->pending[index].have_msg = gs->have_frame_data;
+	if (gs->have_frame_data) {
+		gs->pending[index].msg = gs->frame_data;
+	}
+	gs->frame_data_count++;
+
+	// Kept for other encoders fed from the same appsrc, they don't consume it.
+	struct ems_gstreamer_src_recent *recent = &gs->recent[gs->recent_next];
+	recent->pts = pts;
+	recent->have_msg = gs->have_frame_data;
+	if (gs->have_frame_data) {
+		recent->msg = gs->frame_data;
+	}
+	gs->recent_next = (gs->recent_next + 1) % EMS_GSTREAMER_SRC_FRAME_DATA_QUEUE;
+
+	os_mutex_unlock(&gs->frame_data_mutex);
+
+	gs->have_frame_data = false;
+}
+
+/*!
+ * Takes the pending frame matching @p pts off the queue and records its
+ * encode time, returns true if it had frame data.
+ */
+static bool
+pop_frame_data(struct ems_gstreamer_src *gs, uint64_t pts, em_proto_DownFrameDataMessage *out_msg)
+{
+	bool found = false;
+
+	os_mutex_lock(&gs->frame_data_mutex);
+
+	// Frames come out in order, anything older than this one was dropped.
+	while (gs->frame_data_count > 0) {
+		uint32_t index = gs->frame_data_head;
+		if (gs->pending[index].pts > pts) {
+			break;
+		}
+
+		gs->frame_data_head = (gs->frame_data_head + 1) % EMS_GSTREAMER_SRC_FRAME_DATA_QUEUE;
+		gs->frame_data_count--;
+
+		if (gs->pending[index].pts == pts) {
+			gs->encode_ns = os_monotonic_get_ns() - gs->pending[index].push_ns;
+			if (gs->pending[index].have_msg) {
+				*out_msg = gs->pending[index].msg;
+				found = true;
+			}
+			break;
+		}
+	}
+
+	os_mutex_unlock(&gs->frame_data_mutex);
+
+	return found;
+}
+
+/*!
+ * Follow the spread of the encoded frame sizes, big frames go out as packet
+ * bursts which is what hurts over Wi-Fi. Called from the encoder output.
+ */
+static void
+update_frame_size_stats(struct ems_gstreamer_src *gs, size_t size)
+{
+	float x = (float)size;
+
+	gs->frames_encoded++;
+
+	if (gs->frames_encoded == 1) {
+		gs->frame_size_mean = x;
+		gs->frame_size_variance = 0.f;
+		gs->frame_size_stddev = 0.f;
+		return;
+	}
+
+	// Give the mean some frames to settle before counting spikes.
+	if (gs->frames_encoded > EMS_GSTREAMER_SRC_FRAME_SIZE_WARMUP && x > 2.f * gs->frame_size_mean) {
+		gs->frame_size_spikes++;
+	}
+
+	float alpha = EMS_GSTREAMER_SRC_FRAME_SIZE_ALPHA;
+	float diff = x - gs->frame_size_mean;
+
+	gs->frame_size_mean += alpha * diff;
+	gs->frame_size_variance = (1.f - alpha) * (gs->frame_size_variance + alpha * diff * diff);
+	gs->frame_size_stddev = sqrtf(gs->frame_size_variance);
+}
+
+//! Like @ref pop_frame_data but leaves it for others and doesn't time the encoder.
+static bool
+find_recent_frame_data(struct ems_gstreamer_src *gs, uint64_t pts, em_proto_DownFrameDataMessage *out_msg)
+{
+	bool found = false;
+
+	os_mutex_lock(&gs->frame_data_mutex);
+
+	for (uint32_t i = 0; i < EMS_GSTREAMER_SRC_FRAME_DATA_QUEUE; i++) {
+		if (gs->recent[i].have_msg && gs->recent[i].pts == pts) {
+			*out_msg = gs->recent[i].msg;
+			found = true;
+			break;
+		}
+	}
+
+	os_mutex_unlock(&gs->frame_data_mutex);
+
+	return found;
+}
+
+//! Replace the buffer in @p info with one that has the frame data SEI spliced in.
+static void
+insert_sei(GstPadProbeInfo *info, GstBuffer *buffer, const em_proto_DownFrameDataMessage *msg)
+{
+	uint8_t sei[EM_FRAME_SEI_MAX_SIZE];
+	size_t sei_size = em_frame_sei_build(msg, sei, sizeof(sei));
+	if (sei_size == 0) {
+		U_LOG_W("Failed to build frame data SEI for frame %" PRId64, msg->frame_sequence_id);
+		return;
+	}
+
+	GstMapInfo map;
+	if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+		return;
+	}
+	size_t size = map.size;
+	size_t offset = em_frame_sei_find_insert_offset(map.data, map.size);
+	gst_buffer_unmap(buffer, &map);
+
+	GstMemory *sei_memory = gst_allocator_alloc(NULL, sei_size, NULL);
+	gst_memory_map(sei_memory, &map, GST_MAP_WRITE);
+	memcpy(map.data, sei, sei_size);
+	gst_memory_unmap(sei_memory, &map);
+
+	// Splice the SEI in, the encoded data is shared and not copied.
+	GstBuffer *out = gst_buffer_new();
+	gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+	if (offset > 0) {
+		gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_MEMORY, 0, offset);
+	}
+	gst_buffer_append_memory(out, sei_memory);
+	if (offset < size) {
+		gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_MEMORY, offset, size - offset);
+	}
+
+	GST_PAD_PROBE_INFO_DATA(info) = out;
+	gst_buffer_unref(buffer);
+}
+
+static GstPadProbeReturn
+encoder_output_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_src *gs = (struct ems_gstreamer_src *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+	update_frame_size_stats(gs, gst_buffer_get_size(buffer));
+
+	em_proto_DownFrameDataMessage msg = em_proto_DownFrameDataMessage_init_default;
+	if (!GST_BUFFER_PTS_IS_VALID(buffer) || !pop_frame_data(gs, GST_BUFFER_PTS(buffer), &msg)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	// The frame data SEI is an H.264 NAL unit, it would corrupt anything else.
+	if (gs->insert_frame_data) {
+		insert_sei(info, buffer, &msg);
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+branch_output_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_src *gs = (struct ems_gstreamer_src *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+	em_proto_DownFrameDataMessage msg = em_proto_DownFrameDataMessage_init_default;
+	if (GST_BUFFER_PTS_IS_VALID(buffer) && find_recent_frame_data(gs, GST_BUFFER_PTS(buffer), &msg)) {
+		insert_sei(info, buffer, &msg);
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+enough_data_cb(GstAppSrc *appsrc, gpointer user_data)
+{
+	struct ems_gstreamer_src *gs = (struct ems_gstreamer_src *)user_data;
+
+	g_atomic_int_set(&gs->enough_data, 1);
+}
+
+static void
+need_data_cb(GstAppSrc *appsrc, guint length, gpointer user_data)
+{
+	struct ems_gstreamer_src *gs = (struct ems_gstreamer_src *)user_data;
+
+	g_atomic_int_set(&gs->enough_data, 0);
+}
+
+static void
+update_levels(struct ems_gstreamer_src *gs, size_t frame_size)
+{
+	guint64 appsrc_bytes = 0;
+	g_object_get(G_OBJECT(gs->appsrc), "current-level-bytes", &appsrc_bytes, NULL);
+	gs->appsrc_level = (uint32_t)(appsrc_bytes / frame_size);
+
+	if (gs->encoder_queue != NULL) {
+		guint queue_buffers = 0;
+		g_object_get(G_OBJECT(gs->encoder_queue), "current-level-buffers", &queue_buffers, NULL);
+		gs->encoder_queue_level = queue_buffers;
+	}
+}
+
+/*!
+ * Set NV12 caps with BT.709 colorimetry, matching what the conversion shader
+ * writes, and size the appsrc queue for frames of that size.
+ */
+static void
+set_caps(struct ems_gstreamer_src *gs, uint32_t width, uint32_t height)
+{
+	GstCaps *caps = gst_caps_new_simple(       //
+	    "video/x-raw",                         //
+	    "format", G_TYPE_STRING, "NV12",       //
+	    "width", G_TYPE_INT, width,            //
+	    "height", G_TYPE_INT, height,          //
+	    "colorimetry", G_TYPE_STRING, "bt709", //
+	    "framerate", GST_TYPE_FRACTION, 0, 1,  //
+	    NULL);
+
+	// Serialised with the buffers, frames already queued keep the old caps.
+	gst_app_src_set_caps(GST_APP_SRC(gs->appsrc), caps);
+	gst_caps_unref(caps);
+
+	guint64 frame_size = (guint64)width * height * 3 / 2;
+	g_object_set(G_OBJECT(gs->appsrc), "max-bytes", frame_size * EMS_GSTREAMER_SRC_MAX_QUEUED_FRAMES, NULL);
+
+	if (gs->width != 0) {
+		U_LOG_I("Stream size %ux%u -> %ux%u", gs->width, gs->height, width, height);
+	}
+
+	gs->width = width;
+	gs->height = height;
+}
+
+static void
+release_frame(gpointer user_data)
+{
+	struct xrt_frame *xf = (struct xrt_frame *)user_data;
+
+	// Hands the memory back to the readback pool once GStreamer is done with it.
+	xrt_frame_reference(&xf, NULL);
+}
+
+static void
+push_frame(struct xrt_frame_sink *xfs, struct xrt_frame *xf)
+{
+	SINK_TRACE_MARKER();
+
+	struct ems_gstreamer_src *gs = (struct ems_gstreamer_src *)xfs;
+	size_t size = (size_t)xf->width * xf->height * 3 / 2;
+
+	if (xf->width % 2 != 0 || xf->height % 2 != 0 || xf->size < size) {
+		U_LOG_E("Frame %ux%u (%zu bytes) is not a valid NV12 frame", xf->width, xf->height, xf->size);
+		return;
+	}
+
+	if (xf->width != gs->width || xf->height != gs->height) {
+		set_caps(gs, xf->width, xf->height);
+	}
+
+	/*
+	 * Wrap the mapped readback memory directly instead of copying it, the
+	 * memory keeps a reference to the frame that is dropped when the last
+	 * element downstream releases the buffer.
+	 */
+	struct xrt_frame *ref = NULL;
+	xrt_frame_reference(&ref, xf);
+
+	GstMemory *memory = gst_memory_new_wrapped( //
+	    GST_MEMORY_FLAG_READONLY,               // flags
+	    xf->data,                               // data
+	    xf->size,                               // maxsize
+	    0,                                      // offset
+	    size,                                   // size
+	    ref,                                    // user_data
+	    release_frame);                         // notify
+
+	GstBuffer *buffer = gst_buffer_new();
+	gst_buffer_append_memory(buffer, memory);
+
+	GST_BUFFER_PTS(buffer) = xf->timestamp - gs->offset_ns;
+	GST_BUFFER_DTS(buffer) = GST_BUFFER_PTS(buffer);
+
+	add_regions(gs, buffer);
+	queue_frame_data(gs, GST_BUFFER_PTS(buffer));
+
+	// The compositor puts the frame id in the sequence, from here on the PTS identifies the frame.
+	ems_frame_trace_mark_push((int64_t)xf->source_sequence, GST_BUFFER_PTS(buffer), os_monotonic_get_ns());
+
+	// Takes ownership of the buffer.
+	GstFlowReturn ret = gst_app_src_push_buffer(GST_APP_SRC(gs->appsrc), buffer);
+	if (ret != GST_FLOW_OK) {
+		U_LOG_E("Got GST error '%i'", ret);
+	}
+
+	update_levels(gs, size);
+}
+
+
+/*
+ *
+ * Node functions.
+ *
+ */
+
+static void
+break_apart(struct xrt_frame_node *node)
+{
+	struct ems_gstreamer_src *gs = container_of(node, struct ems_gstreamer_src, node);
+
+	gst_app_src_end_of_stream(GST_APP_SRC(gs->appsrc));
+}
+
+static void
+destroy(struct xrt_frame_node *node)
+{
+	struct ems_gstreamer_src *gs = container_of(node, struct ems_gstreamer_src, node);
+
+	gst_object_unref(gs->appsrc);
+	gs->appsrc = NULL;
+
+	if (gs->encoder_queue != NULL) {
+		gst_object_unref(gs->encoder_queue);
+		gs->encoder_queue = NULL;
+	}
+
+	os_mutex_destroy(&gs->frame_data_mutex);
+
+	free(gs);
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+void
+ems_gstreamer_src_create_with_pipeline(struct gstreamer_pipeline *gp,
+                                       uint32_t width,
+                                       uint32_t height,
+                                       uint32_t layer,
+                                       struct ems_gstreamer_src **out_gs,
+                                       struct xrt_frame_sink **out_xfs)
+{
+	struct xrt_frame_context *xfctx = gp->xfctx;
+
+	gchar *appsrc_name = g_strdup_printf(EMS_GSTREAMER_APPSRC_NAME_FMT, layer);
+	gchar *encoder_queue_name = g_strdup_printf(EMS_GSTREAMER_ENCODER_QUEUE_NAME_FMT, layer);
+	gchar *encoder_name = g_strdup_printf(EMS_GSTREAMER_ENCODER_NAME_FMT, layer);
+
+	GstElement *appsrc = gst_bin_get_by_name(GST_BIN(gp->pipeline), appsrc_name);
+	g_assert(appsrc != NULL);
+
+	g_object_set(G_OBJECT(appsrc),          //
+	             "format", GST_FORMAT_TIME, //
+	             "is-live", TRUE,           //
+	             NULL);
+
+	/*
+	 * Keep the handoff to the encoder short, frames waiting here only add
+	 * latency. Past max-bytes, set with the caps, it reports enough-data,
+	 * which the compositor uses to skip frames, and as a last resort drops
+	 * the oldest frame.
+	 */
+	g_object_set(G_OBJECT(appsrc), "block", FALSE, NULL);
+#if GST_CHECK_VERSION(1, 20, 0)
+	g_object_set(G_OBJECT(appsrc), "leaky-type", GST_APP_LEAKY_TYPE_DOWNSTREAM, NULL);
+#endif
+
+	struct ems_gstreamer_src *gs = U_TYPED_CALLOC(struct ems_gstreamer_src);
+	gs->base.push_frame = push_frame;
+	gs->node.break_apart = break_apart;
+	gs->node.destroy = destroy;
+	gs->gp = gp;
+	gs->appsrc = appsrc;
+	set_caps(gs, width, height);
+	gs->encoder_queue = gst_bin_get_by_name(GST_BIN(gp->pipeline), encoder_queue_name);
+
+	// For the pipeline to find us from other branches fed by the appsrc.
+	g_object_set_data(G_OBJECT(appsrc), EMS_GSTREAMER_SRC_DATA_KEY, gs);
+
+	int ret = os_mutex_init(&gs->frame_data_mutex);
+	g_assert(ret == 0);
+
+	g_signal_connect(appsrc, "enough-data", G_CALLBACK(enough_data_cb), gs);
+	g_signal_connect(appsrc, "need-data", G_CALLBACK(need_data_cb), gs);
+
+	gs->insert_frame_data = ems_gstreamer_pipeline_get_encoder(gp)->codec == EMS_GSTREAMER_CODEC_H264;
+	if (!gs->insert_frame_data) {
+		U_LOG_W("Not encoding H.264, frames will not carry frame data");
+	}
+
+	GstElement *encoder = gst_bin_get_by_name(GST_BIN(gp->pipeline), encoder_name);
+	if (encoder != NULL) {
+		GstPad *pad = gst_element_get_static_pad(encoder, "src");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, encoder_output_probe_cb, gs, NULL);
+		gst_object_unref(pad);
+		gst_object_unref(encoder);
+	} else {
+		U_LOG_W("No element called '%s', frames will not carry frame data", encoder_name);
+	}
+
+	g_free(appsrc_name);
+	g_free(encoder_queue_name);
+	g_free(encoder_name);
+
+	xrt_frame_context_add(xfctx, &gs->node);
+
+	*out_gs = gs;
+	*out_xfs = &gs->base;
+}
+
+void
+ems_gstreamer_src_set_regions(struct ems_gstreamer_src *gs,
+                              const struct ems_gstreamer_src_region *regions,
+                              uint32_t count)
+{
+	count = MIN(count, EMS_GSTREAMER_SRC_MAX_REGIONS);
+
+	for (uint32_t i = 0; i < count; i++) {
+		gs->regions[i] = regions[i];
+	}
+
+	gs->region_count = count;
+}
+
+void
+ems_gstreamer_src_set_frame_data(struct ems_gstreamer_src *gs, const em_proto_DownFrameDataMessage *msg)
+{
+	gs->frame_data = *msg;
+	gs->have_frame_data = true;
+}
+
+void
+ems_gstreamer_src_add_branch_probe(struct ems_gstreamer_src *gs, struct _GstPad *pad)
+{
+	if (!gs->insert_frame_data) {
+		return;
+	}
+
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, branch_output_probe_cb, gs, NULL);
+}
+
+bool
+ems_gstreamer_src_is_backed_up(struct ems_gstreamer_src *gs)
+{
+	return g_atomic_int_get(&gs->enough_data) != 0;
+}
+
+uint64_t
+ems_gstreamer_src_get_encode_time_ns(struct ems_gstreamer_src *gs)
+{
+	os_mutex_lock(&gs->frame_data_mutex);
+	uint64_t encode_ns = gs->encode_ns;
+	os_mutex_unlock(&gs->frame_data_mutex);
+
+	return encode_ns;
+}
@@ -0,0 +1,214 @@
+// Copyright 2019-2023, Collabora, Ltd.
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Frame sink feeding NV12 frames into the appsrc of our pipeline.
+ *
+ * Based on the Monado gstreamer sink, which only knows about packed formats.
+ *
+ * @ingroup aux_util
+ */
+
+#pragma once
+
+#include "xrt/xrt_frame.h"
+
+#include "os/os_threading.h"
+
+#include "electricmaple.pb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gstreamer_pipeline;
+
+//! Max number of regions of interest that can be attached to a frame.
+#define EMS_GSTREAMER_SRC_MAX_REGIONS (2)
+
+//! Frames that can be between the appsrc and the encoder output, for matching frame data.
+#define EMS_GSTREAMER_SRC_FRAME_DATA_QUEUE (8)
+
+//! Frames the appsrc queues before it reports enough-data, and drops the oldest past that.
+#define EMS_GSTREAMER_SRC_MAX_QUEUED_FRAMES (2)
+
+//! Key the sink is set under on its appsrc with g_object_set_data.
+#define EMS_GSTREAMER_SRC_DATA_KEY "ems_gstreamer_src"
+
+//! Weight of a new encoded frame in the frame size mean and variance.
+#define EMS_GSTREAMER_SRC_FRAME_SIZE_ALPHA (0.05f)
+
+//! Encoded frames before frames over twice the mean size are counted.
+#define EMS_GSTREAMER_SRC_FRAME_SIZE_WARMUP (60)
+
+/*!
+ * A region of interest in pixels, encoders that support it (va, vaapi and
+ * msdk) apply @ref delta_qp to the macroblocks inside of it.
+ */
+struct ems_gstreamer_src_region
+{
+	uint32_t x, y, w, h;
+
+	//! Negative for better quality than the rest of the frame.
+	int32_t delta_qp;
+};
+
+//! Frame data of a recently pushed frame.
+struct ems_gstreamer_src_recent
+{
+	uint64_t pts;
+	bool have_msg;
+	em_proto_DownFrameDataMessage msg;
+};
+
+/*!
+ * An @ref xrt_frame_sink that pushes tightly packed NV12 frames into a named
+ * appsrc, frames are expected to be laid out like @ref ems_nv12_frame.
+ *
+ * No copy is made, each GstBuffer wraps the frame memory and holds a
+ * reference to the frame until the encoder is done with it. The frame data
+ * must therefore stay valid and unchanged while referenced.
+ *
+ * Frame data set with @ref ems_gstreamer_src_set_frame_data is matched to
+ * the encoded frame by PTS and inserted in front of its slices as a SEI,
+ * see em_frame_sei.h. Only done when the pipeline encodes H.264.
+ *
+ * The appsrc only queues @ref EMS_GSTREAMER_SRC_MAX_QUEUED_FRAMES, use
+ * @ref ems_gstreamer_src_is_backed_up to stop producing frames the encoder
+ * has no room for rather than have them dropped here.
+ *
+ * @implements xrt_frame_sink
+ * @implements xrt_frame_node
+ */
+struct ems_gstreamer_src
+{
+	struct xrt_frame_sink base;
+	struct xrt_frame_node node;
+
+	struct gstreamer_pipeline *gp;
+
+	//! The appsrc element, we hold a reference.
+	struct _GstElement *appsrc;
+
+	//! Size in the caps, follows the size of the frames pushed.
+	uint32_t width, height;
+
+	//! Subtracted from frame timestamps to make the PTS.
+	uint64_t offset_ns;
+
+	//! Attached to the next pushed frame as GstVideoRegionOfInterestMeta.
+	struct ems_gstreamer_src_region regions[EMS_GSTREAMER_SRC_MAX_REGIONS];
+	uint32_t region_count;
+
+	//! Sent with the next pushed frame.
+	em_proto_DownFrameDataMessage frame_data;
+	bool have_frame_data;
+
+	/*!
+	 * Pushed frames waiting for the encoder output, oldest at
+	 * frame_data_head. Protected by frame_data_mutex as the encoder
+	 * output is on a streaming thread.
+	 */
+	struct
+	{
+		uint64_t pts;
+		uint64_t push_ns;
+		bool have_msg;
+		em_proto_DownFrameDataMessage msg;
+	} pending[EMS_GSTREAMER_SRC_FRAME_DATA_QUEUE];
+	uint32_t frame_data_head;
+	uint32_t frame_data_count;
+	struct os_mutex frame_data_mutex;
+
+	//! The last pushed frames, written over in order, protected by frame_data_mutex.
+	struct ems_gstreamer_src_recent recent[EMS_GSTREAMER_SRC_FRAME_DATA_QUEUE];
+	uint32_t recent_next;
+
+	//! From push to encoder output of the last frame, protected by frame_data_mutex.
+	uint64_t encode_ns;
+
+	//! Only for H.264, set at creation.
+	bool insert_frame_data;
+
+	/*!
+	 * Encoded frame sizes in bytes, exponentially weighted, and the number
+	 * of frames over twice the mean. Updated from the encoder output.
+	 */
+	uint64_t frames_encoded;
+	float frame_size_mean;
+	float frame_size_variance;
+	float frame_size_stddev;
+	uint64_t frame_size_spikes;
+
+	//! The queue in front of the encoder, we hold a reference, may be NULL.
+	struct _GstElement *encoder_queue;
+
+	//! Set on enough-data from the appsrc and cleared on need-data, use g_atomic_int_*.
+	int enough_data;
+
+	//! Frames queued in the appsrc and the encoder queue, updated on each push.
+	uint32_t appsrc_level;
+	uint32_t encoder_queue_level;
+};
+
+/*!
+ * Creates a sink pushing into the appsrc of @p layer in the pipeline and
+ * sets NV12 caps with BT.709 colorimetry on it. Frame data is inserted into
+ * the output of the encoder of that layer, see
+ * @ref EMS_GSTREAMER_ENCODER_NAME_FMT.
+ *
+ * Frames may be pushed at a different size than @p width and @p height,
+ * the caps are changed to match which makes the encoder start over with a
+ * key frame. They should be no larger than the size given here.
+ */
+void
+ems_gstreamer_src_create_with_pipeline(struct gstreamer_pipeline *gp,
+                                       uint32_t width,
+                                       uint32_t height,
+                                       uint32_t layer,
+                                       struct ems_gstreamer_src **out_gs,
+                                       struct xrt_frame_sink **out_xfs);
+
+/*!
+ * Set the regions of interest for the next frame pushed, must be called from
+ * the same thread that pushes frames. A @p count of zero clears them.
+ */
+void
+ems_gstreamer_src_set_regions(struct ems_gstreamer_src *gs,
+                              const struct ems_gstreamer_src_region *regions,
+                              uint32_t count);
+
+/*!
+ * Set the frame data sent along with the next frame pushed, must be called
+ * from the same thread that pushes frames.
+ */
+void
+ems_gstreamer_src_set_frame_data(struct ems_gstreamer_src *gs, const em_proto_DownFrameDataMessage *msg);
+
+/*!
+ * Insert frame data into the output of another encoder fed from the same
+ * appsrc, @p pad is its src pad. Matched by PTS like for our own encoder,
+ * but without taking it away from that.
+ */
+void
+ems_gstreamer_src_add_branch_probe(struct ems_gstreamer_src *gs, struct _GstPad *pad);
+
+/*!
+ * Has the appsrc said it has enough data, a frame pushed now would wait
+ * behind others for the encoder. Safe to call from any thread.
+ */
+bool
+ems_gstreamer_src_is_backed_up(struct ems_gstreamer_src *gs);
+
+/*!
+ * How long the last frame to come out of the encoder took from being pushed,
+ * zero before the first one. Safe to call from any thread.
+ */
+uint64_t
+ems_gstreamer_src_get_encode_time_ns(struct ems_gstreamer_src *gs);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,528 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Headless benchmark of the remote rendering compositor.
+ *
+ * Drives an @ref ems_compositor directly, without a system compositor or an
+ * OpenXR app, by committing synthetic stereo swapchains and then reports the
+ * compositor's per-stage timings. Runs on a software Vulkan driver, so it
+ * works on machines without a GPU, for example with lavapipe:
+ *
+ *     VK_ICD_FILENAMES=/usr/share/vulkan/icd.d/lvp_icd.x86_64.json ems_compositor_bench
+ *
+ * The sizes are those of the compositor, they can also be given with
+ * EMS_VIEW_WIDTH, EMS_VIEW_HEIGHT and EMS_READBACK_SCALE.
+ *
+ * With budgets given it fails when they are exceeded, so it can run as a
+ * test. It exits with 77, the skip code of the test, only when there is no
+ * Vulkan device at all, a compositor that fails to create is a failure.
+ */
+
+#include "xrt/xrt_compositor.h"
+#include "xrt/xrt_instance.h"
+#include "xrt/xrt_system.h"
+
+#include "os/os_time.h"
+
+#include "util/u_misc.h"
+#include "util/u_time.h"
+#include "util/u_logging.h"
+
+#include "util/comp_swapchain.h"
+
+#include "vk/vk_cmd.h"
+#include "vk/vk_cmd_pool.h"
+
+#include "ems_compositor.h"
+#include "ems_server_internal.h"
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+
+static gint frame_count = 600;
+static gint warmup_count = 60;
+static gdouble commit_rate = 0.0;
+static gint view_width = 0;
+static gint view_height = 0;
+static gdouble readback_scale = 0.0;
+static gdouble commit_budget_ms = 0.0;
+static gdouble convert_budget_ms = 0.0;
+static gdouble min_fps = 0.0;
+
+//! Exit code telling CTest the bench could not run here, see SKIP_RETURN_CODE.
+#define EXIT_SKIP (77)
+
+static GOptionEntry options[] = {
+    {"frames", 'n', 0, G_OPTION_ARG_INT, &frame_count, "Frames to time", "N"},
+    {"warmup", 'w', 0, G_OPTION_ARG_INT, &warmup_count, "Frames to commit before timing", "N"},
+    {"rate", 'r', 0, G_OPTION_ARG_DOUBLE, &commit_rate, "Frames per second to commit, 0 is as fast as possible",
+     "FPS"},
+    {"view-width", 0, 0, G_OPTION_ARG_INT, &view_width, "Per-view swapchain width", "PIXELS"},
+    {"view-height", 0, 0, G_OPTION_ARG_INT, &view_height, "Per-view swapchain height", "PIXELS"},
+    {"readback-scale", 0, 0, G_OPTION_ARG_DOUBLE, &readback_scale, "Scale from view to encoded size", "SCALE"},
+    {"commit-budget", 0, 0, G_OPTION_ARG_DOUBLE, &commit_budget_ms,
+     "Fail if layer_commit takes longer on average, 0 is no budget", "MS"},
+    {"convert-budget", 0, 0, G_OPTION_ARG_DOUBLE, &convert_budget_ms,
+     "Fail if the NV12 conversion takes longer on average on the GPU, 0 is no budget", "MS"},
+    {"min-fps", 0, 0, G_OPTION_ARG_DOUBLE, &min_fps, "Fail below this frame rate, 0 is no minimum", "FPS"},
+    {NULL},
+};
+
+static const char *stage_names[EMS_COMP_STAGE_COUNT] = {
+    "bounce blit",
+    "nv12 convert",
+    "readback wait",
+    "sink push",
+};
+
+
+/*
+ *
+ * Helpers.
+ *
+ */
+
+//! Sizes are read by the compositor from the environment, pass ours on that way.
+static void
+set_size_options(void)
+{
+	char buf[32];
+
+	if (view_width > 0) {
+		snprintf(buf, sizeof(buf), "%d", view_width);
+		setenv("EMS_VIEW_WIDTH", buf, 1);
+	}
+	if (view_height > 0) {
+		snprintf(buf, sizeof(buf), "%d", view_height);
+		setenv("EMS_VIEW_HEIGHT", buf, 1);
+	}
+	if (readback_scale > 0.0) {
+		snprintf(buf, sizeof(buf), "%f", readback_scale);
+		setenv("EMS_READBACK_SCALE", buf, 1);
+	}
+}
+
+/*!
+ * Is there a Vulkan driver with a device to run on at all, probed without the
+ * compositor so a compositor that fails to create is reported as a failure.
+ */
+static bool
+have_vulkan_device(void)
+{
+	PFN_vkCreateInstance create_instance =
+	    (PFN_vkCreateInstance)vkGetInstanceProcAddr(VK_NULL_HANDLE, "vkCreateInstance");
+	if (create_instance == NULL) {
+		return false;
+	}
+
+	VkApplicationInfo app_info = {};
+	app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	app_info.pApplicationName = "ems_compositor_bench";
+	app_info.apiVersion = VK_MAKE_VERSION(1, 0, 0);
+
+	VkInstanceCreateInfo create_info = {};
+	create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	create_info.pApplicationInfo = &app_info;
+
+	VkInstance instance = VK_NULL_HANDLE;
+	if (create_instance(&create_info, NULL, &instance) != VK_SUCCESS) {
+		return false;
+	}
+
+	PFN_vkEnumeratePhysicalDevices enumerate_physical_devices =
+	    (PFN_vkEnumeratePhysicalDevices)vkGetInstanceProcAddr(instance, "vkEnumeratePhysicalDevices");
+	PFN_vkDestroyInstance destroy_instance =
+	    (PFN_vkDestroyInstance)vkGetInstanceProcAddr(instance, "vkDestroyInstance");
+
+	uint32_t count = 0;
+	VkResult ret = VK_ERROR_INITIALIZATION_FAILED;
+	if (enumerate_physical_devices != NULL) {
+		ret = enumerate_physical_devices(instance, &count, NULL);
+	}
+
+	if (destroy_instance != NULL) {
+		destroy_instance(instance, NULL);
+	}
+
+	return ret == VK_SUCCESS && count > 0;
+}
+
+/*!
+ * Clears a swapchain image to a colour that changes every frame, so the
+ * encoder does not get the same image over and over.
+ */
+static bool
+fill_image(struct ems_compositor *c, struct xrt_swapchain *xsc, uint32_t index, int64_t frame)
+{
+	struct vk_bundle *vk = &c->base.vk;
+	struct comp_swapchain *sc = comp_swapchain(xsc);
+	VkImage image = sc->vkic.images[index].handle;
+	VkCommandBuffer cmd = VK_NULL_HANDLE;
+	VkResult ret;
+
+	VkImageSubresourceRange range = {
+	    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+	    .baseMipLevel = 0,
+	    .levelCount = 1,
+	    .baseArrayLayer = 0,
+	    .layerCount = 1,
+	};
+
+	float t = (float)(frame % 120) / 120.f;
+	VkClearColorValue color = {{t, 1.f - t, 0.5f, 1.f}};
+
+	vk_cmd_pool_lock(&c->cmd_pool);
+
+	ret = vk_cmd_pool_create_and_begin_cmd_buffer_locked(vk, &c->cmd_pool, 0, &cmd);
+	if (ret != VK_SUCCESS) {
+		vk_cmd_pool_unlock(&c->cmd_pool);
+		U_LOG_E("vk_cmd_pool_create_and_begin_cmd_buffer_locked: %s", vk_result_string(ret));
+		return false;
+	}
+
+	// The compositor leaves swapchain images ready to be sampled.
+	vk_cmd_image_barrier_locked(                  //
+	    vk,                                       // vk_bundle
+	    cmd,                                      // cmdbuffer
+	    image,                                    // image
+	    VK_ACCESS_SHADER_READ_BIT,                // srcAccessMask
+	    VK_ACCESS_TRANSFER_WRITE_BIT,             // dstAccessMask
+	    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // oldImageLayout
+	    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,     // newImageLayout
+	    VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,       // srcStageMask
+	    VK_PIPELINE_STAGE_TRANSFER_BIT,           // dstStageMask
+	    range);                                   // subresourceRange
+
+	vk->vkCmdClearColorImage(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
+
+	vk_cmd_image_barrier_locked(                  //
+	    vk,                                       // vk_bundle
+	    cmd,                                      // cmdbuffer
+	    image,                                    // image
+	    VK_ACCESS_TRANSFER_WRITE_BIT,             // srcAccessMask
+	    VK_ACCESS_SHADER_READ_BIT,                // dstAccessMask
+	    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,     // oldImageLayout
+	    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // newImageLayout
+	    VK_PIPELINE_STAGE_TRANSFER_BIT,           // srcStageMask
+	    VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,       // dstStageMask
+	    range);                                   // subresourceRange
+
+	ret = vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked(vk, &c->cmd_pool, cmd);
+
+	vk_cmd_pool_unlock(&c->cmd_pool);
+
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked: %s", vk_result_string(ret));
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+render_view(struct ems_compositor *c, struct xrt_swapchain *xsc, int64_t frame, uint32_t *out_index)
+{
+	uint32_t index = 0;
+
+	if (xrt_swapchain_acquire_image(xsc, &index) != XRT_SUCCESS ||
+	    xrt_swapchain_wait_image(xsc, XRT_INFINITE_DURATION, index) != XRT_SUCCESS) {
+		U_LOG_E("Failed to get swapchain image!");
+		return false;
+	}
+
+	bool ret = fill_image(c, xsc, index, frame);
+
+	xrt_swapchain_release_image(xsc, index);
+
+	*out_index = index;
+
+	return ret;
+}
+
+/*!
+ * Renders and commits one frame, @p out_commit_ns is set to the time spent
+ * in layer_commit only, without the synthetic rendering around it.
+ */
+static bool
+commit_frame(struct ems_compositor *c,
+             struct xrt_device *head,
+             struct xrt_swapchain *xscs[2],
+             int64_t frame,
+             uint64_t *out_commit_ns)
+{
+	struct xrt_compositor *xc = &c->base.base.base;
+
+	int64_t frame_id = -1;
+	uint64_t wake_time_ns = 0;
+	uint64_t predicted_gpu_time_ns = 0;
+	uint64_t predicted_display_time_ns = 0;
+	uint64_t predicted_display_period_ns = 0;
+
+	xrt_comp_predict_frame(            //
+	    xc,                            //
+	    &frame_id,                     //
+	    &wake_time_ns,                 //
+	    &predicted_gpu_time_ns,        //
+	    &predicted_display_time_ns,    //
+	    &predicted_display_period_ns); //
+	xrt_comp_mark_frame(xc, frame_id, XRT_COMPOSITOR_FRAME_POINT_WOKE, os_monotonic_get_ns());
+	xrt_comp_begin_frame(xc, frame_id);
+
+	uint32_t indices[2];
+	for (uint32_t view = 0; view < 2; view++) {
+		if (!render_view(c, xscs[view], frame, &indices[view])) {
+			return false;
+		}
+	}
+
+	struct xrt_layer_frame_data frame_data = {};
+	frame_data.frame_id = frame_id;
+	frame_data.display_time_ns = predicted_display_time_ns;
+	frame_data.env_blend_mode = XRT_BLEND_MODE_OPAQUE;
+	xrt_comp_layer_begin(xc, &frame_data);
+
+	struct xrt_layer_data data = {};
+	data.type = XRT_LAYER_STEREO_PROJECTION;
+	data.name = XRT_INPUT_GENERIC_HEAD_POSE;
+	data.timestamp = predicted_display_time_ns;
+
+	struct xrt_layer_projection_view_data *vds[2] = {&data.stereo.l, &data.stereo.r};
+	for (uint32_t view = 0; view < 2; view++) {
+		vds[view]->sub.image_index = indices[view];
+		vds[view]->sub.array_index = 0;
+		vds[view]->sub.rect.extent.w = (int)c->settings.view_width;
+		vds[view]->sub.rect.extent.h = (int)c->settings.view_height;
+		vds[view]->fov = head->hmd->distortion.fov[view];
+		vds[view]->pose = (struct xrt_pose)XRT_POSE_IDENTITY;
+	}
+
+	xrt_comp_layer_stereo_projection(xc, head, xscs[0], xscs[1], &data);
+
+	uint64_t commit_start_ns = os_monotonic_get_ns();
+	xrt_result_t xret = xrt_comp_layer_commit(xc, XRT_GRAPHICS_SYNC_HANDLE_INVALID);
+	*out_commit_ns = os_monotonic_get_ns() - commit_start_ns;
+
+	return xret == XRT_SUCCESS;
+}
+
+//! Reads a "Vm*:" line from /proc/self/status, in kB.
+static long
+read_vm_status_kb(const char *key)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL) {
+		return -1;
+	}
+
+	char line[256];
+	long ret = -1;
+	size_t key_len = strlen(key);
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+			ret = strtol(line + key_len + 1, NULL, 10);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return ret;
+}
+
+static void
+print_results(struct ems_compositor *c,
+              const struct ems_comp_stage_timing stages[EMS_COMP_STAGE_COUNT],
+              uint64_t elapsed_ns,
+              uint64_t commit_total_ns)
+{
+	printf("Views %ux%u, encoded %ux%u, %d frames\n\n",              //
+	       c->settings.view_width, c->settings.view_height,           //
+	       c->settings.readback_width, c->settings.readback_height, //
+	       frame_count);
+
+	printf("%-16s %8s %10s %10s %10s\n", "stage", "count", "avg ms", "min ms", "max ms");
+	for (uint32_t i = 0; i < EMS_COMP_STAGE_COUNT; i++) {
+		const struct ems_comp_stage_timing *t = &stages[i];
+		double avg_ms = t->count > 0 ? time_ns_to_ms_f((int64_t)(t->total_ns / t->count)) : 0.0;
+
+		printf("%-16s %8" PRIu64 " %10.3f %10.3f %10.3f\n", //
+		       stage_names[i], t->count, avg_ms,               //
+		       time_ns_to_ms_f((int64_t)t->min_ns),           //
+		       time_ns_to_ms_f((int64_t)t->max_ns));
+	}
+
+	double elapsed_s = time_ns_to_s((int64_t)elapsed_ns);
+	printf("\nlayer_commit avg %.3f ms\n", time_ns_to_ms_f((int64_t)(commit_total_ns / (uint64_t)frame_count)));
+	printf("Achieved %.1f fps\n", (double)frame_count / elapsed_s);
+
+	// On a software driver GPU memory is host memory, so this covers it too.
+	printf("Memory: %ld kB resident, %ld kB peak\n", read_vm_status_kb("VmRSS"), read_vm_status_kb("VmHWM"));
+}
+
+static bool
+check_budget(const char *what, double value, double budget, bool is_minimum)
+{
+	if (budget <= 0.0) {
+		return true;
+	}
+
+	bool ok = is_minimum ? value >= budget : value <= budget;
+	printf("%s %.3f, %s %.3f: %s\n", what, value, is_minimum ? "minimum" : "budget", budget, ok ? "ok" : "FAILED");
+
+	return ok;
+}
+
+//! All budgets are checked, so a failing run shows every stage that went over.
+static bool
+check_budgets(const struct ems_comp_stage_timing stages[EMS_COMP_STAGE_COUNT],
+              uint64_t elapsed_ns,
+              uint64_t commit_total_ns)
+{
+	const struct ems_comp_stage_timing *convert = &stages[EMS_COMP_STAGE_CONVERT];
+	double commit_ms = time_ns_to_ms_f((int64_t)(commit_total_ns / (uint64_t)frame_count));
+	double convert_ms = convert->count > 0 ? time_ns_to_ms_f((int64_t)(convert->total_ns / convert->count)) : 0.0;
+	double fps = (double)frame_count / time_ns_to_s((int64_t)elapsed_ns);
+
+	printf("\n");
+
+	bool ok = true;
+	ok = check_budget("layer_commit avg ms", commit_ms, commit_budget_ms, false) && ok;
+	ok = check_budget("nv12 convert avg ms", convert_ms, convert_budget_ms, false) && ok;
+	ok = check_budget("fps", fps, min_fps, true) && ok;
+
+	return ok;
+}
+
+
+/*
+ *
+ * Main.
+ *
+ */
+
+int
+main(int argc, char *argv[])
+{
+	GError *error = NULL;
+	GOptionContext *context = g_option_context_new("- Electric Maple compositor benchmark");
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		U_LOG_E("Option parsing failed: %s", error->message);
+		g_error_free(error);
+		g_option_context_free(context);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if (frame_count <= 0) {
+		U_LOG_E("Need at least one frame to time.");
+		return 1;
+	}
+
+	set_size_options();
+
+	if (!have_vulkan_device()) {
+		U_LOG_W("No Vulkan driver with a device, skipping.");
+		return EXIT_SKIP;
+	}
+
+	struct xrt_instance *xinst = NULL;
+	struct xrt_system_devices *xsysd = NULL;
+	struct xrt_space_overseer *xso = NULL;
+
+	if (xrt_instance_create(NULL, &xinst) != XRT_SUCCESS ||
+	    xrt_instance_create_system(xinst, &xsysd, &xso, NULL) != XRT_SUCCESS) {
+		U_LOG_E("Failed to create the instance!");
+		return 1;
+	}
+
+	struct ems_instance *emsi = container_of(xinst, struct ems_instance, xinst_base);
+	struct xrt_device *head = xsysd->roles.head;
+
+	struct ems_compositor *c = NULL;
+	if (ems_compositor_create(*emsi, &c) != XRT_SUCCESS) {
+		U_LOG_E("Failed to create the compositor!");
+		return 1;
+	}
+
+	struct xrt_compositor *xc = &c->base.base.base;
+
+	struct xrt_swapchain_create_info info = {};
+	info.bits = (enum xrt_swapchain_usage_bits)(XRT_SWAPCHAIN_USAGE_COLOR | XRT_SWAPCHAIN_USAGE_SAMPLED |
+	                                            XRT_SWAPCHAIN_USAGE_TRANSFER_DST);
+	info.format = VK_FORMAT_R8G8B8A8_SRGB;
+	info.sample_count = 1;
+	info.width = c->settings.view_width;
+	info.height = c->settings.view_height;
+	info.face_count = 1;
+	info.array_size = 1;
+	info.mip_count = 1;
+
+	struct xrt_swapchain *xscs[2] = {};
+	for (uint32_t view = 0; view < 2; view++) {
+		if (xrt_comp_create_swapchain(xc, &info, &xscs[view]) != XRT_SUCCESS) {
+			U_LOG_E("Failed to create swapchain!");
+			return 1;
+		}
+	}
+
+	uint64_t interval_ns = commit_rate > 0.0 ? (uint64_t)(1e9 / commit_rate) : 0;
+	struct ems_comp_stage_timing stages[EMS_COMP_STAGE_COUNT];
+	uint64_t start_ns = 0;
+	uint64_t commit_total_ns = 0;
+	int ret = 0;
+
+	for (int64_t frame = 0; frame < warmup_count + frame_count; frame++) {
+		if (frame == warmup_count) {
+			// Throw away what the warmup frames accumulated.
+			ems_compositor_get_stage_timings(c, stages, true);
+			start_ns = os_monotonic_get_ns();
+		}
+
+		if (interval_ns > 0) {
+			uint64_t target_ns = start_ns + (uint64_t)(frame - warmup_count) * interval_ns;
+			uint64_t now_ns = os_monotonic_get_ns();
+			if (frame >= warmup_count && target_ns > now_ns) {
+				os_nanosleep((int64_t)(target_ns - now_ns));
+			}
+		}
+
+		uint64_t commit_ns = 0;
+		if (!commit_frame(c, head, xscs, frame, &commit_ns)) {
+			ret = 1;
+			break;
+		}
+		if (frame >= warmup_count) {
+			commit_total_ns += commit_ns;
+		}
+	}
+
+	uint64_t elapsed_ns = os_monotonic_get_ns() - start_ns;
+
+	if (ret == 0) {
+		ems_compositor_get_stage_timings(c, stages, false);
+		print_results(c, stages, elapsed_ns, commit_total_ns);
+
+		if (!check_budgets(stages, elapsed_ns, commit_total_ns)) {
+			ret = 1;
+		}
+	}
+
+	xrt_swapchain_reference(&xscs[0], NULL);
+	xrt_swapchain_reference(&xscs[1], NULL);
+	xrt_comp_destroy(&xc);
+	xrt_space_overseer_destroy(&xso);
+	xrt_system_devices_destroy(&xsysd);
+	xrt_instance_destroy(&xinst);
+
+	return ret;
+}
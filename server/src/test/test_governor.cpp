@@ -0,0 +1,112 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ */
+
+#include "catch2/catch_test_macros.hpp"
+
+#include "ems_governor.h"
+
+#include <cstdint>
+
+namespace {
+
+constexpr uint64_t kIntervalNs = 10'000'000;
+
+// Either side of the step down (0.9) and step up (0.45) loads.
+constexpr uint64_t kOverloadedNs = kIntervalNs * 95 / 100;
+constexpr uint64_t kBusyNs = kIntervalNs * 60 / 100;
+constexpr uint64_t kIdleNs = kIntervalNs * 20 / 100;
+
+// Frames at a new level before stepping down again and before stepping up.
+constexpr uint32_t kSettleFrames = 30;
+constexpr uint32_t kStepUpFrames = 180;
+
+// Feeds the same frame until the level changes, returns how many frames that took, zero if it didn't in @p max.
+uint32_t framesUntilChange(ems_governor &g, uint64_t busyNs, uint64_t dropped, uint32_t max) {
+  for (uint32_t i = 1; i <= max; i++) {
+    if (ems_governor_update(&g, busyNs, dropped)) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+void checkLevel(ems_governor &g, float scale, uint32_t divisor) {
+  ems_governor_level level = ems_governor_get_level(&g);
+  CHECK(level.scale == scale);
+  CHECK(level.frame_divisor == divisor);
+}
+
+} // namespace
+
+TEST_CASE("Governor") {
+  ems_governor g{};
+  REQUIRE(ems_governor_init(&g, kIntervalNs) == 0);
+
+  checkLevel(g, 1.0f, 1);
+
+  SECTION("Holds the level between the thresholds") {
+    CHECK(framesUntilChange(g, kBusyNs, 0, 1000) == 0);
+    checkLevel(g, 1.0f, 1);
+  }
+
+  SECTION("Steps down once settled") {
+    CHECK(framesUntilChange(g, kOverloadedNs, 0, 1000) == kSettleFrames);
+    checkLevel(g, 0.75f, 1);
+
+    INFO("Each new level settles before the next step");
+    CHECK(framesUntilChange(g, kOverloadedNs, 0, 1000) == kSettleFrames);
+    checkLevel(g, 0.5f, 1);
+
+    INFO("Halving the frame rate doubles the budget");
+    CHECK(framesUntilChange(g, kOverloadedNs, 0, 1000) == kSettleFrames);
+    checkLevel(g, 0.5f, 2);
+    CHECK(framesUntilChange(g, kOverloadedNs, 0, 1000) == 0);
+
+    INFO("Stays at the bottom of the ladder");
+    CHECK(framesUntilChange(g, kIntervalNs * 3, 0, 1000) == 0);
+    checkLevel(g, 0.5f, 2);
+  }
+
+  SECTION("Steps down on dropped frames") {
+    uint64_t dropped = 0;
+    for (uint32_t i = 1; i < kSettleFrames; i++) {
+      INFO("Not settled at frame " << i);
+      CHECK_FALSE(ems_governor_update(&g, kIdleNs, ++dropped));
+    }
+    CHECK(ems_governor_update(&g, kIdleNs, ++dropped));
+    checkLevel(g, 0.75f, 1);
+
+    INFO("The same count is no new drop");
+    CHECK(framesUntilChange(g, kBusyNs, dropped, 1000) == 0);
+  }
+
+  SECTION("Steps up after a long stretch of headroom") {
+    REQUIRE(framesUntilChange(g, kOverloadedNs, 0, 1000) == kSettleFrames);
+    checkLevel(g, 0.75f, 1);
+
+    CHECK(framesUntilChange(g, kIdleNs, 0, 1000) == kStepUpFrames);
+    checkLevel(g, 1.0f, 1);
+
+    INFO("Already at full quality");
+    CHECK(framesUntilChange(g, kIdleNs, 0, 1000) == 0);
+  }
+
+  SECTION("A drop restarts the wait for headroom") {
+    for (uint32_t i = 0; i < 3; i++) {
+      REQUIRE(framesUntilChange(g, kIntervalNs * 3, 0, 1000) == kSettleFrames);
+    }
+    checkLevel(g, 0.5f, 2);
+
+    CHECK(framesUntilChange(g, kIdleNs, 0, 100) == 0);
+    CHECK_FALSE(ems_governor_update(&g, kIdleNs, 1));
+
+    // Counted from the settle point, not from the start of the level.
+    CHECK(framesUntilChange(g, kIdleNs, 1, 1000) == kStepUpFrames - kSettleFrames);
+    checkLevel(g, 0.5f, 1);
+  }
+
+  ems_governor_fini(&g);
+}
@@ -14,6 +14,7 @@
 #include <json-glib/json-glib.h>
 #include "stdio.h"
 #include "util/u_logging.h"
+#include "em_data_channels.h"
 
 static gchar *websocket_uri = NULL;
 
@@ -83,6 +84,16 @@ static void
 webrtc_on_data_channel_cb(GstElement *webrtcbin, GstWebRTCDataChannel *data_channel, void *user_data)
 {
 	guint timeout_src_id;
+	gchar *label = NULL;
+
+	// We only talk on the control channel.
+	g_object_get(data_channel, "label", &label, NULL);
+	gboolean is_control = g_strcmp0(label, EM_DATA_CHANNEL_CONTROL) == 0;
+	g_free(label);
+
+	if (!is_control) {
+		return;
+	}
 
 	U_LOG_I("Successfully created datachannel");
 